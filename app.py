@@ -5,6 +5,7 @@ import asyncio
 import concurrent
 import datetime
 import jinja2
+import json
 import logging
 import os
 
@@ -20,6 +21,9 @@ ROOT_DIRECTORY = os.path.dirname(os.path.realpath(__file__))
 
 DATABASE_PATH = "./blabber.db"             # File path of our database file
 DATABASE_CACHE_SIZE = (10 * 2**20) // 4096; # Memory cache size (unit is blocks of 4 KiB)
+DATABASE_WORKERS = 8                        # Number of threads executing database operations
+DATABASE_MAX_PENDING = 1000                 # Maximum number of pending database operations
+DATABASE_SYNC_MODE = "full"                 # "full", "periodic" or "none" (see blabber_database.Database)
 
 
 # Called from html templates
@@ -55,16 +59,24 @@ class BlabberHandlers:
         # Database state
         self._dbexec = concurrent.futures.ThreadPoolExecutor(max_workers = 1)
         self._dbpending = 0
-
-    # Run the database operations in a worker thread so we don't block other network I/O.
-    # The database does not support multithreading right now, so more than one worker would be useless.
-    # We only allow a maximum number of pending operations in case our database is too slow
-    # to handle the incoming requests (they would queue up without bounds otherwise).
+        self._dbpending_max = 0
+
+    # Waits for an operation of the asynchronous database API (the *_async methods).
+    # These operations are executed by worker threads of the database module, which
+    # also rejects new operations when DATABASE_MAX_PENDING operations are already pending.
+    # Concurrent writes are committed in groups (one journal sync for many writes).
+    async def _dbasync(self, db, future):
+        self._dbpending_max = max(self._dbpending_max, db.async_pending())
+        return await future
+
+    # Runs a database operation that has no asynchronous variant (maintenance and debugging)
+    # in a worker thread so we don't block other network I/O.
     async def _dbop(self, op):
-        if self._dbpending > 1000:
+        if self._dbpending > 100:
             raise RuntimeError("Too many pending db queries.")
 
         self._dbpending += 1
+        self._dbpending_max = max(self._dbpending_max, self._dbpending)
         try:
             return await self._loop.run_in_executor(self._dbexec, op)
         finally:
@@ -97,13 +109,13 @@ class BlabberHandlers:
 
     async def _show_index_impl(self, request, existing_form):
         db = request.app["db"]
-        frontpage = await self._dbop(lambda: db.fetch_frontpage(max_posts = 100))
+        frontpage = await self._dbasync(db, db.fetch_frontpage_async(max_posts = 100))
         form = dict()
         return self._render_html("index.html", frontpage = frontpage, form = existing_form)
 
     async def _show_post_impl(self, request, post_id, existing_form):
         db = request.app["db"]
-        post = await self._dbop(lambda: db.fetch_post(post_id = post_id, max_comments = 100))
+        post = await self._dbasync(db, db.fetch_post_async(post_id = post_id, max_comments = 100))
 
         if post is None:
             raise web.HTTPNotFound()
@@ -144,7 +156,7 @@ class BlabberHandlers:
             }
             return await self._show_index_impl(request, form)
 
-        post_id = await self._dbop(lambda: db.create_post(user = user, title = title, content = content))
+        post_id = await self._dbasync(db, db.create_post_async(user = user, title = title, content = content))
         raise web.HTTPFound(self._post_location(post_id))
 
     async def submit_comment(self, request):
@@ -170,11 +182,34 @@ class BlabberHandlers:
             }
             return await self._show_post_impl(request, post_id, form)
 
-        ok = await self._dbop(lambda: db.create_comment(post_id = post_id, user = user, content = content))
+        ok = await self._dbasync(db, db.create_comment_async(post_id = post_id, user = user, content = content))
         if not ok:
             raise web.HTTPNotFound()
         raise web.HTTPFound(self._post_location(post_id))
 
+    # Returns the number of pending database operations and the database statistics as json.
+    # `pending_max` is the largest number of pending operations since the last call.
+    async def stats(self, request):
+        db = request.app["db"]
+        pending = db.async_pending() + self._dbpending
+        pending_max, self._dbpending_max = self._dbpending_max, pending
+        stats = await self._dbop(lambda: db.stats())
+        result = {
+            "pending": pending,
+            "pending_max": pending_max,
+            "database": stats,
+        }
+        return web.Response(content_type = "application/json", text = json.dumps(result))
+
+    # Returns the latency histograms of the database in the Prometheus text format.
+    async def metrics(self, request):
+        db = request.app["db"]
+        text = db.metrics_text()
+        text += "# HELP blabber_pending_operations Database operations waiting for a worker.\n"
+        text += "# TYPE blabber_pending_operations gauge\n"
+        text += "blabber_pending_operations {}\n".format(db.async_pending() + self._dbpending)
+        return web.Response(content_type = "text/plain", text = text)
+
     async def dump(self, request):
         db = request.app["db"]
         data = await self._dbop(lambda: db.dump())
@@ -184,7 +219,12 @@ class BlabberHandlers:
 def main():
 
     async def run_database(app):
-        app["db"] = blabber_database.Database(DATABASE_PATH, DATABASE_CACHE_SIZE)
+        db = blabber_database.Database(DATABASE_PATH, DATABASE_CACHE_SIZE,
+                                       sync = DATABASE_SYNC_MODE,
+                                       async_workers = DATABASE_WORKERS,
+                                       async_max_pending = DATABASE_MAX_PENDING)
+        db.attach_event_loop(asyncio.get_event_loop())
+        app["db"] = db
         yield
         app["db"].finish()
 
@@ -198,6 +238,8 @@ def main():
         web.post("/post", blabber.submit_post, name = "submit_post"),
         web.get("/post/{post_id:\d+}", blabber.show_post, name = "show_post"),
         web.post("/post/{post_id:\d+}/comment", blabber.submit_comment, name = "submit_comment"),
+        web.get("/stats", blabber.stats, name = "stats"),
+        web.get("/metrics", blabber.metrics, name = "metrics"),
         web.get("/dump", blabber.dump, name = "dump"),
     ])
     app.router.add_static("/static", path = os.path.join(ROOT_DIRECTORY, "static"), name = "static")
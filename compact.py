@@ -0,0 +1,40 @@
+#!/usr/bin/env python3
+
+# Writes a compacted copy of a blabber database file.
+# The application must not be running while the source database is being compacted.
+#
+# Usage: ./compact.py SOURCE DEST
+#
+# Replace the original database file with DEST afterwards.
+
+import argparse
+import sys
+
+# This is our native database module
+import blabber_database
+
+DATABASE_CACHE_SIZE = (64 * 2**20) // 4096 # Memory cache size (unit is blocks of 4 KiB)
+
+
+def main():
+    parser = argparse.ArgumentParser(description = "Write a compacted copy of a blabber database.")
+    parser.add_argument("source", help = "path of the existing database file")
+    parser.add_argument("dest", help = "path of the new database file (must not exist)")
+    args = parser.parse_args()
+
+    db = blabber_database.Database(args.source, DATABASE_CACHE_SIZE)
+    try:
+        stats = db.compact(dest_path = args.dest)
+    finally:
+        db.finish()
+
+    print("Copied {} posts and {} comments in {:.2f} seconds.".format(
+        stats["posts"], stats["comments"], stats["seconds"]))
+    print("File size: {} bytes -> {} bytes.".format(stats["source_bytes"], stats["dest_bytes"]))
+    if stats["adjusted_timestamps"]:
+        print("Raised the creation time of {} posts to keep posts sorted by time.".format(
+            stats["adjusted_timestamps"]))
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,118 @@
+#include "async_queue.hpp"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace blabber {
+
+async_queue::async_queue(size_t workers, size_t max_pending)
+    : m_max_pending(max_pending) {
+    if (workers == 0) {
+        throw std::invalid_argument("The number of async workers must not be zero.");
+    }
+
+    m_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_event_fd == -1) {
+        throw std::system_error(errno, std::system_category(), "Failed to create an eventfd");
+    }
+
+    try {
+        for (size_t i = 0; i < workers; ++i) {
+            m_workers.emplace_back([this] { worker_main(); });
+        }
+    } catch (...) {
+        stop();
+        ::close(m_event_fd);
+        throw;
+    }
+}
+
+async_queue::~async_queue() {
+    stop();
+    ::close(m_event_fd);
+}
+
+bool async_queue::submit(std::unique_ptr<async_operation>& op) {
+    {
+        std::lock_guard lock(m_mutex);
+        if (m_stop || m_pending >= m_max_pending)
+            return false;
+
+        m_queue.push_back(std::move(op));
+        m_pending += 1;
+    }
+    m_wakeup.notify_one();
+    return true;
+}
+
+size_t async_queue::drain() {
+    // Reset the counter first: operations that finish while we are draining
+    // make the descriptor readable again.
+    std::uint64_t value;
+    while (::read(m_event_fd, &value, sizeof(value)) == -1 && errno == EINTR) {
+    }
+
+    std::vector<std::unique_ptr<async_operation>> finished;
+    {
+        std::lock_guard lock(m_mutex);
+        finished.swap(m_finished);
+        m_pending -= finished.size();
+    }
+
+    for (auto& op : finished) {
+        try {
+            op->complete();
+        } catch (...) {
+            op->fail(std::current_exception());
+        }
+        op.reset();
+    }
+    return finished.size();
+}
+
+size_t async_queue::pending() const {
+    std::lock_guard lock(m_mutex);
+    return m_pending;
+}
+
+void async_queue::stop() {
+    {
+        std::lock_guard lock(m_mutex);
+        m_stop = true;
+    }
+    m_wakeup.notify_all();
+    for (std::thread& worker : m_workers) {
+        if (worker.joinable())
+            worker.join();
+    }
+}
+
+void async_queue::worker_main() {
+    std::unique_lock lock(m_mutex);
+    while (1) {
+        m_wakeup.wait(lock, [&] { return m_stop || !m_queue.empty(); });
+        if (m_queue.empty()) // Stopped and no more work.
+            return;
+
+        std::unique_ptr<async_operation> op = std::move(m_queue.front());
+        m_queue.pop_front();
+
+        lock.unlock();
+        op->run();
+        lock.lock();
+
+        m_finished.push_back(std::move(op));
+        const std::uint64_t one = 1;
+        while (::write(m_event_fd, &one, sizeof(one)) == -1 && errno == EINTR) {
+        }
+    }
+}
+
+} // namespace blabber
@@ -0,0 +1,89 @@
+#ifndef BLABBER_ASYNC_QUEUE_HPP
+#define BLABBER_ASYNC_QUEUE_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace blabber {
+
+/*
+ * An operation executed by an async_queue.
+ * `run()` is called on a worker thread, `complete()` later on the thread that calls
+ * async_queue::drain(). The operation is destroyed after complete() has returned.
+ */
+class async_operation {
+public:
+    virtual ~async_operation() = default;
+
+    // Executes the operation. Must not throw.
+    virtual void run() noexcept = 0;
+
+    // Delivers the result of run().
+    virtual void complete() = 0;
+
+    // Called instead when complete() throws. Must not throw.
+    virtual void fail(std::exception_ptr error) noexcept = 0;
+};
+
+/*
+ * A bounded queue of operations that are executed by a fixed number of worker threads.
+ * Finished operations are collected until they are drained by the owner of the queue,
+ * which is notified through a file descriptor that becomes readable (an eventfd), so that
+ * the queue can be integrated into an event loop without an additional thread.
+ */
+class async_queue {
+public:
+    // Starts `workers` threads. At most `max_pending` operations can be submitted
+    // (i.e. queued or running) at the same time.
+    explicit async_queue(size_t workers, size_t max_pending);
+
+    // Stops the workers (see stop()). Finished operations are destroyed without
+    // being completed.
+    ~async_queue();
+
+    async_queue(const async_queue&) = delete;
+    async_queue& operator=(const async_queue&) = delete;
+
+    // Readable when there are finished operations. Reset by drain().
+    int notify_fd() const { return m_event_fd; }
+
+    // Queues the operation. Returns false (and does not take ownership) if the queue is full
+    // or has been stopped.
+    bool submit(std::unique_ptr<async_operation>& op);
+
+    // Completes all finished operations and returns their number. Operations are completed
+    // in the order they finished. An exception thrown by one operation is passed to its
+    // fail() function and does not prevent the completion of the others.
+    size_t drain();
+
+    // Number of submitted operations that have not been drained yet.
+    size_t pending() const;
+
+    // Executes all queued operations, then stops the worker threads.
+    // Operations submitted afterwards are rejected. Finished operations must still be drained.
+    void stop();
+
+private:
+    void worker_main();
+
+private:
+    const size_t m_max_pending;
+    int m_event_fd = -1;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_wakeup;
+    bool m_stop = false;
+    size_t m_pending = 0;
+    std::deque<std::unique_ptr<async_operation>> m_queue;
+    std::vector<std::unique_ptr<async_operation>> m_finished;
+    std::vector<std::thread> m_workers;
+};
+
+} // namespace blabber
+
+#endif // BLABBER_ASYNC_QUEUE_HPP
@@ -0,0 +1,431 @@
+/*
+ * Native benchmark of the database. Drives `blabber::database` directly (without python),
+ * i.e. the same code as the database module, including group commit, the result caches,
+ * background checkpoints and snapshot reads.
+ *
+ * Usage: blabber_bench [--option=value...]
+ *
+ *  --workload=NAME         insert, frontpage, hot-comments, read-posts or mixed (default: mixed)
+ *  --path=PATH             database file, will be overwritten (default: ./blabber-bench.db)
+ *  --ops=N                 number of measured operations (default: 100000)
+ *  --threads=N             number of threads executing the operations (default: 1)
+ *  --posts=N               posts created before the measurement (default: 10000)
+ *  --comments=N            comments per post created before the measurement (default: 10)
+ *  --hot-posts=N           number of posts targeted by hot-comments (default: 10)
+ *  --hot-comments=N        additional comments of every hot post (default: 5000)
+ *  --content-size=N        content size of posts in bytes (default: 2000)
+ *  --comment-size=N        content size of comments in bytes, 0 for random sizes between
+ *                          10 and 209 bytes (default: 0)
+ *  --cache-blocks=N        block cache size (default: 2560, i.e. 10 MiB)
+ *  --frontpage-cache=N     front page cache size in entries, 0 disables (default: 100)
+ *  --post-cache=N          post cache size in bytes, 0 disables (default: 8388608)
+ *  --user-cache=N          number of cached user names, 0 disables (default: 100000)
+ *  --compression=N         compression threshold in bytes, 0 disables (default: 512)
+ *  --checkpoint-threshold=N
+ *                          journal size in bytes that triggers a checkpoint (default: 1048576)
+ *  --snapshots=0|1         read only operations read snapshots of the database file
+ *                          instead of using the engine and its block cache (default: 1)
+ *  --mmap=0|1              snapshot reads use a memory mapping instead of system calls,
+ *                          the block cache shrinks to an eighth (default: 0)
+ *  --sync=MODE             full, periodic or none (default: none)
+ *  --seed=N                random seed (default: 1)
+ *
+ * The result caches serve most reads of the read workloads. Disable them to measure
+ * the storage layer (e.g. --post-cache=0 --frontpage-cache=0).
+ */
+
+#include "database.hpp"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <exception>
+#include <functional>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace blabber;
+
+namespace {
+
+using bench_clock = std::chrono::steady_clock;
+
+constexpr u64 block_size = database::BLOCK_SIZE;
+
+struct options {
+    std::string workload = "mixed";
+    std::string path = "./blabber-bench.db";
+    u64 ops = 100000;
+    u64 threads = 1;
+    u64 posts = 10000;
+    u64 comments = 10;
+    u64 hot_posts = 10;
+    u64 hot_comments = 5000;
+    u64 content_size = 2000;
+    u64 comment_size = 0;
+    database_options db;
+    u64 seed = 1;
+};
+
+options parse_options(int argc, char** argv) {
+    options opts;
+    opts.db.cache_blocks = 2560;
+    opts.db.sync = sync_mode::none;
+
+    std::map<std::string, std::function<void(const std::string&)>> parsers;
+    auto number = [](u64& target) {
+        return [&target](const std::string& value) { target = std::stoull(value); };
+    };
+    auto number32 = [](u32& target) {
+        return [&target](const std::string& value) { target = std::stoul(value); };
+    };
+    parsers["workload"] = [&](const std::string& value) { opts.workload = value; };
+    parsers["path"] = [&](const std::string& value) { opts.path = value; };
+    parsers["ops"] = number(opts.ops);
+    parsers["threads"] = number(opts.threads);
+    parsers["posts"] = number(opts.posts);
+    parsers["comments"] = number(opts.comments);
+    parsers["hot-posts"] = number(opts.hot_posts);
+    parsers["hot-comments"] = number(opts.hot_comments);
+    parsers["content-size"] = number(opts.content_size);
+    parsers["comment-size"] = number(opts.comment_size);
+    parsers["cache-blocks"] = number32(opts.db.cache_blocks);
+    parsers["frontpage-cache"] = number32(opts.db.frontpage_cache_size);
+    parsers["post-cache"] = number(opts.db.post_cache_bytes);
+    parsers["user-cache"] = number32(opts.db.user_cache_size);
+    parsers["compression"] = number32(opts.db.compression_threshold);
+    parsers["checkpoint-threshold"] = number(opts.db.checkpoint_threshold);
+    parsers["snapshots"] = [&](const std::string& value) {
+        opts.db.snapshot_reads = std::stoul(value) != 0;
+    };
+    parsers["mmap"] = [&](const std::string& value) {
+        opts.db.mmap_reads = std::stoul(value) != 0;
+    };
+    parsers["seed"] = number(opts.seed);
+    parsers["sync"] = [&](const std::string& value) {
+        if (value == "full") {
+            opts.db.sync = sync_mode::full;
+        } else if (value == "periodic") {
+            opts.db.sync = sync_mode::periodic;
+        } else if (value == "none") {
+            opts.db.sync = sync_mode::none;
+        } else {
+            throw std::invalid_argument(fmt::format("Invalid sync mode: \"{}\".", value));
+        }
+    };
+
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const size_t eq = arg.find('=');
+        if (arg.compare(0, 2, "--") != 0 || eq == std::string::npos) {
+            throw std::invalid_argument(fmt::format("Invalid argument: \"{}\".", arg));
+        }
+
+        auto parser = parsers.find(arg.substr(2, eq - 2));
+        if (parser == parsers.end()) {
+            throw std::invalid_argument(fmt::format("Unknown option: \"{}\".", arg));
+        }
+        parser->second(arg.substr(eq + 1));
+    }
+    if (opts.posts == 0) {
+        throw std::invalid_argument("At least one post is required.");
+    }
+    if (opts.threads == 0) {
+        throw std::invalid_argument("At least one thread is required.");
+    }
+    return opts;
+}
+
+/*
+ * Generates the content of posts and comments. The text is made of random words,
+ * which makes it about as compressible as real text.
+ */
+class text_generator {
+public:
+    explicit text_generator(u64 seed)
+        : m_rng(seed) {
+        static const char* const words[] = {
+            "the",   "quick",    "brown",   "fox",      "jumps",     "over",   "lazy",
+            "dog",   "database", "storage", "block",    "cache",     "journal", "commit",
+            "post",  "comment",  "reply",   "thread",   "benchmark", "latency", "throughput",
+            "disk",  "memory",   "index",   "tree",     "heap",      "list",    "string",
+            "hello", "world",    "agree",   "disagree", "because",   "however", "maybe"};
+        m_words.assign(std::begin(words), std::end(words));
+    }
+
+    std::string text(size_t size) {
+        std::uniform_int_distribution<size_t> word(0, m_words.size() - 1);
+
+        std::string result;
+        result.reserve(size + 16);
+        while (result.size() < size) {
+            if (!result.empty())
+                result += ' ';
+            result += m_words[word(m_rng)];
+        }
+        result.resize(size);
+        return result;
+    }
+
+    std::string user() { return fmt::format("user{}", m_rng() % 1000); }
+
+    std::mt19937_64& rng() { return m_rng; }
+
+private:
+    std::mt19937_64 m_rng;
+    std::vector<std::string> m_words;
+};
+
+struct op_result {
+    std::vector<double> latencies; // seconds
+    io_stats database_io;
+    io_stats journal_io;
+    u64 snapshot_reads = 0;
+    u64 snapshot_fallbacks = 0;
+    double seconds = 0;
+};
+
+void print_result(const std::string& name, const op_result& result) {
+    std::vector<double> latencies = result.latencies;
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p) {
+        if (latencies.empty())
+            return 0.0;
+        size_t index = static_cast<size_t>(p * (latencies.size() - 1) + 0.5);
+        return latencies[index];
+    };
+
+    const double ops = latencies.size();
+    fmt::print("{}:\n", name);
+    fmt::print("  operations:     {}\n", latencies.size());
+    fmt::print("  seconds:        {:.3f}\n", result.seconds);
+    fmt::print("  ops/sec:        {:.0f}\n", result.seconds > 0 ? ops / result.seconds : 0.0);
+    fmt::print("  p50 latency:    {:.1f} us\n", percentile(0.50) * 1e6);
+    fmt::print("  p99 latency:    {:.1f} us\n", percentile(0.99) * 1e6);
+    fmt::print("  max latency:    {:.1f} us\n", percentile(1.0) * 1e6);
+    fmt::print("  blocks read:    {} (database), {} (journal)\n",
+               result.database_io.read_bytes / block_size,
+               result.journal_io.read_bytes / block_size);
+    fmt::print("  blocks written: {} (database), {} (journal)\n",
+               result.database_io.write_bytes / block_size,
+               result.journal_io.write_bytes / block_size);
+    fmt::print("  journal syncs:  {}\n", result.journal_io.syncs);
+    fmt::print("  snapshot reads: {} ({} fallbacks)\n", result.snapshot_reads,
+               result.snapshot_fallbacks);
+}
+
+io_stats difference(const io_stats& after, const io_stats& before) {
+    io_stats result;
+    result.reads = after.reads - before.reads;
+    result.read_bytes = after.read_bytes - before.read_bytes;
+    result.writes = after.writes - before.writes;
+    result.write_bytes = after.write_bytes - before.write_bytes;
+    result.syncs = after.syncs - before.syncs;
+    return result;
+}
+
+/*
+ * Executes `count` operations (`op(gen, index)`), each of them timed individually.
+ * The operations are distributed over `threads` threads, every thread uses its own
+ * text generator.
+ */
+template<typename Op>
+op_result measure(database& db, const options& opts, Op&& op) {
+    std::vector<std::vector<double>> latencies(opts.threads);
+    std::vector<std::exception_ptr> errors(opts.threads);
+    auto worker = [&](u64 thread) {
+        try {
+            text_generator gen(opts.seed + 1 + thread);
+            for (u64 i = thread; i < opts.ops; i += opts.threads) {
+                const bench_clock::time_point op_start = bench_clock::now();
+                op(gen, i);
+                const bench_clock::duration latency = bench_clock::now() - op_start;
+                latencies[thread].push_back(std::chrono::duration<double>(latency).count());
+            }
+        } catch (...) {
+            errors[thread] = std::current_exception();
+        }
+    };
+
+    const database_stats before = db.stats();
+    const bench_clock::time_point start = bench_clock::now();
+    std::vector<std::thread> threads;
+    for (u64 thread = 1; thread < opts.threads; ++thread) {
+        threads.emplace_back(worker, thread);
+    }
+    worker(0);
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    op_result result;
+    result.seconds = std::chrono::duration<double>(bench_clock::now() - start).count();
+    for (const std::exception_ptr& error : errors) {
+        if (error)
+            std::rethrow_exception(error);
+    }
+    for (const std::vector<double>& thread_latencies : latencies) {
+        result.latencies.insert(result.latencies.end(), thread_latencies.begin(),
+                                thread_latencies.end());
+    }
+
+    const database_stats after = db.stats();
+    result.database_io = difference(after.database_io, before.database_io);
+    result.journal_io = difference(after.journal_io, before.journal_io);
+    result.snapshot_reads = after.snapshot_reads - before.snapshot_reads;
+    result.snapshot_fallbacks = after.snapshot_fallbacks - before.snapshot_fallbacks;
+    return result;
+}
+
+// Returns a random post id in [1, max_id].
+u64 random_post(text_generator& gen, u64 max_id) {
+    return std::uniform_int_distribution<u64>(1, max_id)(gen.rng());
+}
+
+std::string comment_text(text_generator& gen, const options& opts) {
+    if (opts.comment_size > 0)
+        return gen.text(opts.comment_size);
+    return gen.text(10 + gen.rng()() % 200);
+}
+
+void create_post(database& db, text_generator& gen, const options& opts) {
+    db.create_post(gen.user(), gen.text(20), gen.text(opts.content_size));
+}
+
+void create_comment(database& db, text_generator& gen, const options& opts, u64 post_id) {
+    db.create_comment(post_id, gen.user(), comment_text(gen, opts));
+}
+
+// Creates the posts and comments that exist before the measurement starts.
+void populate(database& db, const options& opts) {
+    const bench_clock::time_point start = bench_clock::now();
+    text_generator gen(opts.seed);
+
+    // Bulk imports keep the population phase fast, only the measured operations run one by one.
+    const u64 batch_size = 1000;
+    for (u64 first = 1; first <= opts.posts; first += batch_size) {
+        const u64 last = std::min(opts.posts, first + batch_size - 1);
+
+        std::vector<database::new_post> posts;
+        for (u64 id = first; id <= last; ++id) {
+            posts.push_back({gen.user(), gen.text(20), gen.text(opts.content_size), {}});
+        }
+        db.insert_posts(posts);
+    }
+
+    auto new_comment = [&] {
+        post_result::comment_entry comment;
+        comment.created_at = current_timestamp();
+        comment.user = gen.user();
+        comment.content = comment_text(gen, opts);
+        return comment;
+    };
+
+    for (u64 first = 1; first <= opts.posts; first += batch_size) {
+        const u64 last = std::min(opts.posts, first + batch_size - 1);
+
+        std::map<u64, std::vector<post_result::comment_entry>> comments;
+        for (u64 id = first; id <= last; ++id) {
+            for (u64 i = 0; i < opts.comments; ++i) {
+                comments[id].push_back(new_comment());
+            }
+        }
+        db.insert_comments(comments);
+    }
+
+    const u64 hot_posts = std::min(opts.hot_posts, opts.posts);
+    for (u64 id = 1; id <= hot_posts; ++id) {
+        for (u64 first = 0; first < opts.hot_comments; first += batch_size) {
+            const u64 count = std::min(batch_size, opts.hot_comments - first);
+
+            std::map<u64, std::vector<post_result::comment_entry>> comments;
+            for (u64 i = 0; i < count; ++i) {
+                comments[id].push_back(new_comment());
+            }
+            db.insert_comments(comments);
+        }
+    }
+
+    fmt::print("populated {} posts ({} comments each, {} hot posts with {} more) in {:.3f} s\n",
+               opts.posts, opts.comments, hot_posts, opts.hot_comments,
+               std::chrono::duration<double>(bench_clock::now() - start).count());
+}
+
+void run(const options& opts) {
+    std::remove(opts.path.c_str());
+    std::remove((opts.path + "-journal").c_str());
+
+    database db(opts.path, opts.db);
+    populate(db, opts);
+
+    // Measurements start with an empty journal (all blocks are read from the database file).
+    db.checkpoint_now();
+    const database_stats stats = db.stats();
+    const char* reads = !opts.db.snapshot_reads ? "block cache"
+                        : opts.db.mmap_reads    ? "mmap snapshots"
+                                                : "file snapshots";
+    fmt::print("database size: {} MiB, block cache: {} MiB, reads: {}, threads: {}\n",
+               stats.size_bytes >> 20, (u64(stats.cache_blocks) * block_size) >> 20, reads,
+               opts.threads);
+
+    const u64 hot_posts = std::max<u64>(1, std::min(opts.hot_posts, opts.posts));
+
+    if (opts.workload == "insert") {
+        print_result("insert (1 post per 10 comments)",
+                     measure(db, opts, [&](text_generator& gen, u64 i) {
+                         if (i % 11 == 0) {
+                             create_post(db, gen, opts);
+                         } else {
+                             create_comment(db, gen, opts, random_post(gen, opts.posts));
+                         }
+                     }));
+    } else if (opts.workload == "frontpage") {
+        print_result("frontpage", measure(db, opts, [&](text_generator&, u64) {
+                         db.fetch_frontpage(100);
+                     }));
+    } else if (opts.workload == "hot-comments") {
+        print_result("hot-comments", measure(db, opts, [&](text_generator& gen, u64) {
+                         db.fetch_comments(random_post(gen, hot_posts), {}, 100);
+                     }));
+    } else if (opts.workload == "read-posts") {
+        print_result("read-posts", measure(db, opts, [&](text_generator& gen, u64) {
+                         db.fetch_post(random_post(gen, opts.posts), 100);
+                     }));
+    } else if (opts.workload == "mixed") {
+        // 80% post reads, 10% front page reads, 9% comments, 1% posts.
+        print_result("mixed", measure(db, opts, [&](text_generator& gen, u64) {
+                         const u64 choice = gen.rng()() % 100;
+                         if (choice < 80) {
+                             db.fetch_post(random_post(gen, opts.posts), 100);
+                         } else if (choice < 90) {
+                             db.fetch_frontpage(100);
+                         } else if (choice < 99) {
+                             create_comment(db, gen, opts, random_post(gen, opts.posts));
+                         } else {
+                             create_post(db, gen, opts);
+                         }
+                     }));
+    } else {
+        throw std::invalid_argument(fmt::format("Unknown workload: \"{}\".", opts.workload));
+    }
+
+    // Checkpoints (after flushing the journal) and removes the journal file.
+    db.finish();
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    try {
+        run(parse_options(argc, argv));
+        return 0;
+    } catch (const std::exception& e) {
+        fmt::print(stderr, "Error: {}\n", e.what());
+        return 1;
+    }
+}
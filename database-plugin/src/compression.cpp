@@ -0,0 +1,42 @@
+#include "compression.hpp"
+#include "storage.hpp"
+
+#include <fmt/format.h>
+#include <zlib.h>
+
+#include <limits>
+
+namespace blabber {
+
+std::optional<std::string> compress_string(const std::string& str) {
+    // uLong is only 32 bits wide on some platforms (e.g. 64-bit windows).
+    if constexpr (sizeof(size_t) > sizeof(uLong)) {
+        if (str.size() > std::numeric_limits<uLong>::max())
+            return {};
+    }
+
+    // compressBound() is the worst case, but we only keep results smaller than the input.
+    std::string result(compressBound(str.size()), '\0');
+    uLongf result_size = result.size();
+    int ret = compress2(reinterpret_cast<Bytef*>(&result[0]), &result_size,
+                        reinterpret_cast<const Bytef*>(str.data()), str.size(), Z_BEST_SPEED);
+    if (ret != Z_OK) {
+        throw database_error(fmt::format("Failed to compress a string (error {}).", ret));
+    }
+    if (result_size >= str.size())
+        return {};
+
+    result.resize(result_size);
+    return result;
+}
+
+void decompress_string(const byte* data, size_t size, std::string& target) {
+    uLongf target_size = target.size();
+    int ret = uncompress(reinterpret_cast<Bytef*>(&target[0]), &target_size,
+                         reinterpret_cast<const Bytef*>(data), size);
+    if (ret != Z_OK || target_size != target.size()) {
+        throw database_error(fmt::format("Failed to decompress a string (error {}).", ret));
+    }
+}
+
+} // namespace blabber
@@ -0,0 +1,23 @@
+#ifndef BLABBER_COMPRESSION_HPP
+#define BLABBER_COMPRESSION_HPP
+
+#include <prequel/defs.hpp>
+
+#include <optional>
+#include <string>
+
+namespace blabber {
+
+using namespace prequel::short_types;
+
+// Compresses the string (zlib format). Returns an empty optional if the compressed
+// representation would not be smaller than the original string.
+std::optional<std::string> compress_string(const std::string& str);
+
+// Decompresses `size` bytes at `data` into `target`. The target must already have
+// the size of the original string.
+void decompress_string(const byte* data, size_t size, std::string& target);
+
+} // namespace blabber
+
+#endif // BLABBER_COMPRESSION_HPP
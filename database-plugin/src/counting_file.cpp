@@ -0,0 +1,58 @@
+#include "counting_file.hpp"
+
+namespace blabber {
+
+io_stats io_counters::get() const {
+    io_stats stats;
+    stats.reads = m_reads.load(std::memory_order_relaxed);
+    stats.read_bytes = m_read_bytes.load(std::memory_order_relaxed);
+    stats.writes = m_writes.load(std::memory_order_relaxed);
+    stats.write_bytes = m_write_bytes.load(std::memory_order_relaxed);
+    stats.syncs = m_syncs.load(std::memory_order_relaxed);
+    return stats;
+}
+
+counting_file::counting_file(std::unique_ptr<prequel::file> inner, io_counters& counters)
+    : file(inner->get_vfs())
+    , m_inner(std::move(inner))
+    , m_counters(&counters) {}
+
+counting_file::~counting_file() {}
+
+bool counting_file::read_only() const noexcept {
+    return m_inner->read_only();
+}
+
+const char* counting_file::name() const noexcept {
+    return m_inner->name();
+}
+
+void counting_file::read(u64 offset, void* buffer, u32 count) {
+    m_inner->read(offset, buffer, count);
+    m_counters->add_read(count);
+}
+
+void counting_file::write(u64 offset, const void* buffer, u32 count) {
+    m_inner->write(offset, buffer, count);
+    m_counters->add_write(count);
+}
+
+u64 counting_file::file_size() {
+    return m_inner->file_size();
+}
+
+void counting_file::truncate(u64 size) {
+    m_inner->truncate(size);
+    m_counters->add_write(0);
+}
+
+void counting_file::sync() {
+    m_inner->sync();
+    m_counters->add_sync();
+}
+
+void counting_file::close() {
+    m_inner->close();
+}
+
+} // namespace blabber
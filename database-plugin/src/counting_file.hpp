@@ -0,0 +1,88 @@
+#ifndef BLABBER_COUNTING_FILE_HPP
+#define BLABBER_COUNTING_FILE_HPP
+
+#include <prequel/vfs.hpp>
+
+#include <atomic>
+#include <memory>
+
+namespace blabber {
+
+using namespace prequel::short_types;
+
+/*
+ * Counters of the I/O operations on a file.
+ */
+struct io_stats {
+    u64 reads = 0;
+    u64 read_bytes = 0;
+    u64 writes = 0;
+    u64 write_bytes = 0;
+    u64 syncs = 0;
+};
+
+/*
+ * Thread safe I/O counters. Can be read while the file is in use and
+ * outlive the files that update them.
+ */
+class io_counters {
+public:
+    io_counters() = default;
+
+    io_counters(const io_counters&) = delete;
+    io_counters& operator=(const io_counters&) = delete;
+
+    void add_read(u64 bytes) {
+        m_reads.fetch_add(1, std::memory_order_relaxed);
+        m_read_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    void add_write(u64 bytes) {
+        m_writes.fetch_add(1, std::memory_order_relaxed);
+        m_write_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    void add_sync() { m_syncs.fetch_add(1, std::memory_order_relaxed); }
+
+    // Number of writes so far (truncations included).
+    u64 writes() const { return m_writes.load(std::memory_order_relaxed); }
+
+    io_stats get() const;
+
+private:
+    std::atomic<u64> m_reads{0};
+    std::atomic<u64> m_read_bytes{0};
+    std::atomic<u64> m_writes{0};
+    std::atomic<u64> m_write_bytes{0};
+    std::atomic<u64> m_syncs{0};
+};
+
+/*
+ * Wraps a file and counts the I/O operations that reach it.
+ * The engine only reads blocks from disk when they are not in its cache, so the reads
+ * of the database file are the misses of the block cache.
+ * Truncations count as writes (of zero bytes), so every modification of the file
+ * changes the write counter.
+ */
+class counting_file final : public prequel::file {
+public:
+    explicit counting_file(std::unique_ptr<prequel::file> inner, io_counters& counters);
+    ~counting_file();
+
+    bool read_only() const noexcept override;
+    const char* name() const noexcept override;
+    void read(u64 offset, void* buffer, u32 count) override;
+    void write(u64 offset, const void* buffer, u32 count) override;
+    u64 file_size() override;
+    void truncate(u64 size) override;
+    void sync() override;
+    void close() override;
+
+private:
+    std::unique_ptr<prequel::file> m_inner;
+    io_counters* m_counters;
+};
+
+} // namespace blabber
+
+#endif // BLABBER_COUNTING_FILE_HPP
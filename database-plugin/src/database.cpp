@@ -1,142 +1,444 @@
-#include "storage.hpp"
+#include "database.hpp"
+#include "legacy_format.hpp"
 
-#include <prequel/container/default_allocator.hpp>
-#include <prequel/simple_file_format.hpp> // just for magic_header... FIXME move it
-#include <prequel/transaction_engine.hpp>
+#include <prequel/file_engine.hpp>
+#include <prequel/mmap_engine.hpp>
 #include <prequel/vfs.hpp>
 
-#include <pybind11/pybind11.h>
+#include <fmt/ostream.h>
 
-#include <memory>
-#include <mutex>
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
 #include <sstream>
+#include <type_traits>
 
 namespace blabber {
 
-namespace py = pybind11;
+// Size of the strings of a post and its comments (in bytes).
+static size_t string_bytes(const post_result& post) {
+    size_t bytes = post.user.size() + post.title.size() + post.content.size();
+    for (const auto& comment : post.comments) {
+        bytes += comment.user.size() + comment.content.size();
+    }
+    return bytes;
+}
+
+database::database(const std::string& path, const database_options& options)
+    : m_database_path(path)
+    , m_journal_path(path + "-journal")
+    , m_options(options)
+    , m_cache_blocks(options.cache_blocks)
+    , m_frontpage(options.frontpage_cache_size)
+    , m_post_cache(options.post_cache_bytes)
+    , m_user_cache(options.user_cache_size) {
+    if (m_options.group_commit_max_ops == 0) {
+        throw std::invalid_argument("The maximum group commit size must not be zero.");
+    }
+    if (m_options.sync == sync_mode::periodic && m_options.sync_interval.count() <= 0) {
+        throw std::invalid_argument("The sync interval must be positive.");
+    }
+    if (m_options.checkpoint_interval.count() < 0) {
+        throw std::invalid_argument("The checkpoint interval must not be negative.");
+    }
+    open();
+
+    m_background = std::thread([this] { background_main(); });
+}
+
+database::~database() {
+    stop_background();
+}
+
+// Called from constructor only.
+// Opens files, initializes the engine and accesses (or creates) the master block.
+void database::open() {
+    open_engine();
+
+    static_assert(prequel::serialized_offset<&master_block::header>() == 0,
+                  "Header must be at the beginning of the master block.");
+    if (m_engine->size() == 0) {
+        init_master_block();
+    } else if (u32 version = check_master_block(); version != FILE_FORMAT_VERSION) {
+        m_upgrade_stats = upgrade(version);
+    }
+    m_open = true;
+
+    if (m_engine->journal_has_changes()) {
+        // Snapshot reads do not know which posts have been changed by the recovered
+        // transactions, they remain disabled until the changes have been checkpointed.
+        request_checkpoint();
+    } else {
+        unblock_snapshots(true);
+    }
+
+    reload_frontpage_cache();
+}
+
+void database::reload_frontpage_cache() {
+    if (m_frontpage.capacity() > 0) {
+        run_read_transaction([&](const storage& store) {
+            m_frontpage.reset(store.fetch_frontpage(m_frontpage.capacity()));
+        });
+    }
+}
 
 /*
- * The database is the top level interface exposed to clients (i.e. the python code).
- *
- * All public member functions run in the context of a transaction and are therefore atomic.
+ * The background thread wakes up when a sync or a checkpoint is due. Syncs only touch the
+ * journal file (which supports concurrent flushes), so they run without taking the mutex.
+ * Checkpoints need exclusive access to the engine, but they are executed here instead of
+ * in the transaction that happened to push the journal over the threshold, see
+ * background_checkpoint().
  */
-class database {
-public:
-    explicit database(const std::string& path, u32 cache_blocks);
-    ~database();
+void database::background_main() {
+    using clock = std::chrono::steady_clock;
+
+    const bool periodic_sync = m_options.sync == sync_mode::periodic;
+    const bool periodic_checkpoint = m_options.checkpoint_interval.count() > 0;
+    clock::time_point next_sync = clock::now() + m_options.sync_interval;
+    clock::time_point next_checkpoint = clock::now() + m_options.checkpoint_interval;
+
+    std::unique_lock lock(m_background_mutex);
+    while (!m_background_stop) {
+        auto woken = [&] { return m_background_stop || m_checkpoint_requested; };
+        if (periodic_sync || periodic_checkpoint) {
+            clock::time_point deadline = periodic_sync ? next_sync : next_checkpoint;
+            if (periodic_sync && periodic_checkpoint)
+                deadline = std::min(next_sync, next_checkpoint);
+            m_background_wakeup.wait_until(lock, deadline, woken);
+        } else {
+            m_background_wakeup.wait(lock, woken);
+        }
+        if (m_background_stop)
+            break;
 
-    database(const database&) = delete;
-    database& operator=(const database&) = delete;
+        const clock::time_point now = clock::now();
+        const bool do_sync = periodic_sync && now >= next_sync;
+        const bool do_checkpoint =
+            m_checkpoint_requested || (periodic_checkpoint && now >= next_checkpoint);
+        m_checkpoint_requested = false;
 
-    // Todo: flag for disabling "sync on commit"
+        lock.unlock();
+        try {
+            if (do_sync)
+                m_journal_file->flush();
+            if (do_checkpoint)
+                background_checkpoint();
+        } catch (const std::exception& e) {
+            // The next attempt will try again. There is no one to report the error to.
+            fmt::print(stderr, "Background maintenance of the database failed: {}\n", e.what());
+        }
+        lock.lock();
 
-    u64 create_post(const std::string& user, const std::string& title, const std::string& content);
-    bool create_comment(u64 post_id, const std::string& user, const std::string& content);
-    py::list fetch_frontpage(size_t max_posts);
-    py::object fetch_post(u64 post_id, size_t max_comments);
+        if (do_sync)
+            next_sync = clock::now() + m_options.sync_interval;
+        if (do_checkpoint)
+            next_checkpoint = clock::now() + m_options.checkpoint_interval;
+    }
+}
 
-    // Called on a clean shutdown: performs a checkpoint and erases the journal.
-    void finish();
+void database::stop_background() {
+    {
+        std::lock_guard lock(m_background_mutex);
+        m_background_stop = true;
+    }
+    m_background_wakeup.notify_all();
+    if (m_background.joinable()) {
+        m_background.join();
+    }
+}
 
-    std::string dump();
+void database::request_checkpoint() {
+    {
+        std::lock_guard lock(m_background_mutex);
+        m_checkpoint_requested = true;
+    }
+    m_background_wakeup.notify_one();
+}
 
-private:
-    static constexpr const char FILE_FORMAT_MAGIC[] = "BLABBER_DB";
-    static constexpr u32 FILE_FORMAT_VERSION = 1;
+void database::open_engine() {
+    auto& vfs = prequel::system_vfs();
+    m_database_file = std::make_unique<counting_file>(
+        vfs.open(m_database_path.c_str(), vfs.read_write, vfs.open_create), m_database_io);
+    m_journal_file = std::make_unique<journal_file>(
+        std::make_unique<counting_file>(
+            vfs.open(m_journal_path.c_str(), vfs.read_write, vfs.open_create), m_journal_io),
+        m_options.sync);
+    create_engine();
+}
 
-    // At offset 0 in the file.
-    struct file_header {
-        prequel::magic_header magic;
-        u32 version = 0;
+void database::create_engine() {
+    m_engine.reset();
+    m_engine = std::make_unique<prequel::transaction_engine>(*m_database_file, *m_journal_file,
+                                                             BLOCK_SIZE, engine_cache_blocks());
+}
 
-        static constexpr auto get_binary_format() {
-            return prequel::binary_format(&file_header::magic, &file_header::version);
-        }
-    };
+/*
+ * With mmap reads, snapshot reads are served by the page cache of the operating system.
+ * A full sized block cache would keep a second copy of the same blocks. The engine only
+ * needs the blocks touched by writes (mostly the rightmost paths of the trees) and those
+ * of reads that depend on changes in the journal.
+ */
+u32 database::engine_cache_blocks() const {
+    if (m_options.mmap_reads && m_options.snapshot_reads)
+        return std::min(m_cache_blocks, std::max(m_cache_blocks / 8, u32(256)));
+    return m_cache_blocks;
+}
+
+/*
+ * The new database is written to "<path>-upgrade" and renamed to "<path>" once it is
+ * complete. The old file stays intact until then, so an interrupted upgrade simply
+ * starts over on the next open.
+ */
+copy_stats database::upgrade(u32 version) {
+    // Apply a recovered journal to the database file, which will be copied as a whole.
+    if (m_engine->journal_has_changes()) {
+        checkpoint();
+    }
 
-    // Full content of the first block.
-    struct master_block {
-        file_header header;
-        prequel::default_allocator::anchor alloc;
-        storage::anchor store;
+    const std::string upgrade_path = m_database_path + "-upgrade";
+    const std::string upgrade_journal_path = upgrade_path + "-journal";
+    std::remove(upgrade_path.c_str());
+    std::remove(upgrade_journal_path.c_str());
 
-        static constexpr auto get_binary_format() {
-            return prequel::binary_format(&master_block::header, &master_block::alloc,
-                                          &master_block::store);
+    copy_stats stats;
+    {
+        database dest(upgrade_path, copy_options());
+        switch (version) {
+        case 1:
+            copy_legacy_posts<v1::reader>(dest, stats);
+            break;
+        case 2:
+            copy_legacy_posts<v2::reader>(dest, stats);
+            break;
+        case 3:
+            copy_legacy_posts<v3::reader>(dest, stats);
+            break;
+        case 4:
+        case 5: // Versions 5 and 6 only added indexes to the storage anchor.
+        case 6:
+            copy_legacy_posts<v4::reader>(dest, stats);
+            break;
+        case 7:
+            copy_legacy_posts<v7::reader>(dest, stats);
+            break;
+        case 8: // Version 8 lacks the post counts of the search index.
+            copy_legacy_posts<storage>(dest, stats);
+            break;
+        default:
+            throw std::logic_error(fmt::format("Cannot upgrade from file version {}.", version));
         }
-    };
+        dest.finish();
+    }
 
-private:
-    void open();
-    void init_master_block();
-    void check_master_block();
-
-    static void check_header(const file_header& header);
-
-    /*
-     * Unlocks the python GIL and locks our mutex, then executes `fn`.
-     */
-    template<typename Func>
-    void exec(Func&& fn);
-
-    /*
-     * Like exec, but also starts a transaction. The transaction will be committed
-     * if `fn` returns without an exception, and will be rolled back otherwise.
-     */
-    template<typename Func>
-    void exec_transaction(Func&& fn);
-
-private:
-    // These values are constant after construction.
-    std::string m_database_path;
-    std::string m_journal_path;
-    u32 m_cache_blocks = 0;
-
-    // All public operations lock the mutex and release the GIL.
-    std::mutex m_mutex;
-
-    // Accessed while the mutex is locked.
-    bool m_open = false;
-    std::unique_ptr<prequel::file> m_database_file;
-    std::unique_ptr<prequel::file> m_journal_file;
-    std::unique_ptr<prequel::transaction_engine> m_engine;
-};
+    close_snapshots();
+    m_engine.reset();
+    m_journal_file.reset();
+    m_database_file.reset();
+    prequel::system_vfs().remove(m_journal_path.c_str());
+
+    if (std::rename(upgrade_path.c_str(), m_database_path.c_str()) != 0) {
+        throw database_error(fmt::format("Failed to replace the database file with \"{}\".",
+                                         upgrade_path));
+    }
+
+    open_engine();
+    if (u32 new_version = check_master_block(); new_version != FILE_FORMAT_VERSION) {
+        throw std::logic_error("Upgraded database has an unexpected file format version.");
+    }
+    return stats;
+}
+
+template<typename Reader>
+void database::copy_legacy_posts(database& dest, copy_stats& stats) {
+    using master_block_type = legacy_master_block<Reader>;
+    static_assert(prequel::serialized_offset<&master_block_type::header>() == 0,
+                  "Header must be at the beginning of the master block.");
+
+    m_engine->begin();
+    try {
+        auto first_block = m_engine->read(prequel::block_index(0));
+
+        master_block_type master = first_block.get<master_block_type>(0);
+        prequel::anchor_flag master_changed;
+        prequel::anchor_handle anchor(master, master_changed);
+        {
+            prequel::default_allocator alloc(anchor.template member<&master_block_type::alloc>(),
+                                             *m_engine);
+            Reader source(anchor.template member<&master_block_type::store>(), alloc);
+            copy_posts(source, dest, stats);
+        }
+    } catch (...) {
+        m_engine->rollback();
+        throw;
+    }
+    m_engine->rollback();
+}
 
 /*
- * A checkpoint operation is automatically executed when the journal
- * has grown to this many or more bytes.
+ * Only the merge of the journal into the database file holds the mutex. Writes and reads that
+ * depend on changes in the journal wait for it, snapshot reads only wait while the file is
+ * being written and cached results are served as usual. The journal is synced before the mutex
+ * is taken, while writes continue, so checkpoint() only has to sync the commits made since.
+ * The work done while holding the mutex is bounded by the checkpoint threshold because
+ * checkpoints are requested as soon as the journal grows beyond it.
  */
-static constexpr u64 journal_checkpoint_threshold = 1 << 20;
+void database::background_checkpoint() {
+    // The files are only closed after the background thread has been stopped.
+    m_journal_file->flush();
 
-database::database(const std::string& path, u32 cache_blocks)
-    : m_database_path(path)
-    , m_journal_path(path + "-journal")
-    , m_cache_blocks(cache_blocks) {
-    open();
+    std::lock_guard locked(m_mutex);
+    if (m_open && m_engine->journal_has_changes()) {
+        checkpoint();
+    }
 }
 
-database::~database() {}
+void database::checkpoint_now() {
+    exec([&] {
+        check_open();
+        if (m_engine->journal_has_changes()) {
+            checkpoint();
+        }
+    });
+}
 
-// Called from constructor only.
-// Opens files, initializes the engine and accesses (or creates) the master block.
-void database::open() {
-    auto& vfs = prequel::system_vfs();
-    m_database_file = vfs.open(m_database_path.c_str(), vfs.read_write, vfs.open_create);
-    m_journal_file = vfs.open(m_journal_path.c_str(), vfs.read_write, vfs.open_create);
-    m_engine = std::make_unique<prequel::transaction_engine>(*m_database_file, *m_journal_file,
-                                                             4096, m_cache_blocks);
+void database::checkpoint() {
+    using clock = std::chrono::steady_clock;
 
-    static_assert(prequel::serialized_offset<&master_block::header>() == 0,
-                  "Header must be at the beginning of the master block.");
-    if (m_engine->size() == 0) {
-        init_master_block();
+    const u64 journal_size = m_engine->journal_size();
+    const clock::time_point start = clock::now();
+
+    // The checkpoint relies on a durable journal if it is interrupted by a crash.
+    m_journal_file->flush();
+
+    // The checkpoint writes to the database file, which may also grow. If it fails,
+    // the content of the file is unknown.
+    block_snapshots();
+    try {
+        m_engine->checkpoint();
+    } catch (...) {
+        unblock_snapshots(false);
+        throw;
+    }
+    unblock_snapshots(true);
+
+    const clock::duration duration = clock::now() - start;
+    m_metrics.record_checkpoint(duration);
+
+    std::lock_guard lock(m_background_mutex);
+    blabber::checkpoint_stats& stats = m_checkpoint_stats;
+    stats.count += 1;
+    stats.total_duration += duration;
+    stats.last_duration = duration;
+    stats.max_duration = std::max<std::chrono::nanoseconds>(stats.max_duration, duration);
+    stats.last_journal_size = journal_size;
+}
+
+blabber::checkpoint_stats database::checkpoint_stats() {
+    std::lock_guard lock(m_background_mutex);
+    return m_checkpoint_stats;
+}
+
+std::unique_ptr<database::snapshot_view> database::acquire_snapshot_view() {
+    {
+        std::lock_guard lock(m_snapshot_mutex);
+        if (!m_snapshot_views.empty()) {
+            std::unique_ptr<snapshot_view> view = std::move(m_snapshot_views.back());
+            m_snapshot_views.pop_back();
+            return view;
+        }
+    }
+
+    auto& vfs = prequel::system_vfs();
+    auto view = std::make_unique<snapshot_view>();
+    view->file = std::make_unique<counting_file>(vfs.open(m_database_path.c_str(), vfs.read_only),
+                                                 m_database_io);
+    if (m_options.mmap_reads) {
+        view->engine = std::make_unique<prequel::mmap_engine>(*view->file, BLOCK_SIZE);
     } else {
-        check_master_block();
+        view->engine = std::make_unique<prequel::file_engine>(*view->file, BLOCK_SIZE,
+                                                              SNAPSHOT_VIEW_CACHE_BLOCKS);
     }
-    m_open = true;
+    return view;
+}
+
+bool database::snapshot_readable(const std::vector<u64>* posts) const {
+    switch (m_snapshot_state) {
+    case snapshot_state::current:
+        return true;
+    case snapshot_state::tracked:
+        return posts && std::none_of(posts->begin(), posts->end(), [&](u64 id) {
+                   return id >= m_first_new_post || m_changed_posts.count(id) > 0;
+               });
+    case snapshot_state::disabled:
+        return false;
+    }
+    return false;
+}
+
+void database::block_snapshots() {
+    std::unique_lock lock(m_snapshot_mutex);
+    m_snapshots_blocked = true;
+    m_snapshot_wakeup.wait(lock, [&] { return m_snapshot_readers == 0; });
+}
+
+void database::unblock_snapshots(bool file_current) {
+    // Closed without holding the lock.
+    std::vector<std::unique_ptr<snapshot_view>> views;
+    {
+        std::lock_guard lock(m_snapshot_mutex);
+        m_snapshot_state = file_current ? snapshot_state::current : snapshot_state::disabled;
+        m_changed_posts.clear();
+        m_first_new_post = u64(-1);
+        views.swap(m_snapshot_views);
+        m_snapshots_blocked = false;
+    }
+    m_snapshot_wakeup.notify_all();
+}
+
+void database::close_snapshots() {
+    block_snapshots();
+    unblock_snapshots(false);
+}
+
+void database::check_database_unmodified(u64 writes, const char* operation) const {
+    if (m_database_io.writes() != writes) {
+        throw std::logic_error(
+            fmt::format("The database file was modified outside of a checkpoint ({}).", operation));
+    }
+}
+
+void database::post_modified(u64 post_id) {
+    m_transaction_changes.modified.push_back(post_id);
+}
+
+void database::post_created(u64 post_id) {
+    // Post ids are increasing.
+    if (!m_transaction_changes.first_created)
+        m_transaction_changes.first_created = post_id;
+}
+
+void database::publish_changes() {
+    post_changes changes = std::move(m_transaction_changes);
+    m_transaction_changes = post_changes();
+    if (m_compaction_changes)
+        m_compaction_changes->insert(changes.modified.begin(), changes.modified.end());
+    if (!m_engine->journal_has_changes())
+        return;
+
+    std::lock_guard lock(m_snapshot_mutex);
+    if (m_snapshot_state == snapshot_state::disabled)
+        return;
+
+    m_snapshot_state = snapshot_state::tracked;
+    m_changed_posts.insert(changes.modified.begin(), changes.modified.end());
+    if (changes.first_created)
+        m_first_new_post = std::min(m_first_new_post, *changes.first_created);
 }
 
 void database::finish() {
+    stop_background();
+
     exec([&] {
         if (!m_open) {
             throw std::logic_error("database::finish() was already called.");
@@ -145,8 +447,9 @@ void database::finish() {
         m_open = false;
 
         if (m_engine->journal_has_changes()) {
-            m_engine->checkpoint();
+            checkpoint();
         }
+        close_snapshots();
         m_engine.reset();
         m_journal_file.reset();
         m_database_file.reset();
@@ -156,10 +459,16 @@ void database::finish() {
     });
 }
 
+bool database::is_open() {
+    bool open = false;
+    exec([&] { open = m_open; });
+    return open;
+}
+
 std::string database::dump() {
     std::ostringstream ss;
 
-    exec_transaction([&](storage& store) {
+    exec_read_transaction([&](const storage& store) {
         auto& alloc = dynamic_cast<prequel::default_allocator&>(store.get_allocator());
         fmt::print(ss, "Allocator state:\n");
         alloc.dump(ss);
@@ -173,63 +482,529 @@ std::string database::dump() {
 
 u64 database::create_post(const std::string& user, const std::string& title,
                           const std::string& content) {
-    u64 id = 0;
-    exec_transaction([&](storage& store) { id = store.create_post(user, title, content); });
-    return id;
+    frontpage_result::post_entry entry;
+    exec_write(
+        operation::create_post,
+        [&](storage& store) {
+            entry = store.create_post(user, title, content);
+            post_created(entry.id);
+        },
+        [&] { m_frontpage.insert(entry); });
+    return entry.id;
 }
 
 bool database::create_comment(u64 post_id, const std::string& user, const std::string& content) {
     try {
-        exec_transaction([&](storage& store) { store.create_comment(post_id, user, content); });
+        post_result::comment_entry entry;
+        exec_write(
+            operation::create_comment,
+            [&](storage& store) {
+                entry = store.create_comment(post_id, user, content);
+                post_modified(post_id);
+            },
+            [&] {
+                m_post_cache.insert_comment(post_id, entry);
+                m_frontpage.insert_comment(post_id, entry.created_at);
+            });
         return true;
     } catch (const not_found_error& e) {
         return false;
     }
 }
 
-py::list database::fetch_frontpage(size_t max_posts) {
+std::shared_ptr<const frontpage_entries> database::fetch_frontpage(size_t max_posts) {
+    const metrics_clock::time_point start = metrics_clock::now();
+    operation_timings timings;
+
+    // The cache is usually sufficient, it does not need the mutex.
+    std::shared_ptr<const frontpage_entries> result = m_frontpage.fetch(max_posts);
+    if (!result) {
+        exec_read_transaction(
+            [&](const storage& store) { result = share_entries(store.fetch_frontpage(max_posts)); },
+            &timings);
+    }
+
+    timings.total = metrics_clock::now() - start;
+    m_metrics.record(operation::fetch_frontpage, timings);
+    return result;
+}
+
+frontpage_result database::fetch_posts(std::optional<u64> before_id, size_t max_posts) {
     frontpage_result result;
-    exec_transaction([&](const storage& store) { result = store.fetch_frontpage(max_posts); });
+    exec_read_transaction(
+        [&](const storage& store) { result = store.fetch_posts(before_id, max_posts); });
+    return result;
+}
 
-    py::list entries;
-    for (const frontpage_result::post_entry& native_post : result.entries) {
-        py::dict post;
-        post["id"] = native_post.id;
-        post["created_at"] = native_post.created_at;
-        post["user"] = native_post.user;
-        post["title"] = native_post.title;
+frontpage_result database::fetch_posts_between(u64 start, u64 end, size_t max_posts,
+                                               std::optional<u64> before_id) {
+    frontpage_result result;
+    exec_read_transaction([&](const storage& store) {
+        result = store.fetch_posts_between(start, end, max_posts, before_id);
+    });
+    return result;
+}
+
+frontpage_result database::fetch_active_posts(size_t max_posts) {
+    frontpage_result result;
+    exec_read_transaction(
+        [&](const storage& store) { result = store.fetch_active_posts(max_posts); });
+    return result;
+}
+
+frontpage_result database::search(const std::string& query, size_t limit) {
+    const metrics_clock::time_point start = metrics_clock::now();
+    operation_timings timings;
+
+    frontpage_result result;
+    exec_read_transaction([&](const storage& store) { result = store.search(query, limit); },
+                          &timings);
+
+    timings.total = metrics_clock::now() - start;
+    m_metrics.record(operation::search, timings);
+    return result;
+}
+
+std::shared_ptr<const post_result> database::fetch_post(u64 post_id, size_t max_comments) {
+    const metrics_clock::time_point start = metrics_clock::now();
+    operation_timings timings;
 
-        entries.append(std::move(post));
+    std::shared_ptr<const post_result> result = m_post_cache.fetch(post_id, max_comments);
+    if (!result) {
+        try {
+            const std::vector<u64> posts{post_id};
+            std::shared_ptr<post_result> loaded;
+            exec_read(
+                &posts,
+                [&](const storage& store) {
+                    loaded = std::make_shared<post_result>(store.fetch_post(post_id, max_comments));
+                },
+                [&] {
+                    if (m_post_cache.max_bytes() > 0)
+                        m_post_cache.insert(loaded, max_comments);
+                },
+                &timings);
+            result = std::move(loaded);
+        } catch (const not_found_error&) {
+            // Reported as a null result.
+        }
     }
-    return entries;
+
+    timings.total = metrics_clock::now() - start;
+    m_metrics.record(operation::fetch_post, timings);
+    return result;
 }
 
-py::object database::fetch_post(u64 post_id, size_t max_comments) {
-    post_result result;
+std::optional<comments_result> database::fetch_comments(u64 post_id, std::optional<u64> before,
+                                                         size_t limit) {
+    std::optional<comments_result> result;
     try {
-        exec_transaction(
-            [&](const storage& store) { result = store.fetch_post(post_id, max_comments); });
+        const std::vector<u64> posts{post_id};
+        exec_read(
+            &posts,
+            [&](const storage& store) { result = store.fetch_comments(post_id, before, limit); },
+            [] {});
     } catch (const not_found_error& e) {
-        return py::none();
+        return {};
+    }
+    return result;
+}
+
+user_activity_result
+database::fetch_user_activity(const std::string& user, size_t limit,
+                              std::optional<user_activity_result::position> cursor) {
+    user_activity_result result;
+    exec_read_transaction([&](const storage& store) {
+        result = store.fetch_user_activity(user, limit, cursor);
+    });
+    return result;
+}
+
+/*
+ * Post ids are increasing, so every insertion happens at the rightmost leaf of the post tree,
+ * which stays in the cache for the whole batch. Only one transaction (and one sync)
+ * is needed per batch.
+ */
+std::vector<u64> database::insert_posts(const std::vector<new_post>& posts) {
+    std::vector<u64> ids;
+    exec([&] {
+        check_open();
+        run_transaction([&](storage& store) {
+            ids.clear();
+            for (const new_post& p : posts) {
+                ids.push_back(store.create_post(p.user, p.title, p.content, p.created_at).id);
+                post_created(ids.back());
+            }
+        });
+        reload_frontpage_cache();
+    });
+    return ids;
+}
+
+/*
+ * The comments are grouped by their post: every post is only read and updated
+ * once per batch. Comments of the same post keep their relative order.
+ */
+u64 database::insert_comments(
+    const std::map<u64, std::vector<post_result::comment_entry>>& comments) {
+    u64 missing = 0;
+    exec([&] {
+        check_open();
+        run_transaction([&](storage& store) {
+            missing = 0;
+            for (const auto& [post_id, post_comments] : comments) {
+                try {
+                    store.create_comments(post_id, post_comments);
+                    post_modified(post_id);
+                } catch (const not_found_error&) {
+                    missing += post_comments.size();
+                }
+            }
+        });
+
+        // Cached results would have to be updated once per comment. Drop them instead.
+        for (const auto& entry : comments) {
+            m_post_cache.erase(entry.first);
+        }
+        reload_frontpage_cache();
+    });
+    return missing;
+}
+
+/*
+ * Batches with writes are applied as a single write operation of a group commit,
+ * so they are atomic and share the commit with other writers. Reads within such a batch
+ * go to the storage because they must see the uncommitted changes of earlier operations.
+ * Read only batches try the caches first and load all misses in a single read transaction.
+ */
+std::vector<batch::result> database::execute_batch(const std::vector<batch::op>& ops) {
+    auto is_write = [](const batch::op& op) {
+        return std::holds_alternative<batch::create_post>(op) ||
+               std::holds_alternative<batch::create_comment>(op);
+    };
+
+    std::vector<batch::result> results(ops.size());
+    if (std::any_of(ops.begin(), ops.end(), is_write)) {
+        std::vector<frontpage_result::post_entry> new_posts;
+        std::vector<std::pair<u64, post_result::comment_entry>> new_comments;
+        exec_write(
+            operation::execute_batch,
+            [&](storage& store) {
+                // May be executed more than once.
+                new_posts.clear();
+                new_comments.clear();
+                for (size_t i = 0; i < ops.size(); ++i) {
+                    std::visit(
+                        [&](const auto& op) {
+                            using type = std::decay_t<decltype(op)>;
+                            if constexpr (std::is_same_v<type, batch::create_post>) {
+                                new_posts.push_back(
+                                    store.create_post(op.user, op.title, op.content));
+                                results[i] = new_posts.back().id;
+                                post_created(new_posts.back().id);
+                            } else if constexpr (std::is_same_v<type, batch::create_comment>) {
+                                try {
+                                    new_comments.emplace_back(
+                                        op.post_id,
+                                        store.create_comment(op.post_id, op.user, op.content));
+                                    results[i] = true;
+                                    post_modified(op.post_id);
+                                } catch (const not_found_error&) {
+                                    results[i] = false;
+                                }
+                            } else if constexpr (std::is_same_v<type, batch::fetch_frontpage>) {
+                                results[i] = share_entries(store.fetch_frontpage(op.max_posts));
+                            } else {
+                                std::shared_ptr<const post_result> post;
+                                try {
+                                    post = std::make_shared<const post_result>(
+                                        store.fetch_post(op.post_id, op.max_comments));
+                                } catch (const not_found_error&) {
+                                }
+                                results[i] = std::move(post);
+                            }
+                        },
+                        ops[i]);
+                }
+            },
+            [&] {
+                for (const auto& entry : new_posts)
+                    m_frontpage.insert(entry);
+                for (const auto& [post_id, entry] : new_comments) {
+                    m_post_cache.insert_comment(post_id, entry);
+                    m_frontpage.insert_comment(post_id, entry.created_at);
+                }
+            });
+        return results;
+    }
+
+    const metrics_clock::time_point start = metrics_clock::now();
+    operation_timings timings;
+
+    std::vector<size_t> misses;
+    for (size_t i = 0; i < ops.size(); ++i) {
+        if (auto op = std::get_if<batch::fetch_frontpage>(&ops[i])) {
+            if (auto cached = m_frontpage.fetch(op->max_posts)) {
+                results[i] = std::move(cached);
+                continue;
+            }
+        } else if (auto op = std::get_if<batch::fetch_post>(&ops[i])) {
+            if (auto cached = m_post_cache.fetch(op->post_id, op->max_comments)) {
+                results[i] = std::move(cached);
+                continue;
+            }
+        }
+        misses.push_back(i);
     }
 
-    py::dict post;
-    post["id"] = result.id;
-    post["created_at"] = result.created_at;
-    post["user"] = result.user;
-    post["title"] = result.title;
-    post["content"] = result.content;
+    if (!misses.empty()) {
+        // A snapshot read is possible if the posts have not been changed. Front pages
+        // depend on all posts.
+        std::vector<u64> posts;
+        bool all_posts = false;
+        for (size_t i : misses) {
+            if (auto op = std::get_if<batch::fetch_post>(&ops[i])) {
+                posts.push_back(op->post_id);
+            } else {
+                all_posts = true;
+            }
+        }
 
-    py::list comments;
-    for (const post_result::comment_entry& native_comment : result.comments) {
-        py::dict comment;
-        comment["created_at"] = native_comment.created_at;
-        comment["user"] = native_comment.user;
-        comment["content"] = native_comment.content;
-        comments.append(std::move(comment));
+        std::vector<std::shared_ptr<post_result>> loaded(ops.size());
+        exec_read(
+            all_posts ? nullptr : &posts,
+            [&](const storage& store) {
+                for (size_t i : misses) {
+                    if (auto op = std::get_if<batch::fetch_frontpage>(&ops[i])) {
+                        results[i] = share_entries(store.fetch_frontpage(op->max_posts));
+                        continue;
+                    }
+
+                    const auto& op = std::get<batch::fetch_post>(ops[i]);
+                    try {
+                        loaded[i] = std::make_shared<post_result>(
+                            store.fetch_post(op.post_id, op.max_comments));
+                    } catch (const not_found_error&) {
+                    }
+                    results[i] = std::shared_ptr<const post_result>(loaded[i]);
+                }
+            },
+            [&] {
+                if (m_post_cache.max_bytes() == 0)
+                    return;
+                for (size_t i : misses) {
+                    if (loaded[i])
+                        m_post_cache.insert(loaded[i],
+                                            std::get<batch::fetch_post>(ops[i]).max_comments);
+                }
+            },
+            &timings);
     }
-    post["comments"] = std::move(comments);
-    return post;
+
+    timings.total = metrics_clock::now() - start;
+    m_metrics.record(operation::execute_batch, timings);
+    return results;
+}
+
+/*
+ * The source is copied in batches of posts. Every batch is read by its own read only operation
+ * (a snapshot read if possible), and the mutex is not held while the destination is written.
+ * Posts that receive comments after they have been copied are recorded in
+ * m_compaction_changes. The final step holds the mutex: it copies the posts created in the
+ * meantime and appends the missing comments, so the result is a consistent copy of the
+ * database at that point. Its duration only depends on the number of changes made during the
+ * copy. The destination database is a separate instance that is only used by the copy.
+ */
+compact_stats database::compact(const std::string& dest_path) {
+    database_options dest_options;
+    exec([&] {
+        check_open();
+        if (m_compaction_changes) {
+            throw database_error("A compaction is already running.");
+        }
+        m_compaction_changes.emplace();
+        dest_options = copy_options();
+    });
+
+    compact_stats stats;
+    try {
+        database dest(dest_path, dest_options);
+        post_copier copier(dest, stats.copied);
+
+        // Posts with smaller ids have been copied.
+        u64 next_id = 0;
+        while (1) {
+            std::vector<post_result> posts;
+            exec_read_transaction([&](const storage& store) {
+                size_t bytes = 0;
+                for (auto id = store.find_next_post(next_id);
+                     id && posts.size() < post_copier::max_batch_posts &&
+                     bytes < post_copier::max_batch_bytes;
+                     id = store.find_next_post(*id + 1)) {
+                    posts.push_back(store.fetch_post(*id, size_t(-1)));
+                    bytes += string_bytes(posts.back());
+                }
+            });
+            if (posts.empty())
+                break;
+
+            next_id = posts.back().id + 1;
+            for (post_result& post : posts) {
+                copier.add(std::move(post));
+            }
+        }
+
+        exec([&] {
+            check_open();
+            run_read_transaction([&](const storage& store) {
+                for (auto id = store.find_next_post(next_id); id;
+                     id = store.find_next_post(*id + 1)) {
+                    copier.add(store.fetch_post(*id, size_t(-1)));
+                }
+                copier.flush();
+
+                // Comments are only ever appended: the newest ones are missing.
+                std::vector<std::pair<u64, std::vector<post_result::comment_entry>>> missing;
+                for (u64 post_id : *m_compaction_changes) {
+                    if (post_id >= next_id)
+                        continue;
+
+                    u64 copied = 0;
+                    dest.exec_read_transaction([&](const storage& dest_store) {
+                        copied = dest_store.fetch_post(post_id, 0).comment_count;
+                    });
+
+                    const u64 count = store.fetch_post(post_id, 0).comment_count;
+                    if (count > copied) {
+                        post_result post = store.fetch_post(post_id, count - copied);
+                        std::reverse(post.comments.begin(), post.comments.end());
+                        missing.emplace_back(post_id, std::move(post.comments));
+                        stats.copied.comments += count - copied;
+                    }
+                }
+                if (!missing.empty()) {
+                    dest.exec_transaction([&](storage& dest_store) {
+                        for (const auto& [post_id, comments] : missing) {
+                            dest_store.create_comments(post_id, comments);
+                        }
+                    });
+                }
+            });
+
+            stats.source_bytes = byte_size();
+            m_compaction_changes.reset();
+        });
+
+        dest.exec([&] { stats.dest_bytes = dest.byte_size(); });
+        dest.finish();
+    } catch (...) {
+        exec([&] { m_compaction_changes.reset(); });
+        throw;
+    }
+    return stats;
+}
+
+u64 database::byte_size() const {
+    return m_engine->size() * m_engine->block_size();
+}
+
+result_cache_stats database::cache_stats() const {
+    result_cache_stats stats;
+    stats.frontpage = m_frontpage.stats();
+    stats.posts = m_post_cache.stats();
+    stats.users = m_user_cache.stats();
+    return stats;
+}
+
+database_stats database::stats() {
+    database_stats stats;
+    exec([&] {
+        check_open();
+        stats.cache_blocks = engine_cache_blocks();
+        stats.size_bytes = byte_size();
+        stats.journal_bytes = m_engine->journal_size();
+    });
+    stats.snapshot_reads = m_snapshot_reads;
+    stats.snapshot_fallbacks = m_snapshot_fallbacks;
+    stats.database_io = m_database_io.get();
+    stats.journal_io = m_journal_io.get();
+    return stats;
+}
+
+void database::resize_cache(u32 cache_blocks) {
+    exec([&] {
+        check_open();
+        if (cache_blocks == m_cache_blocks)
+            return;
+
+        // The cache size of an engine is fixed. The new engine continues with the journal
+        // of the old one, but a checkpoint keeps its startup cheap.
+        if (m_engine->journal_has_changes()) {
+            checkpoint();
+        }
+        m_cache_blocks = cache_blocks;
+        create_engine();
+    });
+}
+
+database_options database::copy_options() const {
+    database_options options;
+    options.cache_blocks = m_cache_blocks;
+    options.sync = sync_mode::none; // Checkpoints and finish() still sync.
+    options.checkpoint_threshold = m_options.checkpoint_threshold;
+    options.frontpage_cache_size = 0;
+    options.post_cache_bytes = 0;
+    options.compression_threshold = m_options.compression_threshold;
+    return options;
+}
+
+template<typename Source>
+void database::copy_posts(const Source& source, database& dest, copy_stats& stats) {
+    post_copier copier(dest, stats);
+    for (auto id = source.find_next_post(0); id; id = source.find_next_post(*id + 1)) {
+        copier.add(source.fetch_post(*id, size_t(-1)));
+    }
+    copier.flush();
+}
+
+database::post_copier::post_copier(database& dest, copy_stats& stats)
+    : m_dest(dest)
+    , m_stats(stats) {
+    m_dest.exec_read_transaction([&](const storage& dest_store) {
+        if (dest_store.find_next_post(0)) {
+            throw database_error("The destination database is not empty.");
+        }
+    });
+}
+
+void database::post_copier::add(post_result post) {
+    if (post.created_at < m_latest_created_at) {
+        post.created_at = m_latest_created_at;
+        m_stats.adjusted_timestamps += 1;
+    }
+    m_latest_created_at = post.created_at;
+    m_stats.posts += 1;
+    m_stats.comments += post.comments.size();
+
+    m_batch_bytes += string_bytes(post);
+    m_batch.push_back(std::move(post));
+    if (m_batch_bytes >= max_batch_bytes || m_batch.size() >= max_batch_posts) {
+        flush();
+    }
+}
+
+void database::post_copier::flush() {
+    if (m_batch.empty())
+        return;
+
+    m_dest.exec_transaction([&](storage& dest_store) {
+        for (const post_result& post : m_batch) {
+            dest_store.import_post(post);
+            m_dest.post_created(post.id);
+        }
+    });
+    m_batch.clear();
+    m_batch_bytes = 0;
 }
 
 void database::init_master_block() {
@@ -247,40 +1022,49 @@ void database::init_master_block() {
         handle.set(0, master);
     }
     m_engine->commit();
-    m_engine->checkpoint();
+    checkpoint();
 }
 
-void database::check_master_block() {
+u32 database::check_master_block() {
     assert(m_engine->size() > 0);
 
+    file_header header;
     m_engine->begin();
     {
         auto handle = m_engine->read(prequel::block_index(0));
 
         // Check magic header before reinterpreting the block in the application later on.
-        file_header header = handle.get<file_header>(0);
+        header = handle.get<file_header>(0);
         check_header(header);
     }
     m_engine->commit();
+    return header.version;
+}
+
+void database::check_open() const {
+    if (!m_open) {
+        throw std::logic_error("Transactions cannot be started after the database has been shut down.");
+    }
 }
 
 void database::check_header(const file_header& header) {
     if (header.magic != prequel::magic_header(FILE_FORMAT_MAGIC)) {
         throw std::runtime_error("Invalid file (wrong magic header).");
     }
-    if (header.version != FILE_FORMAT_VERSION) {
+    if (header.version == 0 || header.version > FILE_FORMAT_VERSION) {
         throw std::runtime_error(
-            fmt::format("Unsupported version: File version is {} but only version {} is supported.",
+            fmt::format("Unsupported version: File version is {} but only versions up to {} are "
+                        "supported.",
                         header.version, FILE_FORMAT_VERSION));
     }
 }
 
 template<typename Func>
-void database::exec(Func&& fn) {
-    // Lock our own mutex and unlock the GIL for the duration of the function.
-    // Must not execute python code within `fn`.
-    py::gil_scoped_release release;
+void database::exec(Func&& fn, operation_timings* timings) {
+    const metrics_clock::time_point start = metrics_clock::now();
     std::unique_lock locked(m_mutex);
+    if (timings)
+        timings->lock_wait = metrics_clock::now() - start;
     fn();
 }
 
@@ -291,82 +1075,326 @@ void database::exec(Func&& fn) {
 template<typename Func>
 void database::exec_transaction(Func&& fn) {
     exec([&] {
-        if (!m_open) {
-            throw std::logic_error("Transactions cannot be started after the database has been shut down.");
+        check_open();
+        run_transaction(fn);
+    });
+}
+
+template<typename Func>
+void database::run_transaction(Func&& fn, operation_timings* timings) {
+    metrics_clock::time_point last = metrics_clock::now();
+    auto end_phase = [&](std::optional<metrics_clock::duration>& phase_duration) {
+        const metrics_clock::time_point now = metrics_clock::now();
+        phase_duration = now - last;
+        last = now;
+    };
+
+    const u64 database_writes = m_database_io.writes();
+    m_transaction_changes = post_changes();
+    m_engine->begin();
+    try {
+        if (timings)
+            end_phase(timings->begin);
+
+        /*
+         * TODO: Currently, all block references must be released
+         * before either commit() or rollback() can be called.
+         * with_storage() destroys all objects (and their block references)
+         * before it returns, so commit() below is safe.
+         */
+        with_storage(*m_engine, true, fn);
+        if (timings)
+            end_phase(timings->storage);
+        m_engine->commit();
+        if (timings)
+            end_phase(timings->commit);
+    } catch (...) {
+        m_engine->rollback();
+        throw;
+    }
+    publish_changes();
+    check_database_unmodified(database_writes, "transaction");
+
+    // Checkpoints are expensive, they are executed by the background thread.
+    if (m_engine->journal_size() > m_options.checkpoint_threshold)
+        request_checkpoint();
+}
+
+/*
+ * The first thread that finds no active group leader becomes the leader: it collects
+ * the queued operations (including its own) and commits them. All other threads wait until
+ * their operation has been committed by some leader. When a leader is done, one
+ * of the remaining waiters takes over and commits the next group.
+ */
+template<typename Func, typename OnCommit>
+void database::exec_write(operation op_kind, Func&& fn, OnCommit&& on_commit) {
+    pending_write op;
+    op.apply = [&](storage& store) { fn(store); };
+    op.committed = [&] { on_commit(); };
+    op.queued = metrics_clock::now();
+
+    std::unique_lock lock(m_group_mutex);
+    m_group_queue.push_back(&op);
+    if (m_group_queue.size() >= m_options.group_commit_max_ops) {
+        m_group_filled.notify_one();
+    }
+
+    while (!op.done) {
+        if (m_group_leader) {
+            m_group_done.wait(lock);
+            continue;
         }
 
-        m_engine->begin();
-        try {
-            /*
-             * TODO: Currently, all block references must be released
-             * before either commit() or rollback() can be called.
-             * This is why there are multiple scopes in this function; they
-             * ensure that objects are destroyed before we act on the state
-             * that was altered by those objects.
-             * I'm thinking about relaxing this restriction, but i am not sure
-             * about the safety aspects of it.
-             */
-            {
-                auto first_block = m_engine->read(prequel::block_index(0));
-
-                master_block master = first_block.get<master_block>(0);
-                prequel::anchor_flag master_changed;
-                prequel::anchor_handle anchor(master, master_changed);
-
-                {
-                    prequel::default_allocator alloc(anchor.template member<&master_block::alloc>(),
-                                                     *m_engine);
-                    storage store(anchor.template member<&master_block::store>(), alloc);
-                    fn(store);
-                }
+        m_group_leader = true;
+        if (m_options.group_commit_window.count() > 0) {
+            m_group_filled.wait_for(lock, m_options.group_commit_window, [&] {
+                return m_group_queue.size() >= m_options.group_commit_max_ops;
+            });
+        }
+
+        const size_t group_size =
+            std::min<size_t>(m_group_queue.size(), m_options.group_commit_max_ops);
+        std::vector<pending_write*> group(m_group_queue.begin(),
+                                          m_group_queue.begin() + group_size);
+        m_group_queue.erase(m_group_queue.begin(), m_group_queue.begin() + group_size);
+
+        lock.unlock();
+        commit_group(group);
+        lock.lock();
+
+        for (pending_write* member : group) {
+            member->done = true;
+        }
+        m_group_leader = false;
+        m_group_done.notify_all();
+    }
+    lock.unlock();
+
+    op.timings.total = metrics_clock::now() - op.queued;
+    m_metrics.record(op_kind, op.timings);
+
+    if (op.error) {
+        std::rethrow_exception(op.error);
+    }
+}
 
-                if (master_changed) {
-                    first_block.set(0, master);
+/*
+ * Applies all operations in a single transaction. If an operation fails, its exception is
+ * recorded and the transaction is rolled back. The operations before the failed one are then
+ * applied again and committed on their own, and the group continues with the operations after
+ * the failed one. Every operation is therefore applied at most twice, no matter how many
+ * operations of the group fail (every failure costs one additional commit instead).
+ * Operations must be safe to re-apply after a rollback.
+ * Errors that are not caused by a single operation (e.g. I/O errors during commit) are
+ * reported to all members of the group that have not been committed.
+ */
+void database::commit_group(const std::vector<pending_write*>& group) {
+    // The operations in [first, last) are applied by the next transaction.
+    size_t first = 0;
+    size_t last = group.size();
+    try {
+        std::unique_lock locked(m_mutex);
+        check_open();
+
+        while (first < group.size()) {
+            std::optional<size_t> failed;
+            const metrics_clock::time_point start = metrics_clock::now();
+            operation_timings group_timings;
+            try {
+                run_transaction(
+                    [&](storage& store) {
+                        for (size_t i = first; i < last; ++i) {
+                            pending_write* op = group[i];
+                            const metrics_clock::time_point op_start = metrics_clock::now();
+                            try {
+                                op->apply(store);
+                            } catch (...) {
+                                failed = i;
+                                op->error = std::current_exception();
+                                throw;
+                            }
+                            op->timings.storage = metrics_clock::now() - op_start;
+                        }
+                    },
+                    &group_timings);
+            } catch (...) {
+                if (!failed)
+                    throw;
+
+                // The operations before the failed one succeeded, commit them without it.
+                // If the failed operation was the first one, continue right after it.
+                if (*failed == first) {
+                    first = *failed + 1;
+                    last = group.size();
+                } else {
+                    last = *failed;
                 }
+                continue;
+            }
+
+            // Every operation waited for the start of the group's transaction and for its commit.
+            for (size_t i = first; i < last; ++i) {
+                pending_write* op = group[i];
+                op->timings.lock_wait = start - op->queued;
+                op->timings.begin = group_timings.begin;
+                op->timings.commit = group_timings.commit;
+                op->committed();
             }
 
-            m_engine->commit();
-        } catch (...) {
-            m_engine->rollback();
-            throw;
+            // The operation at `last` (if any) has failed, continue after it.
+            first = last + 1;
+            last = group.size();
+        }
+    } catch (...) {
+        std::exception_ptr error = std::current_exception();
+        for (size_t i = first; i < group.size(); ++i) {
+            if (!group[i]->error)
+                group[i]->error = error;
         }
+    }
+}
 
-        if (m_engine->journal_size() > journal_checkpoint_threshold)
-            m_engine->checkpoint();
-    });
+/*
+ * Begin a transaction that is never committed. Read only transactions
+ * do not produce any journal entries, which makes them much cheaper than
+ * the read-write transactions above (no commit record, no sync).
+ */
+template<typename Func>
+void database::exec_read_transaction(Func&& fn, operation_timings* timings) {
+    exec_read(nullptr, fn, [] {}, timings);
 }
 
-} // namespace blabber
+template<typename Func, typename OnRead>
+void database::exec_read(const std::vector<u64>* posts, Func&& fn, OnRead&& on_read,
+                         operation_timings* timings) {
+    if (m_options.snapshot_reads) {
+        if (read_snapshot(posts, fn, on_read, timings))
+            return;
+        ++m_snapshot_fallbacks;
+    }
 
-using namespace blabber;
+    exec(
+        [&] {
+            check_open();
+            run_read_transaction(fn, timings);
 
-PYBIND11_MODULE(blabber_database, m) {
-    m.doc() =
-        "Blabber database native module.\n"
-        "Implements database operations as atomic transactions "
-        "using the prequel library.";
+            // Still holding the mutex, no writes can happen in between.
+            on_read();
+        },
+        timings);
+}
 
-    py::class_<database>(m, "Database")
-        .def(py::init<const std::string&, u32>(),
-             "Create a new database object with the given path and cache size (in blocks).\n"
-             "Database files must not be opened more than once.",
-             py::arg("path"), py::arg("cache_blocks"))
+/*
+ * Committed changes only reach the database file during a checkpoint, which waits for all
+ * snapshot reads to finish. Until then, the file is a consistent snapshot of the state
+ * after the last checkpoint. Writes publish the posts they have changed right after their
+ * commit (and before they update the caches), so a post that has not been published as
+ * changed has the same content in the file and in the journal.
+ */
+template<typename Func, typename OnRead>
+bool database::read_snapshot(const std::vector<u64>* posts, Func&& fn, OnRead&& on_read,
+                             operation_timings* timings) {
+    metrics_clock::time_point last = metrics_clock::now();
+    auto end_phase = [&](std::optional<metrics_clock::duration>& phase_duration) {
+        const metrics_clock::time_point now = metrics_clock::now();
+        phase_duration = now - last;
+        last = now;
+    };
 
-        .def("create_post", &database::create_post, "Create a post.", py::arg("user"),
-             py::arg("title"), py::arg("content"))
+    // Checkpoints wait for all snapshot reads, so the file must not change until leave().
+    u64 database_writes = 0;
+    {
+        std::unique_lock lock(m_snapshot_mutex);
+        m_snapshot_wakeup.wait(lock, [&] { return !m_snapshots_blocked; });
+        if (!snapshot_readable(posts))
+            return false;
+        ++m_snapshot_readers;
+        database_writes = m_database_io.writes();
+    }
+    if (timings)
+        end_phase(timings->lock_wait);
+
+    std::unique_ptr<snapshot_view> view;
+    auto leave = [&] {
+        std::unique_lock lock(m_snapshot_mutex);
+        if (view)
+            m_snapshot_views.push_back(std::move(view));
+        if (--m_snapshot_readers == 0)
+            m_snapshot_wakeup.notify_all();
+        return lock;
+    };
 
-        .def("create_comment", &database::create_comment, "Create a comment in a post.",
-             py::arg("post_id"), py::arg("user"), py::arg("content"))
+    try {
+        view = acquire_snapshot_view();
+        if (timings)
+            end_phase(timings->begin);
+        with_storage(*view->engine, false, [&](const storage& store) { fn(store); });
+        if (timings)
+            end_phase(timings->storage);
+    } catch (...) {
+        leave();
+        throw;
+    }
 
-        .def("fetch_frontpage", &database::fetch_frontpage,
-             "Fetch the content of the front page. Returns the N latest posts.",
-             py::arg("max_posts"))
+    // If the posts have been changed in the meantime, the result is still a valid snapshot,
+    // but the writer may already have updated the caches.
+    auto lock = leave();
+    check_database_unmodified(database_writes, "snapshot read");
+    if (snapshot_readable(posts))
+        on_read();
+    ++m_snapshot_reads;
+    if (timings)
+        end_phase(timings->commit);
+    return true;
+}
 
-        .def("fetch_post", &database::fetch_post,
-             "Fetch the content of a post. Returns the N latest comments.", py::arg("post_id"),
-             py::arg("max_comments"))
+template<typename Func>
+void database::run_read_transaction(Func&& fn, operation_timings* timings) {
+    metrics_clock::time_point last = metrics_clock::now();
+    auto end_phase = [&](std::optional<metrics_clock::duration>& phase_duration) {
+        const metrics_clock::time_point now = metrics_clock::now();
+        phase_duration = now - last;
+        last = now;
+    };
 
-        .def("finish", &database::finish, "Perform a clean shutdown of the database.")
+    const u64 database_writes = m_database_io.writes();
+    m_engine->begin();
+    try {
+        if (timings)
+            end_phase(timings->begin);
+        with_storage(*m_engine, false, [&](const storage& store) { fn(store); });
+        if (timings)
+            end_phase(timings->storage);
+    } catch (...) {
+        m_engine->rollback();
+        throw;
+    }
+    m_engine->rollback();
+    check_database_unmodified(database_writes, "read transaction");
+    if (timings)
+        end_phase(timings->commit);
+}
+
+template<typename Engine, typename Func>
+void database::with_storage(Engine& engine, bool writable, Func&& fn) {
+    auto first_block = engine.read(prequel::block_index(0));
+
+    master_block master = first_block.template get<master_block>(0);
+    prequel::anchor_flag master_changed;
+    prequel::anchor_handle anchor(master, master_changed);
 
-        .def("dump", &database::dump, "Dump the database into a string for debugging.");
+    {
+        prequel::default_allocator alloc(anchor.template member<&master_block::alloc>(), engine);
+        storage store(anchor.template member<&master_block::store>(), alloc,
+                      m_options.compression_threshold, &m_user_cache);
+        fn(store);
+    }
+
+    if (master_changed) {
+        if (!writable) {
+            throw std::logic_error("Must not modify the database in a read only transaction.");
+        }
+        first_block.set(0, master);
+    }
 }
+} // namespace blabber
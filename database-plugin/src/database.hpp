@@ -0,0 +1,674 @@
+#ifndef BLABBER_DATABASE_HPP
+#define BLABBER_DATABASE_HPP
+
+#include "counting_file.hpp"
+#include "journal_file.hpp"
+#include "metrics.hpp"
+#include "result_cache.hpp"
+#include "storage.hpp"
+
+#include <prequel/container/default_allocator.hpp>
+#include <prequel/simple_file_format.hpp> // just for magic_header... FIXME move it
+#include <prequel/transaction_engine.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <variant>
+#include <vector>
+
+namespace blabber {
+
+/*
+ * Tuning parameters for a database instance.
+ */
+struct database_options {
+    // Size of the block cache (in blocks). With `mmap_reads`, the engine only uses an eighth
+    // of it (at least 256 blocks), see database::engine_cache_blocks().
+    u32 cache_blocks = 0;
+
+    // The first writer of a group commit waits this long for other writers
+    // to join before the group is executed. Zero means that only writes that queued up
+    // while the previous group was being committed are grouped together.
+    std::chrono::microseconds group_commit_window{0};
+
+    // Maximum number of write operations committed in a single transaction.
+    u32 group_commit_max_ops = 64;
+
+    // Controls when committed transactions are synced to disk.
+    sync_mode sync = sync_mode::full;
+
+    // Interval of the background sync in `sync_mode::periodic`.
+    std::chrono::milliseconds sync_interval{100};
+
+    // A checkpoint is scheduled when the journal has grown beyond this many bytes.
+    // This also bounds the duration of a checkpoint: writes (and reads that depend
+    // on changes in the journal) wait while the journal is merged into the database file.
+    u64 checkpoint_threshold = 1 << 20;
+
+    // A checkpoint is scheduled when the last one is at least this old. Zero disables
+    // time based checkpoints.
+    std::chrono::milliseconds checkpoint_interval{0};
+
+    // Number of front page entries kept in memory. Zero disables the front page cache.
+    u32 frontpage_cache_size = 100;
+
+    // Memory used for cached post query results (in bytes). Zero disables the post cache.
+    u64 post_cache_bytes = 8 << 20;
+
+    // Number of user names (and their ids) kept in memory. Zero disables the user cache.
+    u32 user_cache_size = 100000;
+
+    // Read only operations may read a snapshot of the database file without locking the
+    // mutex (see database). If disabled, all reads use the engine and its block cache.
+    bool snapshot_reads = true;
+
+    // Snapshot reads access the database file through a memory mapping instead of reading
+    // its blocks with system calls.
+    bool mmap_reads = false;
+
+    // Strings of at least this many bytes are stored compressed. Zero disables compression.
+    u32 compression_threshold = 512;
+
+    // Number of worker threads executing operations of the asynchronous API.
+    // The asynchronous API is implemented by the python module.
+    u32 async_workers = 8;
+
+    // Maximum number of operations of the asynchronous API that can be pending at the same time.
+    // Operations beyond that limit are rejected.
+    u32 async_max_pending = 1000;
+};
+
+/*
+ * Counters of a copy from one database to another (upgrade or compaction).
+ */
+struct copy_stats {
+    u64 posts = 0;
+    u64 comments = 0;
+
+    // Number of posts whose creation time had to be raised to keep posts sorted by time.
+    u64 adjusted_timestamps = 0;
+};
+
+/*
+ * The result of database::compact().
+ */
+struct compact_stats {
+    copy_stats copied;
+
+    // File sizes (in bytes).
+    u64 source_bytes = 0;
+    u64 dest_bytes = 0;
+};
+
+/*
+ * Statistics about the checkpoint operations executed by a database.
+ */
+struct checkpoint_stats {
+    u64 count = 0;
+    std::chrono::nanoseconds total_duration{0};
+    std::chrono::nanoseconds last_duration{0};
+    std::chrono::nanoseconds max_duration{0};
+
+    // Size of the journal (in bytes) before the last checkpoint.
+    u64 last_journal_size = 0;
+};
+
+/*
+ * Counters of the result caches of a database.
+ */
+struct result_cache_stats {
+    cache_stats frontpage;
+    cache_stats posts;
+    user_cache_stats users;
+};
+
+/*
+ * Block cache, I/O and journal statistics of a database.
+ */
+struct database_stats {
+    u32 cache_blocks = 0;
+    u64 size_bytes = 0;
+    u64 journal_bytes = 0;
+
+    // Read only operations served by a snapshot of the database file, and those that had
+    // to use the transaction engine because they depend on changes in the journal.
+    u64 snapshot_reads = 0;
+    u64 snapshot_fallbacks = 0;
+
+    io_stats database_io;
+    io_stats journal_io;
+};
+
+/*
+ * The operations of a batch (see database::execute_batch()).
+ */
+namespace batch {
+
+struct create_post {
+    std::string user;
+    std::string title;
+    std::string content;
+};
+
+struct create_comment {
+    u64 post_id = 0;
+    std::string user;
+    std::string content;
+};
+
+struct fetch_frontpage {
+    size_t max_posts = 0;
+};
+
+struct fetch_post {
+    u64 post_id = 0;
+    size_t max_comments = 0;
+};
+
+using op = std::variant<create_post, create_comment, fetch_frontpage, fetch_post>;
+
+// The result of an operation: the id of a new post, whether a comment was created,
+// or the fetched data (null if the post does not exist).
+using result = std::variant<u64, bool, std::shared_ptr<const frontpage_entries>,
+                            std::shared_ptr<const post_result>>;
+
+} // namespace batch
+
+/*
+ * The database is the top level interface of the storage layer. It is exposed to python
+ * by the module (see module.cpp) and used directly by the native benchmark.
+ *
+ * All public member functions run in the context of a transaction and are therefore atomic.
+ * They are thread safe and never call into python.
+ *
+ * Read only operations do not take the mutex if the data they need has not been changed since
+ * the last checkpoint: they read a snapshot of the database file instead, concurrently with
+ * each other and with the writer (whose changes only reach the journal). Operations that
+ * depend on changes in the journal use a read only transaction of the engine.
+ */
+class database {
+public:
+    // A post of a bulk import (see insert_posts()).
+    struct new_post {
+        std::string user;
+        std::string title;
+        std::string content;
+        std::optional<u64> created_at;
+    };
+
+public:
+    // Size of a block in the database file (in bytes).
+    static constexpr u32 BLOCK_SIZE = 4096;
+
+public:
+    explicit database(const std::string& path, const database_options& options);
+    ~database();
+
+    database(const database&) = delete;
+    database& operator=(const database&) = delete;
+
+    const database_options& options() const { return m_options; }
+
+    // Returns false once finish() has been called.
+    bool is_open();
+
+    u64 create_post(const std::string& user, const std::string& title, const std::string& content);
+
+    // Returns false if the post does not exist.
+    bool create_comment(u64 post_id, const std::string& user, const std::string& content);
+
+    // The fetch functions use the caches (if possible) and record metrics.
+    // fetch_post() returns null and fetch_comments() returns an empty optional if the post
+    // does not exist. Cached results may contain more entries than requested.
+    std::shared_ptr<const frontpage_entries> fetch_frontpage(size_t max_posts);
+    frontpage_result fetch_posts(std::optional<u64> before_id, size_t max_posts);
+    frontpage_result fetch_posts_between(u64 start, u64 end, size_t max_posts,
+                                         std::optional<u64> before_id);
+    frontpage_result fetch_active_posts(size_t max_posts);
+    frontpage_result search(const std::string& query, size_t limit);
+    std::shared_ptr<const post_result> fetch_post(u64 post_id, size_t max_comments);
+    std::optional<comments_result> fetch_comments(u64 post_id, std::optional<u64> before,
+                                                  size_t limit);
+    user_activity_result fetch_user_activity(const std::string& user, size_t limit,
+                                             std::optional<user_activity_result::position> cursor);
+
+    /*
+     * Bulk import of posts and comments. Every call is a single transaction.
+     * insert_posts() returns the ids of the new posts, insert_comments() returns the number
+     * of comments that were skipped because their post does not exist.
+     */
+    std::vector<u64> insert_posts(const std::vector<new_post>& posts);
+    u64 insert_comments(const std::map<u64, std::vector<post_result::comment_entry>>& comments);
+
+    /*
+     * Executes a list of operations in a single transaction and returns their results.
+     * Operations see the changes made by earlier operations of the same batch.
+     * A batch that only reads is served from the caches where possible.
+     */
+    std::vector<batch::result> execute_batch(const std::vector<batch::op>& ops);
+
+    /*
+     * Writes a compacted copy of the database to a new database file at `dest_path`.
+     * Posts and their comments are written in id order, so the trees are filled from left
+     * to right and the strings of a post are written next to each other.
+     * Reads and writes continue while the copy is being made. Only the final step, which
+     * copies the changes made in the meantime, blocks them.
+     */
+    compact_stats compact(const std::string& dest_path);
+
+    // Called on a clean shutdown: performs a checkpoint and erases the journal.
+    void finish();
+
+    // Writes all committed changes to the database file (if the journal has changes).
+    // Checkpoints usually run in the background.
+    void checkpoint_now();
+
+    blabber::checkpoint_stats checkpoint_stats();
+    result_cache_stats cache_stats() const;
+
+    // Latency histograms of the instrumented operations.
+    const database_metrics& metrics() const { return m_metrics; }
+
+    // Returns block cache, I/O and journal statistics.
+    database_stats stats();
+
+    // The counters of the file format upgrade performed when the database was opened.
+    // Empty if the file was already in the current format.
+    const std::optional<copy_stats>& upgrade_stats() const { return m_upgrade_stats; }
+
+    /*
+     * Changes the size of the block cache (in blocks). The engine is recreated with the
+     * new cache size (after a checkpoint), so the cache starts out empty.
+     */
+    void resize_cache(u32 cache_blocks);
+
+    std::string dump();
+
+private:
+    static constexpr const char FILE_FORMAT_MAGIC[] = "BLABBER_DB";
+    static constexpr u32 FILE_FORMAT_VERSION = 9;
+
+    // At offset 0 in the file.
+    struct file_header {
+        prequel::magic_header magic;
+        u32 version = 0;
+
+        static constexpr auto get_binary_format() {
+            return prequel::binary_format(&file_header::magic, &file_header::version);
+        }
+    };
+
+    // Full content of the first block.
+    struct master_block {
+        file_header header;
+        prequel::default_allocator::anchor alloc;
+        storage::anchor store;
+
+        static constexpr auto get_binary_format() {
+            return prequel::binary_format(&master_block::header, &master_block::alloc,
+                                          &master_block::store);
+        }
+    };
+
+    // Content of the first block in older files. `Reader` reads the storage of that version.
+    template<typename Reader>
+    struct legacy_master_block {
+        file_header header;
+        prequel::default_allocator::anchor alloc;
+        typename Reader::anchor store;
+
+        static constexpr auto get_binary_format() {
+            return prequel::binary_format(&legacy_master_block::header,
+                                          &legacy_master_block::alloc,
+                                          &legacy_master_block::store);
+        }
+    };
+
+    // Describes which data snapshot reads can take from the database file.
+    enum class snapshot_state {
+        // The database file contains all committed changes.
+        current,
+
+        // Only the posts in m_changed_posts (and new posts) have been changed since the last
+        // checkpoint. Operations that read other posts can still use the database file.
+        tracked,
+
+        // The changes since the last checkpoint are unknown (e.g. after recovery from the
+        // journal) or the database has been closed. All reads use the engine.
+        disabled,
+    };
+
+    // The posts changed by a write transaction. Writes that modify or create posts must
+    // record them while they are applied, other changes are not tracked.
+    struct post_changes {
+        std::vector<u64> modified;
+        std::optional<u64> first_created;
+    };
+
+    /*
+     * A read only engine on top of the database file, used by one snapshot read at a time.
+     * Views are kept in a pool until the next checkpoint modifies the file.
+     */
+    struct snapshot_view {
+        std::unique_ptr<prequel::file> file;
+        std::unique_ptr<prequel::engine> engine;
+    };
+
+    // Blocks cached by every snapshot view that reads the file with system calls.
+    // A view is used by a single operation at a time, the operating system caches the rest.
+    static constexpr u32 SNAPSHOT_VIEW_CACHE_BLOCKS = 64;
+
+private:
+    void open();
+
+    // Opens the database and journal files and creates the engine.
+    void open_engine();
+
+    // Creates the engine on top of the open files. Mutex must be held
+    // (unless called from open()) and no transaction must be running.
+    void create_engine();
+
+    // Size of the engine's block cache. Mutex must be held.
+    u32 engine_cache_blocks() const;
+
+    // Returns an unused snapshot view, opening a new one if necessary.
+    std::unique_ptr<snapshot_view> acquire_snapshot_view();
+
+    // True if a snapshot read of `posts` (all data if null) would see all committed changes.
+    // m_snapshot_mutex must be held.
+    bool snapshot_readable(const std::vector<u64>* posts) const;
+
+    // Waits until all snapshot reads have finished and prevents new ones from starting.
+    // Must be called before the database file is modified or closed. Mutex must be held.
+    void block_snapshots();
+
+    // Discards the snapshot views and the recorded changes and allows snapshot reads again.
+    // The database file must contain all committed changes if `file_current` is true,
+    // snapshot reads are disabled until the next checkpoint otherwise. Mutex must be held.
+    void unblock_snapshots(bool file_current);
+
+    // Disables snapshot reads, e.g. before the database file is closed. Mutex must be held.
+    void close_snapshots();
+
+    /*
+     * Snapshot reads rely on the engine writing to the database file only in checkpoint():
+     * transactions write their changes to the journal, which is only merged into the database
+     * file by a checkpoint. Throws std::logic_error if the database file has been written
+     * since m_database_io counted `writes` writes.
+     */
+    void check_database_unmodified(u64 writes, const char* operation) const;
+
+    // Record the posts changed by the running write transaction (see post_changes).
+    // Mutex must be held.
+    void post_modified(u64 post_id);
+    void post_created(u64 post_id);
+
+    // Makes the changes recorded in m_transaction_changes visible to snapshot reads.
+    // Called after a commit. Mutex must be held.
+    void publish_changes();
+
+    // Converts a database in an older file format by copying all posts into a new file,
+    // which then replaces the old one. Called from open() only.
+    copy_stats upgrade(u32 version);
+
+    // Copies all posts from this database (in the older format read by `Reader`) to `dest`.
+    template<typename Reader>
+    void copy_legacy_posts(database& dest, copy_stats& stats);
+
+    // Runs maintenance tasks (periodic sync and checkpoints) until stopped.
+    void background_main();
+    void stop_background();
+
+    // Wakes the background thread to perform a checkpoint.
+    void request_checkpoint();
+
+    // Runs a checkpoint if the journal has changes. Called by the background thread.
+    void background_checkpoint();
+
+    // Makes the journal durable (if required by the sync mode), then runs a checkpoint.
+    // Mutex must be held.
+    void checkpoint();
+    void init_master_block();
+
+    // Checks the header of an existing database and returns its file format version.
+    u32 check_master_block();
+
+    static void check_header(const file_header& header);
+
+    // Throws if finish() has already been called. Mutex must be held.
+    void check_open() const;
+
+    // Reloads the front page cache from disk. Mutex must be held.
+    void reload_frontpage_cache();
+
+    // Size of the database (in bytes). Mutex must be held.
+    u64 byte_size() const;
+
+    // Options for a new database that is only written to by a post_copier.
+    database_options copy_options() const;
+
+    /*
+     * Writes copied posts (including their comments) to the empty database `dest`, in batches.
+     * Posts must be added in id order.
+     *
+     * Posts must be sorted by time, but older files (and imports) may contain posts that are
+     * older than their predecessor. Their creation time is raised to the one of the previous
+     * post. The counters in `stats` are incremented.
+     */
+    class post_copier {
+    public:
+        // Upper bound for the size of the strings of a batch of posts (in bytes).
+        static constexpr size_t max_batch_bytes = 4 << 20;
+
+        // Upper bound for the number of posts in a batch.
+        static constexpr size_t max_batch_posts = 1000;
+
+    public:
+        explicit post_copier(database& dest, copy_stats& stats);
+
+        void add(post_result post);
+
+        // Writes the posts that have not been written yet.
+        void flush();
+
+    private:
+        database& m_dest;
+        copy_stats& m_stats;
+        std::vector<post_result> m_batch;
+        size_t m_batch_bytes = 0;
+        u64 m_latest_created_at = 0;
+    };
+
+    /*
+     * Copies all posts (including their comments) from `source` to the empty database `dest`.
+     * `source` must implement find_next_post() and fetch_post() (e.g. storage or v1::reader)
+     * and must remain valid (i.e. its transaction must stay open) during the copy.
+     */
+    template<typename Source>
+    static void copy_posts(const Source& source, database& dest, copy_stats& stats);
+
+    /*
+     * A write operation waiting to be executed as part of a group commit.
+     * Lives on the stack of the calling thread.
+     */
+    struct pending_write {
+        // Applies the operation. Invoked at most twice (again after a rollback).
+        std::function<void(storage&)> apply;
+
+        // Invoked (with the mutex held) after the operation has been committed.
+        std::function<void()> committed;
+
+        // Set when the operation was queued, and by the group leader when it has been applied.
+        metrics_clock::time_point queued;
+        operation_timings timings;
+
+        std::exception_ptr error;
+        bool done = false;
+    };
+
+    /*
+     * Locks our mutex, then executes `fn`.
+     * The time spent waiting for the mutex is stored in `timings` (if not null).
+     */
+    template<typename Func>
+    void exec(Func&& fn, operation_timings* timings = nullptr);
+
+    /*
+     * Like exec, but also starts a transaction. The transaction will be committed
+     * if `fn` returns without an exception, and will be rolled back otherwise.
+     */
+    template<typename Func>
+    void exec_transaction(Func&& fn);
+
+    /*
+     * Executes the write operation `fn` as part of a group commit: writes from concurrent
+     * threads are collected and committed together in a single transaction.
+     * Exceptions thrown by `fn` are reported to the caller and only affect its own operation.
+     *
+     * `on_commit` is called once the transaction that contains the operation has been committed.
+     * Calls happen in commit order, which makes it the right place to update in-memory caches.
+     */
+    template<typename Func, typename OnCommit>
+    void exec_write(operation op_kind, Func&& fn, OnCommit&& on_commit);
+
+    // Executes the group commit of the given operations. Called by the group leader
+    // without holding any locks.
+    void commit_group(const std::vector<pending_write*>& group);
+
+    /*
+     * Executes `fn` in a new read-write transaction. The mutex must be held.
+     * The transaction will be committed if `fn` returns without an exception,
+     * and will be rolled back otherwise.
+     * The duration of the begin, storage and commit phases is stored in `timings` (if not null).
+     */
+    template<typename Func>
+    void run_transaction(Func&& fn, operation_timings* timings = nullptr);
+
+    /*
+     * Like exec_transaction, but for operations that only read from the storage.
+     * `fn` receives a const storage instance. The transaction is always rolled back
+     * at the end: it never writes to the journal, never syncs and never triggers a checkpoint.
+     * Equivalent to exec_read() without a list of posts.
+     */
+    template<typename Func>
+    void exec_read_transaction(Func&& fn, operation_timings* timings = nullptr);
+
+    /*
+     * Executes the read only operation `fn` on a snapshot of the database file (without locking
+     * the mutex) if possible, and in a read only transaction of the engine otherwise.
+     *
+     * `posts` lists the posts read by `fn` (including their comments and the names of their
+     * users), or is null if `fn` may read anything. `on_read` is called after `fn` has returned,
+     * before writes that change these posts update the caches. This makes it the right place to
+     * insert the results into a cache.
+     */
+    template<typename Func, typename OnRead>
+    void exec_read(const std::vector<u64>* posts, Func&& fn, OnRead&& on_read,
+                   operation_timings* timings = nullptr);
+
+    // Executes `fn` on a snapshot view of the database file if snapshot_readable(posts),
+    // then calls `on_read`. Returns false (without calling either) otherwise.
+    template<typename Func, typename OnRead>
+    bool read_snapshot(const std::vector<u64>* posts, Func&& fn, OnRead&& on_read,
+                       operation_timings* timings);
+
+    // Executes `fn` in a new read only transaction. The mutex must be held.
+    template<typename Func>
+    void run_read_transaction(Func&& fn, operation_timings* timings = nullptr);
+
+    /*
+     * Reads the master block of the current transaction and constructs the
+     * allocator and storage instances on top of it, then calls `fn(store)`.
+     * The master block is written back if it was modified and `writable` is true.
+     */
+    template<typename Engine, typename Func>
+    void with_storage(Engine& engine, bool writable, Func&& fn);
+
+private:
+    // These values are constant after construction.
+    std::string m_database_path;
+    std::string m_journal_path;
+    database_options m_options;
+    std::optional<copy_stats> m_upgrade_stats;
+
+    // Group commit state, protected by m_group_mutex. Lock order: m_group_mutex before m_mutex.
+    std::mutex m_group_mutex;
+    std::condition_variable m_group_done;   // Signaled when a group has been committed.
+    std::condition_variable m_group_filled; // Signaled when the queue reaches the max. group size.
+    std::vector<pending_write*> m_group_queue;
+    bool m_group_leader = false;
+
+    // Background thread state, protected by m_background_mutex.
+    // Lock order: m_mutex before m_background_mutex.
+    std::mutex m_background_mutex;
+    std::condition_variable m_background_wakeup;
+    bool m_background_stop = false;
+    bool m_checkpoint_requested = false;
+    blabber::checkpoint_stats m_checkpoint_stats;
+    std::thread m_background;
+
+    // All public operations lock the mutex.
+    std::mutex m_mutex;
+
+    // Updated by the files, can be read without the mutex.
+    io_counters m_database_io;
+    io_counters m_journal_io;
+
+    // Accessed while the mutex is locked.
+    bool m_open = false;
+    u32 m_cache_blocks = 0;
+    std::unique_ptr<prequel::file> m_database_file;
+    std::unique_ptr<journal_file> m_journal_file;
+    std::unique_ptr<prequel::transaction_engine> m_engine;
+
+    // Posts changed by the running write transaction, published to snapshot reads
+    // after the commit. Accessed while the mutex is locked.
+    post_changes m_transaction_changes;
+
+    // Posts modified while compact() is running (new posts are not included).
+    // Accessed while the mutex is locked.
+    std::optional<std::unordered_set<u64>> m_compaction_changes;
+
+    // Snapshot read state, protected by m_snapshot_mutex. Modified with both mutexes held.
+    // Lock order: m_mutex before m_snapshot_mutex before the mutexes of the caches.
+    std::mutex m_snapshot_mutex;
+    std::condition_variable m_snapshot_wakeup; // Signaled when reads are unblocked or finish.
+    snapshot_state m_snapshot_state = snapshot_state::disabled;
+    bool m_snapshots_blocked = false;
+    u32 m_snapshot_readers = 0;
+
+    // Posts changed since the last checkpoint (in state `tracked`). New posts are not
+    // inserted individually: all posts with an id >= m_first_new_post are new.
+    std::unordered_set<u64> m_changed_posts;
+    u64 m_first_new_post = u64(-1);
+
+    // Views that are not used by a snapshot read at the moment.
+    std::vector<std::unique_ptr<snapshot_view>> m_snapshot_views;
+
+    std::atomic<u64> m_snapshot_reads{0};
+    std::atomic<u64> m_snapshot_fallbacks{0};
+
+    // Updated after commits (with the mutex held), but can be read without the mutex.
+    frontpage_cache m_frontpage;
+    post_cache m_post_cache;
+
+    // Thread safe, only contains committed users.
+    user_cache m_user_cache;
+
+    // Thread safe, updated without holding the mutex.
+    database_metrics m_metrics;
+};
+
+} // namespace blabber
+
+#endif // BLABBER_DATABASE_HPP
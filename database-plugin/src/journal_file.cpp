@@ -0,0 +1,58 @@
+#include "journal_file.hpp"
+
+namespace blabber {
+
+journal_file::journal_file(std::unique_ptr<prequel::file> inner, sync_mode mode)
+    : file(inner->get_vfs())
+    , m_inner(std::move(inner))
+    , m_mode(mode) {}
+
+journal_file::~journal_file() {}
+
+void journal_file::flush() {
+    std::lock_guard lock(m_flush_mutex);
+    if (m_dirty.exchange(false)) {
+        m_inner->sync();
+    }
+}
+
+bool journal_file::read_only() const noexcept {
+    return m_inner->read_only();
+}
+
+const char* journal_file::name() const noexcept {
+    return m_inner->name();
+}
+
+void journal_file::read(u64 offset, void* buffer, u32 count) {
+    m_inner->read(offset, buffer, count);
+}
+
+void journal_file::write(u64 offset, const void* buffer, u32 count) {
+    m_inner->write(offset, buffer, count);
+
+    // Only mark the file as dirty once the write is complete, otherwise a concurrent
+    // flush could clear the flag and sync before the data reached the file.
+    m_dirty = true;
+}
+
+u64 journal_file::file_size() {
+    return m_inner->file_size();
+}
+
+void journal_file::truncate(u64 size) {
+    m_inner->truncate(size);
+    m_dirty = true;
+}
+
+void journal_file::sync() {
+    if (m_mode == sync_mode::full) {
+        flush();
+    }
+}
+
+void journal_file::close() {
+    m_inner->close();
+}
+
+} // namespace blabber
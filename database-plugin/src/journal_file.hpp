@@ -0,0 +1,73 @@
+#ifndef BLABBER_JOURNAL_FILE_HPP
+#define BLABBER_JOURNAL_FILE_HPP
+
+#include <prequel/vfs.hpp>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+namespace blabber {
+
+using namespace prequel::short_types;
+
+/*
+ * Controls when committed transactions are synced to disk.
+ */
+enum class sync_mode {
+    // The journal is synced on every commit. Committed transactions are never lost.
+    full,
+
+    // The journal is synced by a background thread in regular intervals.
+    // Transactions committed since the last sync can be lost on a crash.
+    periodic,
+
+    // The journal is only synced before a checkpoint (and on shutdown).
+    // All transactions committed since the last checkpoint can be lost on a crash.
+    none,
+};
+
+/*
+ * Wraps the journal file and decides which sync requests actually reach the disk.
+ *
+ * The transaction engine syncs the journal on every commit. In `sync_mode::full`,
+ * these syncs are forwarded as-is. In all other modes they only mark the file as dirty,
+ * the owner is responsible for calling `flush()` at appropriate times (periodically,
+ * before checkpoints or on shutdown).
+ *
+ * `flush()` may be called from a different thread than the one using the file.
+ * All other functions must be called by the thread that owns the engine.
+ */
+class journal_file final : public prequel::file {
+public:
+    explicit journal_file(std::unique_ptr<prequel::file> inner, sync_mode mode);
+    ~journal_file();
+
+    sync_mode mode() const noexcept { return m_mode; }
+
+    // Syncs the file to disk if there are writes that have not been synced yet.
+    void flush();
+
+    bool read_only() const noexcept override;
+    const char* name() const noexcept override;
+    void read(u64 offset, void* buffer, u32 count) override;
+    void write(u64 offset, const void* buffer, u32 count) override;
+    u64 file_size() override;
+    void truncate(u64 size) override;
+    void sync() override;
+    void close() override;
+
+private:
+    std::unique_ptr<prequel::file> m_inner;
+    sync_mode m_mode;
+
+    // Serializes flushes from different threads.
+    std::mutex m_flush_mutex;
+
+    // True if the file has been modified since the last sync.
+    std::atomic<bool> m_dirty{false};
+};
+
+} // namespace blabber
+
+#endif // BLABBER_JOURNAL_FILE_HPP
@@ -0,0 +1,134 @@
+#include "legacy_format.hpp"
+#include "string_loader.hpp"
+
+#include <vector>
+
+namespace blabber::legacy {
+
+template<typename Post>
+reader<Post>::reader(prequel::anchor_handle<anchor> anchor_, prequel::allocator& alloc_)
+    : m_anchor(std::move(anchor_))
+    , m_alloc(&alloc_)
+    , m_posts(m_anchor.template member<&anchor::posts>(), alloc_)
+    , m_strings(m_anchor.template member<&anchor::strings>(), alloc_) {}
+
+template<typename Post>
+std::optional<u64> reader<Post>::find_next_post(u64 min_id) const {
+    if (auto cursor = m_posts.lower_bound(min_id))
+        return cursor.get().id;
+    return {};
+}
+
+template<typename Post>
+post_result reader<Post>::fetch_post(u64 post_id, size_t max_comments) const {
+    auto post_cursor = m_posts.find(post_id);
+    if (!post_cursor) {
+        throw not_found_error("Post not found.");
+    }
+
+    Post found_post = post_cursor.get();
+    prequel::anchor_flag post_changed;
+    std::vector<comment> found_comments;
+    {
+        prequel::list<comment> comments(prequel::anchor_handle(found_post.comments, post_changed),
+                                        *m_alloc);
+        auto cursor = comments.create_cursor(comments.seek_last);
+        while (cursor && found_comments.size() < max_comments) {
+            found_comments.push_back(cursor.get());
+            cursor.move_prev();
+        }
+    }
+
+    if (post_changed) {
+        throw std::logic_error("Must not modify the post in a read only operation.");
+    }
+
+    post_result result;
+    result.id = found_post.id;
+    result.created_at = found_post.created_at;
+    result.comments.resize(found_comments.size());
+
+    string_loader loader(m_strings);
+    loader.add(found_post.user, result.user);
+    loader.add(found_post.title, result.title);
+    loader.add(found_post.content, result.content);
+    for (size_t i = 0; i < found_comments.size(); ++i) {
+        const comment& c = found_comments[i];
+        post_result::comment_entry& entry = result.comments[i];
+        entry.created_at = c.created_at;
+        loader.add(c.user, entry.user);
+        loader.add(c.content, entry.content);
+    }
+    loader.load();
+    return result;
+}
+
+template class reader<v1::post>;
+template class reader<v2::post>;
+template class reader<v3::post>;
+template class reader<v4::post>;
+
+} // namespace blabber::legacy
+
+namespace blabber::v7 {
+
+reader::reader(prequel::anchor_handle<anchor> anchor_, prequel::allocator& alloc_)
+    : m_anchor(std::move(anchor_))
+    , m_alloc(&alloc_)
+    , m_posts(m_anchor.member<&anchor::posts>(), alloc_)
+    , m_strings(m_anchor.member<&anchor::strings>(), alloc_)
+    , m_user_names(m_anchor.member<&anchor::user_names>(), alloc_, m_strings, nullptr) {}
+
+std::optional<u64> reader::find_next_post(u64 min_id) const {
+    if (auto cursor = m_posts.lower_bound(min_id))
+        return cursor.get().id;
+    return {};
+}
+
+post_result reader::fetch_post(u64 post_id, size_t max_comments) const {
+    auto post_cursor = m_posts.find(post_id);
+    if (!post_cursor) {
+        throw not_found_error("Post not found.");
+    }
+
+    post found_post = post_cursor.get();
+    prequel::anchor_flag post_changed;
+    std::vector<comment> found_comments;
+    {
+        prequel::list<comment> comments(prequel::anchor_handle(found_post.comments, post_changed),
+                                        *m_alloc);
+        auto cursor = comments.create_cursor(comments.seek_last);
+        while (cursor && found_comments.size() < max_comments) {
+            found_comments.push_back(cursor.get());
+            cursor.move_prev();
+        }
+    }
+
+    if (post_changed) {
+        throw std::logic_error("Must not modify the post in a read only operation.");
+    }
+
+    post_result result;
+    result.id = found_post.id;
+    result.created_at = found_post.created_at;
+    result.comment_count = found_post.comment_count;
+    result.last_comment_at = found_post.last_comment_at;
+    result.comments.resize(found_comments.size());
+
+    string_loader loader(m_strings);
+    user_name_loader names(m_user_names);
+    names.add(found_post.user_id, result.user);
+    loader.add(found_post.title, result.title);
+    loader.add(found_post.content, result.content);
+    for (size_t i = 0; i < found_comments.size(); ++i) {
+        const comment& c = found_comments[i];
+        post_result::comment_entry& entry = result.comments[i];
+        entry.created_at = c.created_at;
+        names.add(c.user_id, entry.user);
+        loader.add(c.content, entry.content);
+    }
+    names.load(loader);
+    return result;
+}
+
+} // namespace blabber::v7
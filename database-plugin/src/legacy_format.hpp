@@ -0,0 +1,297 @@
+#ifndef BLABBER_LEGACY_FORMAT_HPP
+#define BLABBER_LEGACY_FORMAT_HPP
+
+#include "storage.hpp"
+
+#include <prequel/anchor_handle.hpp>
+#include <prequel/container/btree.hpp>
+#include <prequel/container/heap.hpp>
+#include <prequel/container/list.hpp>
+#include <prequel/fixed_string.hpp>
+#include <prequel/serialization.hpp>
+
+#include <optional>
+#include <variant>
+
+/*
+ * Read only access to databases written by older versions of this plugin.
+ * Old databases are upgraded by copying all posts into a database with the current format
+ * (see database::open()), so only the operations required for the copy are implemented here.
+ */
+
+namespace blabber {
+
+namespace legacy {
+
+// Strings were either inlined or stored on the heap without compression.
+template<u32 Capacity>
+using optimized_string = std::variant<prequel::fixed_cstring<Capacity>, prequel::heap_reference>;
+
+/*
+ * Reads posts from a storage in an older file format. `Post` is the post type of that format
+ * and must define its comment type as `Post::comment_type`.
+ * Versions 1 to 3 share the same storage anchor. Later versions only appended members to it,
+ * so the reader's anchor is a prefix of the anchor of every version.
+ */
+template<typename Post>
+class reader {
+    using comment = typename Post::comment_type;
+    using post_tree = prequel::btree<Post, prequel::indexed_by_member<&Post::id>>;
+
+public:
+    class anchor {
+        u64 next_post_id = 1;
+        typename post_tree::anchor posts;
+        prequel::heap::anchor strings;
+
+        static constexpr auto get_binary_format() {
+            return prequel::binary_format(&anchor::next_post_id, &anchor::posts, &anchor::strings);
+        }
+
+        friend reader;
+        friend prequel::binary_format_access;
+    };
+
+public:
+    explicit reader(prequel::anchor_handle<anchor> anchor_, prequel::allocator& alloc_);
+
+    // Returns the smallest post id >= `min_id`, or an empty optional if there is no such post.
+    std::optional<u64> find_next_post(u64 min_id) const;
+
+    // Returns the post and up to `max_comments` of its comments (newest first).
+    post_result fetch_post(u64 post_id, size_t max_comments) const;
+
+private:
+    prequel::anchor_handle<anchor> m_anchor;
+    prequel::allocator* m_alloc = nullptr;
+    post_tree m_posts;
+    prequel::heap m_strings;
+};
+
+} // namespace legacy
+
+/*
+ * Version 1: comment content was always stored on the heap.
+ */
+namespace v1 {
+
+struct comment {
+    u64 created_at = 0;
+    legacy::optimized_string<15> user;
+    prequel::heap_reference content;
+
+    static constexpr auto get_binary_format() {
+        return prequel::binary_format(&comment::created_at, &comment::user, &comment::content);
+    }
+};
+
+struct post {
+    using comment_type = comment;
+
+    u64 id = 0;
+    u64 created_at = 0;
+    legacy::optimized_string<15> user;
+    legacy::optimized_string<31> title;
+    prequel::heap_reference content;
+    prequel::list<comment>::anchor comments;
+
+    static constexpr auto get_binary_format() {
+        return prequel::binary_format(&post::id, &post::created_at, &post::user, &post::title,
+                                      &post::content, &post::comments);
+    }
+};
+
+using reader = legacy::reader<post>;
+
+} // namespace v1
+
+/*
+ * Version 2: short comment content was inlined, strings were never compressed.
+ */
+namespace v2 {
+
+struct comment {
+    u64 created_at = 0;
+    legacy::optimized_string<15> user;
+    legacy::optimized_string<47> content;
+
+    static constexpr auto get_binary_format() {
+        return prequel::binary_format(&comment::created_at, &comment::user, &comment::content);
+    }
+};
+
+struct post {
+    using comment_type = comment;
+
+    u64 id = 0;
+    u64 created_at = 0;
+    legacy::optimized_string<15> user;
+    legacy::optimized_string<31> title;
+    prequel::heap_reference content;
+    prequel::list<comment>::anchor comments;
+
+    static constexpr auto get_binary_format() {
+        return prequel::binary_format(&post::id, &post::created_at, &post::user, &post::title,
+                                      &post::content, &post::comments);
+    }
+};
+
+using reader = legacy::reader<post>;
+
+} // namespace v2
+
+/*
+ * Version 3: strings could be compressed, posts had no comment summary (and there was
+ * no activity index).
+ */
+namespace v3 {
+
+struct comment {
+    u64 created_at = 0;
+    optimized_string<15> user;
+    optimized_string<comment_inline_capacity> content;
+
+    static constexpr auto get_binary_format() {
+        return prequel::binary_format(&comment::created_at, &comment::user, &comment::content);
+    }
+};
+
+struct post {
+    using comment_type = comment;
+
+    u64 id = 0;
+    u64 created_at = 0;
+    optimized_string<15> user;
+    optimized_string<31> title;
+    heap_string content;
+    prequel::list<comment>::anchor comments;
+
+    static constexpr auto get_binary_format() {
+        return prequel::binary_format(&post::id, &post::created_at, &post::user, &post::title,
+                                      &post::content, &post::comments);
+    }
+};
+
+using reader = legacy::reader<post>;
+
+} // namespace v3
+
+/*
+ * Version 4: posts had a comment summary and there was an activity index.
+ * Versions 5 and 6 added the search and user activity indexes, but did not change posts
+ * and comments, so they are read with this reader as well.
+ * Until version 6, user names were stored in every post and comment.
+ */
+namespace v4 {
+
+using comment = v3::comment;
+
+struct post {
+    using comment_type = comment;
+
+    u64 id = 0;
+    u64 created_at = 0;
+    optimized_string<15> user;
+    optimized_string<31> title;
+    heap_string content;
+    u64 comment_count = 0;
+    u64 last_comment_at = 0;
+    prequel::list<comment>::anchor comments;
+
+    static constexpr auto get_binary_format() {
+        return prequel::binary_format(&post::id, &post::created_at, &post::user, &post::title,
+                                      &post::content, &post::comment_count,
+                                      &post::last_comment_at, &post::comments);
+    }
+};
+
+using reader = legacy::reader<post>;
+
+} // namespace v4
+
+/*
+ * Version 7: posts and comments stored the id of their user (see user_dictionary),
+ * comments were stored in a list per post.
+ */
+namespace v7 {
+
+struct comment {
+    u64 created_at = 0;
+    u64 user_id = 0;
+    optimized_string<comment_inline_capacity> content;
+
+    static constexpr auto get_binary_format() {
+        return prequel::binary_format(&comment::created_at, &comment::user_id,
+                                      &comment::content);
+    }
+};
+
+struct post {
+    u64 id = 0;
+    u64 created_at = 0;
+    u64 user_id = 0;
+    optimized_string<31> title;
+    heap_string content;
+    u64 comment_count = 0;
+    u64 last_comment_at = 0;
+    prequel::list<comment>::anchor comments;
+
+    static constexpr auto get_binary_format() {
+        return prequel::binary_format(&post::id, &post::created_at, &post::user_id,
+                                      &post::title, &post::content, &post::comment_count,
+                                      &post::last_comment_at, &post::comments);
+    }
+};
+
+/*
+ * Reads posts from a version 7 storage. User names are resolved through the user dictionary,
+ * which is the last member of the storage anchor of that version, so this reader
+ * needs the complete anchor.
+ */
+class reader {
+    using post_tree = prequel::btree<post, prequel::indexed_by_member<&post::id>>;
+    using activity_tree = prequel::btree<activity_entry, activity_entry::key>;
+    using user_tree = prequel::btree<user_activity_entry, user_activity_entry::key>;
+
+public:
+    class anchor {
+        u64 next_post_id = 1;
+        post_tree::anchor posts;
+        prequel::heap::anchor strings;
+        activity_tree::anchor activity;
+        search_index::anchor search;
+        user_tree::anchor users;
+        user_dictionary::anchor user_names;
+
+        static constexpr auto get_binary_format() {
+            return prequel::binary_format(&anchor::next_post_id, &anchor::posts, &anchor::strings,
+                                          &anchor::activity, &anchor::search, &anchor::users,
+                                          &anchor::user_names);
+        }
+
+        friend reader;
+        friend prequel::binary_format_access;
+    };
+
+public:
+    explicit reader(prequel::anchor_handle<anchor> anchor_, prequel::allocator& alloc_);
+
+    // Returns the smallest post id >= `min_id`, or an empty optional if there is no such post.
+    std::optional<u64> find_next_post(u64 min_id) const;
+
+    // Returns the post and up to `max_comments` of its comments (newest first).
+    post_result fetch_post(u64 post_id, size_t max_comments) const;
+
+private:
+    prequel::anchor_handle<anchor> m_anchor;
+    prequel::allocator* m_alloc = nullptr;
+    post_tree m_posts;
+    prequel::heap m_strings;
+    user_dictionary m_user_names;
+};
+
+} // namespace v7
+
+} // namespace blabber
+
+#endif // BLABBER_LEGACY_FORMAT_HPP
@@ -0,0 +1,128 @@
+#include "metrics.hpp"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+
+namespace blabber {
+
+const char* operation_name(operation op) {
+    switch (op) {
+    case operation::create_post:
+        return "create_post";
+    case operation::create_comment:
+        return "create_comment";
+    case operation::fetch_frontpage:
+        return "fetch_frontpage";
+    case operation::fetch_post:
+        return "fetch_post";
+    case operation::execute_batch:
+        return "execute_batch";
+    case operation::search:
+        return "search";
+    }
+    return "unknown";
+}
+
+const char* phase_name(phase ph) {
+    switch (ph) {
+    case phase::lock_wait:
+        return "lock_wait";
+    case phase::begin:
+        return "begin";
+    case phase::storage:
+        return "storage";
+    case phase::commit:
+        return "commit";
+    case phase::total:
+        return "total";
+    }
+    return "unknown";
+}
+
+void latency_histogram::record(metrics_clock::duration value) {
+    const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(value).count();
+    const u64 value_ns = ns > 0 ? static_cast<u64>(ns) : 0;
+
+    // A value belongs to the first bucket whose bound is not smaller.
+    const u64 value_us = (value_ns + 999) / 1000;
+    const size_t index = std::lower_bound(bucket_bounds.begin(), bucket_bounds.end(), value_us) -
+                         bucket_bounds.begin();
+
+    m_buckets[index].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    m_sum_ns.fetch_add(value_ns, std::memory_order_relaxed);
+}
+
+latency_histogram::snapshot latency_histogram::get() const {
+    snapshot result;
+    for (size_t i = 0; i < bucket_count; ++i) {
+        result.buckets[i] = m_buckets[i].load(std::memory_order_relaxed);
+    }
+    result.count = m_count.load(std::memory_order_relaxed);
+    result.sum = std::chrono::nanoseconds(m_sum_ns.load(std::memory_order_relaxed));
+    return result;
+}
+
+void database_metrics::record(operation op, const operation_timings& timings) {
+    auto record_phase = [&](phase ph, const std::optional<metrics_clock::duration>& value) {
+        if (value)
+            histogram_for(op, ph).record(*value);
+    };
+
+    record_phase(phase::lock_wait, timings.lock_wait);
+    record_phase(phase::begin, timings.begin);
+    record_phase(phase::storage, timings.storage);
+    record_phase(phase::commit, timings.commit);
+    histogram_for(op, phase::total).record(timings.total);
+}
+
+void database_metrics::record_checkpoint(metrics_clock::duration duration) {
+    m_checkpoints.record(duration);
+}
+
+// Appends the series of a histogram. `labels` is a (possibly empty) list of label pairs.
+static void append_histogram(std::string& out, const char* name, const std::string& labels,
+                             const latency_histogram::snapshot& hist) {
+    const std::string separator = labels.empty() ? "" : ",";
+
+    u64 cumulative = 0;
+    for (size_t i = 0; i < latency_histogram::bucket_count; ++i) {
+        cumulative += hist.buckets[i];
+
+        std::string bound = "+Inf";
+        if (i < latency_histogram::bucket_bounds.size()) {
+            bound = fmt::format("{}", latency_histogram::bucket_bounds[i] / 1e6);
+        }
+        out += fmt::format("{}_bucket{{{}{}le=\"{}\"}} {}\n", name, labels, separator, bound,
+                           cumulative);
+    }
+
+    const std::string braced = labels.empty() ? "" : "{" + labels + "}";
+    const double sum_seconds = std::chrono::duration<double>(hist.sum).count();
+    out += fmt::format("{}_sum{} {}\n", name, braced, sum_seconds);
+    out += fmt::format("{}_count{} {}\n", name, braced, hist.count);
+}
+
+std::string database_metrics::prometheus_text() const {
+    std::string out;
+
+    out += "# HELP blabber_operation_seconds Latency of database operations by phase.\n";
+    out += "# TYPE blabber_operation_seconds histogram\n";
+    for (size_t op = 0; op < operation_count; ++op) {
+        for (size_t ph = 0; ph < phase_count; ++ph) {
+            const std::string labels =
+                fmt::format("operation=\"{}\",phase=\"{}\"", operation_name(operation(op)),
+                            phase_name(phase(ph)));
+            append_histogram(out, "blabber_operation_seconds", labels,
+                             m_operations[op][ph].get());
+        }
+    }
+
+    out += "# HELP blabber_checkpoint_seconds Duration of checkpoints.\n";
+    out += "# TYPE blabber_checkpoint_seconds histogram\n";
+    append_histogram(out, "blabber_checkpoint_seconds", "", m_checkpoints.get());
+    return out;
+}
+
+} // namespace blabber
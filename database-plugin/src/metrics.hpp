@@ -0,0 +1,141 @@
+#ifndef BLABBER_METRICS_HPP
+#define BLABBER_METRICS_HPP
+
+#include <prequel/defs.hpp>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <optional>
+#include <string>
+
+/*
+ * Latency instrumentation of database operations. Recording a value only
+ * increments a few atomic counters, so the metrics are always enabled.
+ * All classes in this file are thread safe.
+ */
+
+namespace blabber {
+
+using namespace prequel::short_types;
+
+using metrics_clock = std::chrono::steady_clock;
+
+// The instrumented API calls.
+enum class operation {
+    create_post,
+    create_comment,
+    fetch_frontpage,
+    fetch_post,
+    execute_batch,
+    search,
+};
+
+inline constexpr size_t operation_count = 6;
+
+// The phases of an API call.
+enum class phase {
+    // Waiting for the database mutex (or, for writes, for the group commit to start).
+    lock_wait,
+
+    // Starting the transaction.
+    begin,
+
+    // Executing the operation on the storage.
+    storage,
+
+    // Committing (including the journal sync) or rolling back the transaction.
+    commit,
+
+    // The complete call, including cache lookups.
+    total,
+};
+
+inline constexpr size_t phase_count = 5;
+
+const char* operation_name(operation op);
+const char* phase_name(phase ph);
+
+/*
+ * Time spent in the phases of a single operation. Phases that did not run
+ * are empty, e.g. everything but `total` for results served from a cache.
+ */
+struct operation_timings {
+    std::optional<metrics_clock::duration> lock_wait;
+    std::optional<metrics_clock::duration> begin;
+    std::optional<metrics_clock::duration> storage;
+    std::optional<metrics_clock::duration> commit;
+    metrics_clock::duration total{0};
+};
+
+/*
+ * Counts values in fixed buckets (1-2-5 series from 1 microsecond to 10 seconds).
+ */
+class latency_histogram {
+public:
+    static constexpr size_t bucket_count = 23;
+
+    // Upper bounds of the buckets (in microseconds), the last bucket has no upper bound.
+    static constexpr std::array<u64, bucket_count - 1> bucket_bounds = {
+        1,      2,      5,       10,      20,      50,      100,     200,
+        500,    1000,   2000,    5000,    10000,   20000,   50000,   100000,
+        200000, 500000, 1000000, 2000000, 5000000, 10000000};
+
+    struct snapshot {
+        // Number of values in every bucket (not cumulative).
+        std::array<u64, bucket_count> buckets{};
+        u64 count = 0;
+        std::chrono::nanoseconds sum{0};
+    };
+
+public:
+    latency_histogram() = default;
+
+    latency_histogram(const latency_histogram&) = delete;
+    latency_histogram& operator=(const latency_histogram&) = delete;
+
+    void record(metrics_clock::duration value);
+
+    snapshot get() const;
+
+private:
+    std::array<std::atomic<u64>, bucket_count> m_buckets{};
+    std::atomic<u64> m_count{0};
+    std::atomic<u64> m_sum_ns{0};
+};
+
+/*
+ * Latency histograms for every phase of every instrumented operation, and for checkpoints.
+ */
+class database_metrics {
+public:
+    database_metrics() = default;
+
+    database_metrics(const database_metrics&) = delete;
+    database_metrics& operator=(const database_metrics&) = delete;
+
+    void record(operation op, const operation_timings& timings);
+    void record_checkpoint(metrics_clock::duration duration);
+
+    const latency_histogram& histogram(operation op, phase ph) const {
+        return m_operations[static_cast<size_t>(op)][static_cast<size_t>(ph)];
+    }
+
+    const latency_histogram& checkpoints() const { return m_checkpoints; }
+
+    // Renders all histograms in the Prometheus text exposition format.
+    std::string prometheus_text() const;
+
+private:
+    latency_histogram& histogram_for(operation op, phase ph) {
+        return m_operations[static_cast<size_t>(op)][static_cast<size_t>(ph)];
+    }
+
+private:
+    std::array<std::array<latency_histogram, phase_count>, operation_count> m_operations;
+    latency_histogram m_checkpoints;
+};
+
+} // namespace blabber
+
+#endif // BLABBER_METRICS_HPP
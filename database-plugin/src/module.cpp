@@ -0,0 +1,1143 @@
+#include "async_queue.hpp"
+#include "database.hpp"
+
+#include <pybind11/pybind11.h>
+#include <pybind11/stl.h>
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+namespace blabber {
+
+namespace py = pybind11;
+
+/*
+ * The python interface of a database (exposed as `Database`). Converts arguments and results
+ * between python and native types and releases the GIL while the native database executes
+ * an operation. Also implements the asynchronous API on top of an asyncio event loop.
+ */
+class python_database {
+public:
+    explicit python_database(const std::string& path, const database_options& options);
+    ~python_database();
+
+    python_database(const python_database&) = delete;
+    python_database& operator=(const python_database&) = delete;
+
+    u64 create_post(const std::string& user, const std::string& title, const std::string& content);
+    bool create_comment(u64 post_id, const std::string& user, const std::string& content);
+    py::list fetch_frontpage(size_t max_posts);
+    py::list fetch_posts(std::optional<u64> before_id, size_t max_posts);
+    py::list fetch_posts_between(u64 start, u64 end, size_t max_posts,
+                                 std::optional<u64> before_id);
+    py::list fetch_active_posts(size_t max_posts);
+    py::list search(const std::string& query, size_t limit);
+    py::object fetch_post(u64 post_id, size_t max_comments);
+    py::object fetch_comments(u64 post_id, std::optional<u64> before, size_t limit);
+    py::dict fetch_user_activity(const std::string& user, size_t limit,
+                                 std::optional<std::tuple<u64, u64, u64>> cursor);
+
+    /*
+     * Bulk import of posts and comments. Items are read from the iterable and inserted
+     * in transactions of up to `batch_size` items.
+     * Every batch is atomic, the import as a whole is not.
+     */
+    py::dict bulk_insert_posts(py::iterable posts, size_t batch_size);
+    py::dict bulk_insert_comments(py::iterable comments, size_t batch_size);
+
+    // Operations are tuples, e.g. ("create_comment", post_id, user, content).
+    py::list execute_batch(py::iterable ops);
+    py::object execute_batch_async(py::iterable ops);
+
+    py::dict compact(const std::string& dest_path);
+
+    // Detaches from the event loop (if attached), then shuts down the database.
+    void finish();
+
+    /*
+     * Asynchronous API. Operations are queued and executed by internal worker threads.
+     * Their results are delivered through asyncio futures of the attached event loop:
+     * the loop watches a file descriptor that becomes readable when operations have finished,
+     * and completes their futures on the loop's thread.
+     */
+    void attach_event_loop(py::object loop);
+
+    // Waits for all pending operations and completes their futures, then detaches from the loop.
+    void detach_event_loop();
+
+    py::object create_post_async(std::string user, std::string title, std::string content);
+    py::object create_comment_async(u64 post_id, std::string user, std::string content);
+    py::object fetch_frontpage_async(size_t max_posts);
+    py::object fetch_post_async(u64 post_id, size_t max_comments);
+    py::object search_async(std::string query, size_t limit);
+
+    // Number of operations of the asynchronous API that have not completed yet.
+    size_t async_pending();
+
+    py::dict checkpoint_stats();
+    py::dict cache_stats();
+
+    // Latency histograms of the instrumented operations, as a dict or in the
+    // Prometheus text format.
+    py::dict metrics();
+    std::string metrics_text();
+
+    /*
+     * Returns block cache, I/O and journal statistics, together with the
+     * statistics of the result caches and checkpoints.
+     */
+    py::dict stats();
+
+    // The counters of the upgrade performed when the database was opened, or None.
+    py::object upgrade_stats();
+
+    void resize_cache(u32 cache_blocks);
+
+    std::string dump();
+
+private:
+    // Releases the GIL while `fn` is running and returns its result.
+    // `fn` must not execute python code.
+    template<typename Func>
+    static auto without_gil(Func&& fn) {
+        py::gil_scoped_release release;
+        return fn();
+    }
+
+    // Creates a future of the attached loop and queues the operation that completes it.
+    // `execute` runs on a worker thread, `convert(result)` on the loop's thread.
+    template<typename Execute, typename Convert>
+    py::object submit_async(Execute&& execute, Convert&& convert);
+
+    // Completes the futures of finished operations. Called by the event loop.
+    void complete_async();
+
+private:
+    database m_db;
+
+    // State of the asynchronous API. Only accessed while holding the GIL.
+    py::object m_loop;
+    std::unique_ptr<async_queue> m_async;
+};
+
+/*
+ * Conversion of query results to python objects.
+ *
+ * Strings are decoded directly from the native result (the only copy made for a string
+ * on its way to python; cached results are shared and not copied beforehand).
+ * Dictionary keys are created once and reused, lists are allocated with their final size.
+ */
+namespace {
+
+struct result_keys {
+    py::str id = "id";
+    py::str created_at = "created_at";
+    py::str user = "user";
+    py::str title = "title";
+    py::str content = "content";
+    py::str comments = "comments";
+    py::str comment_count = "comment_count";
+    py::str last_comment_at = "last_comment_at";
+    py::str next = "next";
+    py::str entries = "entries";
+    py::str post_id = "post_id";
+    py::str comment = "comment";
+    py::str text = "text";
+
+    // Must be called with the GIL held. Intentionally leaked: python objects
+    // must not be destroyed after the interpreter has been finalized.
+    static const result_keys& get() {
+        static const result_keys* keys = new result_keys();
+        return *keys;
+    }
+};
+
+py::str to_python(const std::string& str) {
+    PyObject* obj = PyUnicode_DecodeUTF8(str.data(), static_cast<Py_ssize_t>(str.size()), nullptr);
+    if (!obj)
+        throw py::error_already_set();
+    return py::reinterpret_steal<py::str>(obj);
+}
+
+py::int_ to_python(u64 value) {
+    return py::int_(value);
+}
+
+// Steals the reference of `item`, like PyList_SET_ITEM.
+void set_list_item(py::list& list, size_t index, py::object&& item) {
+    PyList_SET_ITEM(list.ptr(), static_cast<Py_ssize_t>(index), item.release().ptr());
+}
+
+py::dict to_python(const frontpage_result::post_entry& native_post) {
+    const result_keys& keys = result_keys::get();
+
+    py::dict post;
+    post[keys.id] = to_python(native_post.id);
+    post[keys.created_at] = to_python(native_post.created_at);
+    post[keys.user] = to_python(native_post.user);
+    post[keys.title] = to_python(native_post.title);
+    post[keys.comment_count] = to_python(native_post.comment_count);
+    post[keys.last_comment_at] = to_python(native_post.last_comment_at);
+    return post;
+}
+
+// Converts at most `max_posts` entries of the front page result.
+py::list to_python(const frontpage_result& result, size_t max_posts) {
+    const size_t count = std::min(result.entries.size(), max_posts);
+
+    py::list entries(count);
+    for (size_t i = 0; i < count; ++i) {
+        set_list_item(entries, i, to_python(result.entries[i]));
+    }
+    return entries;
+}
+
+// Converts at most `max_posts` of the shared front page entries.
+py::list to_python(const frontpage_entries& native_entries, size_t max_posts) {
+    const size_t count = std::min(native_entries.size(), max_posts);
+
+    py::list entries(count);
+    for (size_t i = 0; i < count; ++i) {
+        set_list_item(entries, i, to_python(*native_entries[i]));
+    }
+    return entries;
+}
+
+py::list
+to_python(const std::vector<post_result::comment_entry>& native_comments, size_t max_comments) {
+    const result_keys& keys = result_keys::get();
+    const size_t count = std::min(native_comments.size(), max_comments);
+
+    py::list comments(count);
+    for (size_t i = 0; i < count; ++i) {
+        const post_result::comment_entry& native_comment = native_comments[i];
+
+        py::dict comment;
+        comment[keys.created_at] = to_python(native_comment.created_at);
+        comment[keys.user] = to_python(native_comment.user);
+        comment[keys.content] = to_python(native_comment.content);
+        set_list_item(comments, i, std::move(comment));
+    }
+    return comments;
+}
+
+// Converts the post and at most `max_comments` of its comments.
+py::dict to_python(const post_result& result, size_t max_comments) {
+    const result_keys& keys = result_keys::get();
+
+    py::dict post;
+    post[keys.id] = to_python(result.id);
+    post[keys.created_at] = to_python(result.created_at);
+    post[keys.user] = to_python(result.user);
+    post[keys.title] = to_python(result.title);
+    post[keys.content] = to_python(result.content);
+    post[keys.comment_count] = to_python(result.comment_count);
+    post[keys.last_comment_at] = to_python(result.last_comment_at);
+    post[keys.comments] = to_python(result.comments, max_comments);
+    return post;
+}
+
+py::dict to_python(const comments_result& result) {
+    const result_keys& keys = result_keys::get();
+
+    py::dict page;
+    page[keys.comments] = to_python(result.comments, result.comments.size());
+    if (result.next_before) {
+        page[keys.next] = to_python(*result.next_before);
+    } else {
+        page[keys.next] = py::none();
+    }
+    return page;
+}
+
+py::dict to_python(const user_activity_result& result) {
+    const result_keys& keys = result_keys::get();
+
+    py::list entries(result.entries.size());
+    for (size_t i = 0; i < result.entries.size(); ++i) {
+        const user_activity_result::entry& native_entry = result.entries[i];
+
+        py::dict entry;
+        entry[keys.created_at] = to_python(native_entry.created_at);
+        entry[keys.post_id] = to_python(native_entry.post_id);
+        if (native_entry.comment) {
+            entry[keys.comment] = to_python(*native_entry.comment);
+        } else {
+            entry[keys.comment] = py::none();
+        }
+        entry[keys.text] = to_python(native_entry.text);
+        set_list_item(entries, i, std::move(entry));
+    }
+
+    py::dict page;
+    page[keys.entries] = std::move(entries);
+    if (result.next) {
+        page[keys.next] = py::make_tuple(result.next->created_at, result.next->post_id,
+                                         result.next->comment);
+    } else {
+        page[keys.next] = py::none();
+    }
+    return page;
+}
+
+} // namespace
+
+python_database::python_database(const std::string& path, const database_options& options)
+    : m_db(path, options) {}
+
+python_database::~python_database() {
+    if (m_loop) {
+        try {
+            detach_event_loop();
+        } catch (const std::exception& e) {
+            fmt::print(stderr, "Failed to detach the database from the event loop: {}\n",
+                       e.what());
+        }
+    }
+}
+
+void python_database::finish() {
+    if (m_loop) {
+        detach_event_loop();
+    }
+    without_gil([&] { m_db.finish(); });
+}
+
+std::string python_database::dump() {
+    return without_gil([&] { return m_db.dump(); });
+}
+
+u64 python_database::create_post(const std::string& user, const std::string& title,
+                                 const std::string& content) {
+    return without_gil([&] { return m_db.create_post(user, title, content); });
+}
+
+bool python_database::create_comment(u64 post_id, const std::string& user,
+                                     const std::string& content) {
+    return without_gil([&] { return m_db.create_comment(post_id, user, content); });
+}
+
+py::list python_database::fetch_frontpage(size_t max_posts) {
+    auto result = without_gil([&] { return m_db.fetch_frontpage(max_posts); });
+    return to_python(*result, max_posts);
+}
+
+py::list python_database::fetch_posts(std::optional<u64> before_id, size_t max_posts) {
+    auto result = without_gil([&] { return m_db.fetch_posts(before_id, max_posts); });
+    return to_python(result, max_posts);
+}
+
+py::list python_database::fetch_posts_between(u64 start, u64 end, size_t max_posts,
+                                              std::optional<u64> before_id) {
+    auto result =
+        without_gil([&] { return m_db.fetch_posts_between(start, end, max_posts, before_id); });
+    return to_python(result, max_posts);
+}
+
+py::list python_database::fetch_active_posts(size_t max_posts) {
+    auto result = without_gil([&] { return m_db.fetch_active_posts(max_posts); });
+    return to_python(result, max_posts);
+}
+
+py::list python_database::search(const std::string& query, size_t limit) {
+    auto result = without_gil([&] { return m_db.search(query, limit); });
+    return to_python(result, limit);
+}
+
+py::object python_database::fetch_post(u64 post_id, size_t max_comments) {
+    auto result = without_gil([&] { return m_db.fetch_post(post_id, max_comments); });
+    if (!result)
+        return py::none();
+
+    // Cached results may contain more comments than requested.
+    return to_python(*result, max_comments);
+}
+
+py::object python_database::fetch_comments(u64 post_id, std::optional<u64> before,
+                                           size_t limit) {
+    auto result = without_gil([&] { return m_db.fetch_comments(post_id, before, limit); });
+    if (!result)
+        return py::none();
+    return to_python(*result);
+}
+
+py::dict python_database::fetch_user_activity(const std::string& user, size_t limit,
+                                              std::optional<std::tuple<u64, u64, u64>> cursor) {
+    std::optional<user_activity_result::position> position;
+    if (cursor) {
+        auto [created_at, post_id, comment] = *cursor;
+        position = user_activity_result::position{created_at, post_id, comment};
+    }
+
+    auto result = without_gil([&] { return m_db.fetch_user_activity(user, limit, position); });
+    return to_python(result);
+}
+
+namespace {
+
+batch::op parse_batch_op(py::handle item) {
+    py::tuple fields(py::reinterpret_borrow<py::object>(item));
+    if (fields.size() == 0) {
+        throw py::value_error("Empty batch operation.");
+    }
+
+    auto expect_fields = [&](size_t count) {
+        if (fields.size() != count) {
+            throw py::value_error(fmt::format("Expected {} fields for operation \"{}\", got {}.",
+                                              count, fields[0].cast<std::string>(),
+                                              fields.size()));
+        }
+    };
+
+    const std::string name = fields[0].cast<std::string>();
+    if (name == "create_post") {
+        expect_fields(4);
+        return batch::create_post{fields[1].cast<std::string>(), fields[2].cast<std::string>(),
+                                  fields[3].cast<std::string>()};
+    }
+    if (name == "create_comment") {
+        expect_fields(4);
+        return batch::create_comment{fields[1].cast<u64>(), fields[2].cast<std::string>(),
+                                     fields[3].cast<std::string>()};
+    }
+    if (name == "fetch_frontpage") {
+        expect_fields(2);
+        return batch::fetch_frontpage{fields[1].cast<size_t>()};
+    }
+    if (name == "fetch_post") {
+        expect_fields(3);
+        return batch::fetch_post{fields[1].cast<u64>(), fields[2].cast<size_t>()};
+    }
+    throw py::value_error(fmt::format("Unknown batch operation: \"{}\".", name));
+}
+
+std::vector<batch::op> parse_batch(py::iterable ops) {
+    std::vector<batch::op> result;
+    for (py::iterator it = py::iter(ops); it != py::iterator::sentinel(); ++it) {
+        result.push_back(parse_batch_op(*it));
+    }
+    return result;
+}
+
+py::list batch_to_python(const std::vector<batch::op>& ops,
+                         const std::vector<batch::result>& results) {
+    py::list list(results.size());
+    for (size_t i = 0; i < results.size(); ++i) {
+        py::object value;
+        if (auto id = std::get_if<u64>(&results[i])) {
+            value = py::cast(*id);
+        } else if (auto ok = std::get_if<bool>(&results[i])) {
+            value = py::cast(*ok);
+        } else if (auto frontpage =
+                       std::get_if<std::shared_ptr<const frontpage_entries>>(&results[i])) {
+            value = to_python(**frontpage, std::get<batch::fetch_frontpage>(ops[i]).max_posts);
+        } else {
+            const auto& post = std::get<std::shared_ptr<const post_result>>(results[i]);
+            if (post) {
+                value = to_python(*post, std::get<batch::fetch_post>(ops[i]).max_comments);
+            } else {
+                value = py::none();
+            }
+        }
+        set_list_item(list, i, std::move(value));
+    }
+    return list;
+}
+
+} // namespace
+
+py::list python_database::execute_batch(py::iterable ops) {
+    std::vector<batch::op> parsed = parse_batch(ops);
+    auto results = without_gil([&] { return m_db.execute_batch(parsed); });
+    return batch_to_python(parsed, results);
+}
+
+namespace {
+
+// Converts the exception to a python exception object, in the same way as exceptions
+// of synchronous calls are translated.
+py::object to_python_exception(std::exception_ptr error) {
+    PyObject* type = PyExc_RuntimeError;
+    std::string message = "Unknown error.";
+    try {
+        std::rethrow_exception(error);
+    } catch (const std::invalid_argument& e) {
+        type = PyExc_ValueError;
+        message = e.what();
+    } catch (const std::bad_alloc& e) {
+        type = PyExc_MemoryError;
+        message = e.what();
+    } catch (const std::exception& e) {
+        message = e.what();
+    } catch (...) {
+    }
+    return py::reinterpret_borrow<py::object>(type)(message);
+}
+
+/*
+ * An operation of the asynchronous API that completes an asyncio future.
+ * The future is only touched in complete(), which runs with the GIL held.
+ */
+template<typename Result>
+class future_operation final : public async_operation {
+public:
+    future_operation(py::object future, std::function<Result()> execute,
+                     std::function<py::object(const Result&)> convert)
+        : m_future(std::move(future))
+        , m_execute(std::move(execute))
+        , m_convert(std::move(convert)) {}
+
+    void run() noexcept override {
+        try {
+            m_result = m_execute();
+        } catch (...) {
+            m_error = std::current_exception();
+        }
+    }
+
+    void complete() override {
+        // The future may have been cancelled in the meantime.
+        if (m_future.attr("done")().cast<bool>())
+            return;
+
+        if (m_error) {
+            m_future.attr("set_exception")(to_python_exception(m_error));
+        } else {
+            m_future.attr("set_result")(m_convert(*m_result));
+        }
+    }
+
+    void fail(std::exception_ptr error) noexcept override {
+        // Nothing else can be done if the future cannot be completed at all.
+        try {
+            if (!m_future.attr("done")().cast<bool>())
+                m_future.attr("set_exception")(to_python_exception(error));
+        } catch (...) {
+        }
+    }
+
+private:
+    py::object m_future;
+    std::function<Result()> m_execute;
+    std::function<py::object(const Result&)> m_convert;
+    std::optional<Result> m_result;
+    std::exception_ptr m_error;
+};
+
+} // namespace
+
+void python_database::attach_event_loop(py::object loop) {
+    if (m_loop) {
+        throw std::logic_error("The database is already attached to an event loop.");
+    }
+    if (!without_gil([&] { return m_db.is_open(); })) {
+        throw std::logic_error("The database has been shut down.");
+    }
+
+    m_async = std::make_unique<async_queue>(m_db.options().async_workers,
+                                             m_db.options().async_max_pending);
+    loop.attr("add_reader")(m_async->notify_fd(), py::cpp_function([this] { complete_async(); }));
+    m_loop = std::move(loop);
+}
+
+void python_database::detach_event_loop() {
+    if (!m_loop) {
+        throw std::logic_error("The database is not attached to an event loop.");
+    }
+
+    {
+        // Running operations need the database mutex, but not the GIL.
+        py::gil_scoped_release release;
+        m_async->stop();
+    }
+    complete_async();
+
+    m_loop.attr("remove_reader")(m_async->notify_fd());
+    m_async.reset();
+    m_loop = py::object();
+}
+
+void python_database::complete_async() {
+    if (m_async)
+        m_async->drain();
+}
+
+size_t python_database::async_pending() {
+    return m_async ? m_async->pending() : 0;
+}
+
+template<typename Execute, typename Convert>
+py::object python_database::submit_async(Execute&& execute, Convert&& convert) {
+    if (!m_loop) {
+        throw std::logic_error("The database is not attached to an event loop.");
+    }
+
+    using result_type = std::decay_t<decltype(execute())>;
+    py::object future = m_loop.attr("create_future")();
+    std::unique_ptr<async_operation> op = std::make_unique<future_operation<result_type>>(
+        future, std::forward<Execute>(execute), std::forward<Convert>(convert));
+    if (!m_async->submit(op)) {
+        throw database_error("Too many pending database operations.");
+    }
+    return future;
+}
+
+py::object python_database::create_post_async(std::string user, std::string title,
+                                              std::string content) {
+    return submit_async(
+        [this, user = std::move(user), title = std::move(title), content = std::move(content)] {
+            return m_db.create_post(user, title, content);
+        },
+        [](u64 id) { return py::cast(id); });
+}
+
+py::object python_database::create_comment_async(u64 post_id, std::string user,
+                                                 std::string content) {
+    return submit_async(
+        [this, post_id, user = std::move(user), content = std::move(content)] {
+            return m_db.create_comment(post_id, user, content);
+        },
+        [](bool ok) { return py::cast(ok); });
+}
+
+py::object python_database::fetch_frontpage_async(size_t max_posts) {
+    return submit_async([this, max_posts] { return m_db.fetch_frontpage(max_posts); },
+                        [max_posts](const std::shared_ptr<const frontpage_entries>& result) {
+                            return py::object(to_python(*result, max_posts));
+                        });
+}
+
+py::object python_database::fetch_post_async(u64 post_id, size_t max_comments) {
+    return submit_async(
+        [this, post_id, max_comments] { return m_db.fetch_post(post_id, max_comments); },
+        [max_comments](const std::shared_ptr<const post_result>& result) {
+            if (!result)
+                return py::object(py::none());
+            return py::object(to_python(*result, max_comments));
+        });
+}
+
+py::object python_database::search_async(std::string query, size_t limit) {
+    return submit_async(
+        [this, query = std::move(query), limit] { return m_db.search(query, limit); },
+        [limit](const frontpage_result& result) { return py::object(to_python(result, limit)); });
+}
+
+py::object python_database::execute_batch_async(py::iterable ops) {
+    auto parsed = std::make_shared<const std::vector<batch::op>>(parse_batch(ops));
+    return submit_async([this, parsed] { return m_db.execute_batch(*parsed); },
+                        [parsed](const std::vector<batch::result>& results) {
+                            return py::object(batch_to_python(*parsed, results));
+                        });
+}
+
+namespace {
+
+// Returns the fields of a tuple-like item of a bulk import.
+// Checks that the number of fields is in [min_fields, max_fields].
+py::tuple bulk_item_fields(py::handle item, size_t min_fields, size_t max_fields) {
+    py::tuple fields(py::reinterpret_borrow<py::object>(item));
+    if (fields.size() < min_fields || fields.size() > max_fields) {
+        throw py::value_error(fmt::format("Expected between {} and {} fields, got {}.", min_fields,
+                                          max_fields, fields.size()));
+    }
+    return fields;
+}
+
+// Returns the optional timestamp at the given index.
+std::optional<u64> bulk_item_timestamp(const py::tuple& fields, size_t index) {
+    if (index < fields.size() && !fields[index].is_none())
+        return fields[index].cast<u64>();
+    return {};
+}
+
+py::dict bulk_stats(u64 count, std::chrono::steady_clock::duration duration) {
+    const double seconds = std::chrono::duration<double>(duration).count();
+
+    py::dict result;
+    result["count"] = count;
+    result["seconds"] = seconds;
+    result["per_second"] = seconds > 0 ? count / seconds : 0.0;
+    return result;
+}
+
+} // namespace
+
+py::dict python_database::bulk_insert_posts(py::iterable posts, size_t batch_size) {
+    if (batch_size == 0) {
+        throw std::invalid_argument("The batch size must not be zero.");
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    py::list ids;
+    std::vector<database::new_post> batch;
+
+    py::iterator it = py::iter(posts);
+    while (it != py::iterator::sentinel()) {
+        // Convert the next batch while holding the GIL.
+        batch.clear();
+        for (; it != py::iterator::sentinel() && batch.size() < batch_size; ++it) {
+            py::tuple fields = bulk_item_fields(*it, 3, 4);
+
+            database::new_post& p = batch.emplace_back();
+            p.user = fields[0].cast<std::string>();
+            p.title = fields[1].cast<std::string>();
+            p.content = fields[2].cast<std::string>();
+            p.created_at = bulk_item_timestamp(fields, 3);
+        }
+
+        for (u64 id : without_gil([&] { return m_db.insert_posts(batch); })) {
+            ids.append(id);
+        }
+    }
+
+    py::dict result = bulk_stats(ids.size(), std::chrono::steady_clock::now() - start);
+    result["ids"] = std::move(ids);
+    return result;
+}
+
+// Comments for nonexistent posts are skipped and counted as `missing`.
+py::dict python_database::bulk_insert_comments(py::iterable comments, size_t batch_size) {
+    if (batch_size == 0) {
+        throw std::invalid_argument("The batch size must not be zero.");
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    u64 count = 0;
+    u64 missing = 0;
+    std::map<u64, std::vector<post_result::comment_entry>> batch;
+
+    py::iterator it = py::iter(comments);
+    while (it != py::iterator::sentinel()) {
+        // Convert the next batch while holding the GIL.
+        batch.clear();
+        size_t batch_count = 0;
+        for (; it != py::iterator::sentinel() && batch_count < batch_size; ++it, ++batch_count) {
+            py::tuple fields = bulk_item_fields(*it, 3, 4);
+
+            post_result::comment_entry& c = batch[fields[0].cast<u64>()].emplace_back();
+            c.user = fields[1].cast<std::string>();
+            c.content = fields[2].cast<std::string>();
+            c.created_at = bulk_item_timestamp(fields, 3).value_or(current_timestamp());
+        }
+
+        const u64 batch_missing = without_gil([&] { return m_db.insert_comments(batch); });
+        count += batch_count - batch_missing;
+        missing += batch_missing;
+    }
+
+    py::dict result = bulk_stats(count, std::chrono::steady_clock::now() - start);
+    result["missing"] = missing;
+    return result;
+}
+
+py::dict python_database::compact(const std::string& dest_path) {
+    const auto start = std::chrono::steady_clock::now();
+    const compact_stats stats = without_gil([&] { return m_db.compact(dest_path); });
+
+    py::dict result;
+    result["posts"] = stats.copied.posts;
+    result["comments"] = stats.copied.comments;
+    result["adjusted_timestamps"] = stats.copied.adjusted_timestamps;
+    result["seconds"] =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result["source_bytes"] = stats.source_bytes;
+    result["dest_bytes"] = stats.dest_bytes;
+    return result;
+}
+
+py::dict python_database::metrics() {
+    auto convert = [](const latency_histogram& histogram) {
+        const latency_histogram::snapshot hist = histogram.get();
+
+        // (upper bound in seconds, cumulative count) pairs, the last bound is infinite.
+        py::list buckets;
+        u64 cumulative = 0;
+        for (size_t i = 0; i < latency_histogram::bucket_count; ++i) {
+            cumulative += hist.buckets[i];
+            const double bound = i < latency_histogram::bucket_bounds.size()
+                                     ? latency_histogram::bucket_bounds[i] / 1e6
+                                     : std::numeric_limits<double>::infinity();
+            buckets.append(py::make_tuple(bound, cumulative));
+        }
+
+        py::dict result;
+        result["count"] = hist.count;
+        result["sum_seconds"] = std::chrono::duration<double>(hist.sum).count();
+        result["buckets"] = buckets;
+        return result;
+    };
+
+    const database_metrics& metrics = m_db.metrics();
+    py::dict operations;
+    for (size_t op = 0; op < operation_count; ++op) {
+        py::dict phases;
+        for (size_t ph = 0; ph < phase_count; ++ph) {
+            phases[phase_name(phase(ph))] = convert(metrics.histogram(operation(op), phase(ph)));
+        }
+        operations[operation_name(operation(op))] = phases;
+    }
+
+    py::dict result;
+    result["operations"] = operations;
+    result["checkpoints"] = convert(metrics.checkpoints());
+    return result;
+}
+
+std::string python_database::metrics_text() {
+    return m_db.metrics().prometheus_text();
+}
+
+py::dict python_database::checkpoint_stats() {
+    const blabber::checkpoint_stats stats = m_db.checkpoint_stats();
+
+    using seconds = std::chrono::duration<double>;
+    py::dict result;
+    result["count"] = stats.count;
+    result["total_seconds"] = seconds(stats.total_duration).count();
+    result["last_seconds"] = seconds(stats.last_duration).count();
+    result["max_seconds"] = seconds(stats.max_duration).count();
+    result["last_journal_size"] = stats.last_journal_size;
+    return result;
+}
+
+py::dict python_database::cache_stats() {
+    auto convert = [](const blabber::cache_stats& stats) {
+        py::dict result;
+        result["hits"] = stats.hits;
+        result["misses"] = stats.misses;
+        result["evictions"] = stats.evictions;
+        result["entries"] = stats.entries;
+        result["bytes"] = stats.bytes;
+        return result;
+    };
+
+    const result_cache_stats stats = m_db.cache_stats();
+
+    py::dict result;
+    result["frontpage"] = convert(stats.frontpage);
+    result["posts"] = convert(stats.posts);
+
+    py::dict users;
+    users["hits"] = stats.users.hits;
+    users["misses"] = stats.users.misses;
+    users["evictions"] = stats.users.evictions;
+    users["entries"] = stats.users.entries;
+    result["users"] = users;
+    return result;
+}
+
+py::dict python_database::stats() {
+    const database_stats stats = without_gil([&] { return m_db.stats(); });
+
+    auto convert = [](const io_stats& stats) {
+        py::dict result;
+        result["reads"] = stats.reads;
+        result["read_bytes"] = stats.read_bytes;
+        result["writes"] = stats.writes;
+        result["write_bytes"] = stats.write_bytes;
+        result["syncs"] = stats.syncs;
+        return result;
+    };
+
+    // The engine does not report its cache hits, evictions or resident size. The number of
+    // blocks read from the database file is an upper bound for the misses: reads of blocks
+    // that live in the journal are not included, reads done by checkpoints and snapshot
+    // reads are.
+    py::dict block_cache;
+    block_cache["capacity_blocks"] = stats.cache_blocks;
+    block_cache["capacity_bytes"] = u64(stats.cache_blocks) * database::BLOCK_SIZE;
+    block_cache["database_blocks_read"] = stats.database_io.read_bytes / database::BLOCK_SIZE;
+
+    py::dict io;
+    io["database"] = convert(stats.database_io);
+    io["journal"] = convert(stats.journal_io);
+
+    // Modified blocks are written to the journal on commit and remain there until
+    // the next checkpoint.
+    py::dict journal;
+    journal["bytes"] = stats.journal_bytes;
+    journal["blocks"] = stats.journal_bytes / database::BLOCK_SIZE;
+
+    // Read only operations served by a snapshot of the database file, and those that had
+    // to use the engine because they depend on changes in the journal.
+    py::dict snapshots;
+    snapshots["enabled"] = m_db.options().snapshot_reads;
+    snapshots["mmap"] = m_db.options().mmap_reads;
+    snapshots["reads"] = stats.snapshot_reads;
+    snapshots["fallbacks"] = stats.snapshot_fallbacks;
+
+    py::dict result;
+    result["size_bytes"] = stats.size_bytes;
+    result["block_cache"] = block_cache;
+    result["snapshots"] = snapshots;
+    result["io"] = io;
+    result["journal"] = journal;
+    result["result_caches"] = cache_stats();
+    result["checkpoints"] = checkpoint_stats();
+    return result;
+}
+
+py::object python_database::upgrade_stats() {
+    const std::optional<copy_stats>& stats = m_db.upgrade_stats();
+    if (!stats)
+        return py::none();
+
+    py::dict result;
+    result["posts"] = stats->posts;
+    result["comments"] = stats->comments;
+    result["adjusted_timestamps"] = stats->adjusted_timestamps;
+    return result;
+}
+
+void python_database::resize_cache(u32 cache_blocks) {
+    without_gil([&] { m_db.resize_cache(cache_blocks); });
+}
+
+static sync_mode parse_sync_mode(const std::string& mode) {
+    if (mode == "full")
+        return sync_mode::full;
+    if (mode == "periodic")
+        return sync_mode::periodic;
+    if (mode == "none")
+        return sync_mode::none;
+    throw std::invalid_argument(fmt::format("Invalid sync mode: \"{}\".", mode));
+}
+
+} // namespace blabber
+
+using namespace blabber;
+
+PYBIND11_MODULE(blabber_database, m) {
+    m.doc() =
+        "Blabber database native module.\n"
+        "Implements database operations as atomic transactions "
+        "using the prequel library.";
+
+    py::class_<python_database>(m, "Database")
+        .def(py::init([](const std::string& path, u32 cache_blocks, u32 group_commit_window_us,
+                         u32 group_commit_max_ops, const std::string& sync, u32 sync_interval_ms,
+                         u64 checkpoint_threshold, u32 checkpoint_interval_ms,
+                         u32 frontpage_cache_size, u64 post_cache_bytes, u32 user_cache_size,
+                         u32 compression_threshold, u32 async_workers, u32 async_max_pending,
+                         bool snapshot_reads, bool mmap_reads) {
+                 database_options options;
+                 options.cache_blocks = cache_blocks;
+                 options.group_commit_window = std::chrono::microseconds(group_commit_window_us);
+                 options.group_commit_max_ops = group_commit_max_ops;
+                 options.sync = parse_sync_mode(sync);
+                 options.sync_interval = std::chrono::milliseconds(sync_interval_ms);
+                 options.checkpoint_threshold = checkpoint_threshold;
+                 options.checkpoint_interval = std::chrono::milliseconds(checkpoint_interval_ms);
+                 options.frontpage_cache_size = frontpage_cache_size;
+                 options.post_cache_bytes = post_cache_bytes;
+                 options.user_cache_size = user_cache_size;
+                 options.compression_threshold = compression_threshold;
+                 options.async_workers = async_workers;
+                 options.async_max_pending = async_max_pending;
+                 options.snapshot_reads = snapshot_reads;
+                 options.mmap_reads = mmap_reads;
+                 return std::make_unique<python_database>(path, options);
+             }),
+             "Create a new database object with the given path and cache size (in blocks).\n"
+             "Concurrent writes are committed in groups: the first writer waits up to\n"
+             "`group_commit_window_us` microseconds for others to join, and a single\n"
+             "transaction contains at most `group_commit_max_ops` writes.\n"
+             "The `sync` mode controls durability: \"full\" syncs the journal on every commit,\n"
+             "\"periodic\" syncs it every `sync_interval_ms` milliseconds in the background and\n"
+             "\"none\" only syncs before checkpoints and on shutdown.\n"
+             "Checkpoints run in a background thread once the journal is larger than\n"
+             "`checkpoint_threshold` bytes or, if `checkpoint_interval_ms` is not zero,\n"
+             "when the last checkpoint is older than the interval.\n"
+             "The latest `frontpage_cache_size` front page entries are kept in memory.\n"
+             "Post query results are cached in up to `post_cache_bytes` bytes of memory.\n"
+             "The names of up to `user_cache_size` users are kept in memory.\n"
+             "Strings of at least `compression_threshold` bytes are stored compressed\n"
+             "(0 disables compression).\n"
+             "Operations of the asynchronous API are executed by `async_workers` threads,\n"
+             "at most `async_max_pending` of them can be pending at the same time.\n"
+             "Read only operations that do not depend on changes since the last checkpoint\n"
+             "read a snapshot of the database file without blocking each other or writers.\n"
+             "`snapshot_reads=False` makes all reads use the engine and its block cache.\n"
+             "With `mmap_reads`, snapshots are read through a memory mapping and the block\n"
+             "cache shrinks to an eighth of `cache_blocks` (at least 256 blocks).\n"
+             "Database files must not be opened more than once.",
+             py::arg("path"), py::arg("cache_blocks"), py::arg("group_commit_window_us") = 0,
+             py::arg("group_commit_max_ops") = 64, py::arg("sync") = "full",
+             py::arg("sync_interval_ms") = 100, py::arg("checkpoint_threshold") = 1 << 20,
+             py::arg("checkpoint_interval_ms") = 0, py::arg("frontpage_cache_size") = 100,
+             py::arg("post_cache_bytes") = 8 << 20, py::arg("user_cache_size") = 100000,
+             py::arg("compression_threshold") = 512,
+             py::arg("async_workers") = 8, py::arg("async_max_pending") = 1000,
+             py::arg("snapshot_reads") = true, py::arg("mmap_reads") = false)
+
+        .def("create_post", &python_database::create_post, "Create a post.", py::arg("user"),
+             py::arg("title"), py::arg("content"))
+
+        .def("create_comment", &python_database::create_comment, "Create a comment in a post.",
+             py::arg("post_id"), py::arg("user"), py::arg("content"))
+
+        .def("fetch_frontpage", &python_database::fetch_frontpage,
+             "Fetch the content of the front page. Returns the N latest posts.",
+             py::arg("max_posts"))
+
+        .def("fetch_posts", &python_database::fetch_posts,
+             "Fetch up to N posts older than `before_id` (newest first). Starts with the\n"
+             "newest post if `before_id` is None. Returns the same entries as fetch_frontpage.",
+             py::arg("before_id") = py::none(), py::arg("max_posts") = 100)
+
+        .def("fetch_posts_between", &python_database::fetch_posts_between,
+             "Fetch up to N posts created between the unix timestamps `start` and `end`\n"
+             "(both inclusive, newest first). Pass the id of the last post of a page as\n"
+             "`before_id` to fetch the next (older) page of the same range.",
+             py::arg("start"), py::arg("end"), py::arg("max_posts") = 100,
+             py::arg("before_id") = py::none())
+
+        .def("fetch_active_posts", &python_database::fetch_active_posts,
+             "Fetch up to N posts ordered by their last activity (the creation of the post\n"
+             "or of its newest comment, most recent first). Returns the same entries as\n"
+             "fetch_frontpage.",
+             py::arg("max_posts") = 100)
+
+        .def("search", &python_database::search,
+             "Search the titles, contents and comments of all posts. Returns up to `limit`\n"
+             "matching posts (best match first) with the same entries as fetch_frontpage.\n"
+             "Only the newest 1000 posts of every query token are scanned: if even the rarest\n"
+             "token occurs in more posts, older posts that match the query are not returned.",
+             py::arg("query"), py::arg("limit") = 20)
+
+        .def("fetch_post", &python_database::fetch_post,
+             "Fetch the content of a post. Returns the N latest comments.", py::arg("post_id"),
+             py::arg("max_comments"))
+
+        .def("fetch_comments", &python_database::fetch_comments,
+             "Fetch a page of comments of a post (newest first). Returns None if the post\n"
+             "does not exist, otherwise a dict with the `comments` and the cursor for the next\n"
+             "(older) page in `next`. `next` is None on the last page. Pass `before=None`\n"
+             "to start with the newest comment.",
+             py::arg("post_id"), py::arg("before") = py::none(), py::arg("limit") = 100)
+
+        .def("fetch_user_activity", &python_database::fetch_user_activity,
+             "Fetch a page of the posts and comments of a user (newest first). Returns a dict\n"
+             "with the `entries` and the cursor for the next (older) page in `next`, which is\n"
+             "None on the last page. Every entry has the `post_id`, `created_at` and `text`\n"
+             "(the title of a post or the content of a comment); `comment` is the position\n"
+             "of the comment in its post or None for posts. Pass `cursor=None` to start\n"
+             "with the newest entry.",
+             py::arg("user"), py::arg("limit") = 20, py::arg("cursor") = py::none())
+
+        .def("bulk_insert_posts", &python_database::bulk_insert_posts,
+             "Insert many posts. `posts` is an iterable of (user, title, content[, created_at])\n"
+             "tuples. Posts are inserted in transactions of `batch_size` posts.\n"
+             "Posts without `created_at` use the current time. Explicit timestamps must not\n"
+             "be smaller than the one of the previous post, otherwise ValueError is raised\n"
+             "and the current batch is rolled back (earlier batches remain committed).\n"
+             "Returns a dict with the new `ids`, the `count` and the throughput\n"
+             "(`seconds`, `per_second`).",
+             py::arg("posts"), py::arg("batch_size") = 10000)
+
+        .def("bulk_insert_comments", &python_database::bulk_insert_comments,
+             "Insert many comments. `comments` is an iterable of\n"
+             "(post_id, user, content[, created_at]) tuples. Comments are inserted in\n"
+             "transactions of `batch_size` comments. Comments of nonexistent posts are skipped.\n"
+             "Returns a dict with the `count`, the number of skipped comments (`missing`)\n"
+             "and the throughput (`seconds`, `per_second`).",
+             py::arg("comments"), py::arg("batch_size") = 10000)
+
+        .def("compact", &python_database::compact,
+             "Write a compacted copy of the database to a new database file at `dest_path`.\n"
+             "Posts and comments are written in id order, the strings of a post together.\n"
+             "Reads and writes continue during the copy, only a final step that copies the\n"
+             "changes made in the meantime blocks them. Returns a dict with the number\n"
+             "of `posts` and `comments`, the duration in `seconds`, the file sizes\n"
+             "(`source_bytes`, `dest_bytes`) and the number of posts whose creation time\n"
+             "was raised to keep posts sorted by time (`adjusted_timestamps`).",
+             py::arg("dest_path"))
+
+        .def("finish", &python_database::finish, "Perform a clean shutdown of the database.")
+
+        .def("attach_event_loop", &python_database::attach_event_loop,
+             "Attach the database to an asyncio event loop, which enables the *_async\n"
+             "methods. They return futures of that loop and must be called from its thread.",
+             py::arg("loop"))
+
+        .def("detach_event_loop", &python_database::detach_event_loop,
+             "Wait for all pending asynchronous operations, then detach from the event loop.\n"
+             "Called automatically by finish().")
+
+        .def("create_post_async", &python_database::create_post_async,
+             "Like create_post, but returns a future.", py::arg("user"), py::arg("title"),
+             py::arg("content"))
+
+        .def("create_comment_async", &python_database::create_comment_async,
+             "Like create_comment, but returns a future.", py::arg("post_id"), py::arg("user"),
+             py::arg("content"))
+
+        .def("fetch_frontpage_async", &python_database::fetch_frontpage_async,
+             "Like fetch_frontpage, but returns a future.", py::arg("max_posts"))
+
+        .def("fetch_post_async", &python_database::fetch_post_async,
+             "Like fetch_post, but returns a future.", py::arg("post_id"),
+             py::arg("max_comments"))
+
+        .def("search_async", &python_database::search_async,
+             "Like search, but returns a future.", py::arg("query"), py::arg("limit") = 20)
+
+        .def("execute_batch", &python_database::execute_batch,
+             "Execute a list of operations in a single transaction and return the list of\n"
+             "their results. Operations are tuples:\n"
+             "  (\"create_post\", user, title, content) -> post id\n"
+             "  (\"create_comment\", post_id, user, content) -> True if the post exists\n"
+             "  (\"fetch_frontpage\", max_posts) -> list of posts\n"
+             "  (\"fetch_post\", post_id, max_comments) -> post or None\n"
+             "Operations see the changes of earlier operations in the same batch.",
+             py::arg("ops"))
+
+        .def("execute_batch_async", &python_database::execute_batch_async,
+             "Like execute_batch, but returns a future.", py::arg("ops"))
+
+        .def("async_pending", &python_database::async_pending,
+             "Returns the number of asynchronous operations that have not completed yet.")
+
+        .def("checkpoint_stats", &python_database::checkpoint_stats,
+             "Returns statistics about the checkpoints executed so far.")
+
+        .def("cache_stats", &python_database::cache_stats,
+             "Returns hit and miss counters of the front page and post caches.")
+
+        .def("metrics", &python_database::metrics,
+             "Returns latency histograms for every phase (lock_wait, begin, storage, commit,\n"
+             "total) of the create_post, create_comment, fetch_frontpage and fetch_post\n"
+             "operations and for checkpoints. Buckets are (upper bound in seconds,\n"
+             "cumulative count) pairs.")
+
+        .def("metrics_text", &python_database::metrics_text,
+             "Returns the latency histograms in the Prometheus text exposition format.")
+
+        .def("stats", &python_database::stats,
+             "Returns block cache capacity, I/O, journal, result cache and checkpoint statistics.")
+
+        .def("upgrade_stats", &python_database::upgrade_stats,
+             "Returns the number of `posts` and `comments` copied when the database file was\n"
+             "upgraded to the current format on open, and the number of posts whose creation\n"
+             "time was raised to keep posts sorted by time (`adjusted_timestamps`).\n"
+             "Returns None if the file was already in the current format.")
+
+        .def("resize_cache", &python_database::resize_cache,
+             "Changes the size of the block cache (in blocks). The cache starts out empty.",
+             py::arg("cache_blocks"))
+
+        .def("dump", &python_database::dump, "Dump the database into a string for debugging.");
+}
@@ -0,0 +1,222 @@
+#include "result_cache.hpp"
+
+#include <algorithm>
+#include <mutex>
+
+namespace blabber {
+
+std::shared_ptr<const frontpage_entries> share_entries(frontpage_result&& result) {
+    auto entries = std::make_shared<frontpage_entries>();
+    entries->reserve(result.entries.size());
+    for (auto& entry : result.entries) {
+        entries->push_back(std::make_shared<const frontpage_result::post_entry>(std::move(entry)));
+    }
+    return entries;
+}
+
+frontpage_cache::frontpage_cache(size_t capacity)
+    : m_capacity(capacity)
+    , m_entries(std::make_shared<frontpage_entries>()) {}
+
+void frontpage_cache::reset(frontpage_result&& result) {
+    const bool complete = result.entries.size() < m_capacity;
+    if (result.entries.size() > m_capacity)
+        result.entries.resize(m_capacity);
+    auto entries = share_entries(std::move(result));
+
+    std::unique_lock lock(m_mutex);
+    m_entries = std::move(entries);
+    m_complete = complete;
+}
+
+void frontpage_cache::insert(const frontpage_result::post_entry& entry) {
+    if (m_capacity == 0)
+        return;
+
+    auto shared_entry = std::make_shared<const frontpage_result::post_entry>(entry);
+
+    std::unique_lock lock(m_mutex);
+    const frontpage_entries& old_entries = *m_entries;
+    const size_t kept = std::min(old_entries.size(), m_capacity - 1);
+
+    auto entries = std::make_shared<frontpage_entries>();
+    entries->reserve(kept + 1);
+    entries->push_back(std::move(shared_entry));
+    entries->insert(entries->end(), old_entries.begin(), old_entries.begin() + kept);
+    if (kept < old_entries.size())
+        m_complete = false;
+    m_entries = std::move(entries);
+}
+
+void frontpage_cache::insert_comment(u64 post_id, u64 created_at) {
+    std::unique_lock lock(m_mutex);
+
+    // Entries are sorted by id (newest, i.e. largest, first).
+    const frontpage_entries& old_entries = *m_entries;
+    auto pos = std::lower_bound(
+        old_entries.begin(), old_entries.end(), post_id,
+        [](const auto& entry, u64 id) { return entry->id > id; });
+    if (pos == old_entries.end() || (*pos)->id != post_id)
+        return;
+
+    auto updated = std::make_shared<frontpage_result::post_entry>(**pos);
+    updated->comment_count += 1;
+    updated->last_comment_at = std::max(updated->last_comment_at, created_at);
+
+    auto entries = std::make_shared<frontpage_entries>(old_entries);
+    (*entries)[pos - old_entries.begin()] = std::move(updated);
+    m_entries = std::move(entries);
+}
+
+std::shared_ptr<const frontpage_entries> frontpage_cache::fetch(size_t max_posts) const {
+    std::shared_lock lock(m_mutex);
+    if (max_posts > m_entries->size() && !m_complete) {
+        ++m_misses;
+        return nullptr;
+    }
+    ++m_hits;
+    return m_entries;
+}
+
+cache_stats frontpage_cache::stats() const {
+    std::shared_lock lock(m_mutex);
+
+    cache_stats stats;
+    stats.hits = m_hits;
+    stats.misses = m_misses;
+    stats.entries = m_entries->size();
+    for (const auto& entry : *m_entries) {
+        stats.bytes += sizeof(entry) + sizeof(*entry) + entry->user.size() + entry->title.size();
+    }
+    return stats;
+}
+
+post_cache::post_cache(size_t max_bytes)
+    : m_max_bytes(max_bytes) {}
+
+std::shared_ptr<const post_result> post_cache::fetch(u64 post_id, size_t max_comments) {
+    std::lock_guard lock(m_mutex);
+
+    auto pos = m_entries.find(post_id);
+    if (pos == m_entries.end()) {
+        ++m_misses;
+        return nullptr;
+    }
+
+    // The entry is insufficient if the query asks for more comments than we have
+    // and there may be more comments on disk.
+    entry& e = pos->second;
+    if (max_comments > e.result->comments.size() && e.result->comments.size() >= e.limit) {
+        ++m_misses;
+        return nullptr;
+    }
+
+    ++m_hits;
+    m_lru.splice(m_lru.begin(), m_lru, e.lru_pos);
+    return e.result;
+}
+
+void post_cache::insert(std::shared_ptr<const post_result> result, size_t max_comments) {
+    const size_t bytes = result_bytes(*result);
+    if (bytes > m_max_bytes)
+        return;
+
+    std::lock_guard lock(m_mutex);
+
+    const u64 post_id = result->id;
+    auto pos = m_entries.find(post_id);
+    if (pos == m_entries.end()) {
+        m_lru.push_front(post_id);
+        pos = m_entries.emplace(post_id, entry()).first;
+        pos->second.lru_pos = m_lru.begin();
+    } else {
+        m_bytes -= pos->second.bytes;
+        m_lru.splice(m_lru.begin(), m_lru, pos->second.lru_pos);
+    }
+
+    entry& e = pos->second;
+    e.result = std::move(result);
+    e.limit = max_comments;
+    e.bytes = bytes;
+    m_bytes += bytes;
+    evict();
+}
+
+void post_cache::insert_comment(u64 post_id, const post_result::comment_entry& comment) {
+    std::lock_guard lock(m_mutex);
+
+    auto pos = m_entries.find(post_id);
+    if (pos == m_entries.end())
+        return;
+
+    entry& e = pos->second;
+    auto updated = std::make_shared<post_result>();
+    updated->id = e.result->id;
+    updated->created_at = e.result->created_at;
+    updated->user = e.result->user;
+    updated->title = e.result->title;
+    updated->content = e.result->content;
+    updated->comment_count = e.result->comment_count + 1;
+    updated->last_comment_at = std::max(e.result->last_comment_at, comment.created_at);
+
+    // Newest comment first. Keep at most `limit` comments, just like the original query.
+    const size_t kept = std::min(e.result->comments.size(), e.limit > 0 ? e.limit - 1 : 0);
+    updated->comments.reserve(kept + 1);
+    if (e.limit > 0)
+        updated->comments.push_back(comment);
+    updated->comments.insert(updated->comments.end(), e.result->comments.begin(),
+                             e.result->comments.begin() + kept);
+
+    const size_t bytes = result_bytes(*updated);
+    m_bytes = m_bytes - e.bytes + bytes;
+    e.result = std::move(updated);
+    e.bytes = bytes;
+    evict();
+}
+
+void post_cache::erase(u64 post_id) {
+    std::lock_guard lock(m_mutex);
+
+    auto pos = m_entries.find(post_id);
+    if (pos == m_entries.end())
+        return;
+
+    m_bytes -= pos->second.bytes;
+    m_lru.erase(pos->second.lru_pos);
+    m_entries.erase(pos);
+}
+
+cache_stats post_cache::stats() const {
+    std::lock_guard lock(m_mutex);
+
+    cache_stats stats;
+    stats.hits = m_hits;
+    stats.misses = m_misses;
+    stats.evictions = m_evictions;
+    stats.entries = m_entries.size();
+    stats.bytes = m_bytes;
+    return stats;
+}
+
+size_t post_cache::result_bytes(const post_result& result) {
+    size_t bytes = sizeof(entry) + sizeof(post_result) + result.user.size() + result.title.size()
+                   + result.content.size();
+    for (const auto& comment : result.comments) {
+        bytes += sizeof(comment) + comment.user.size() + comment.content.size();
+    }
+    return bytes;
+}
+
+void post_cache::evict() {
+    while (m_bytes > m_max_bytes && !m_lru.empty()) {
+        const u64 post_id = m_lru.back();
+        m_lru.pop_back();
+
+        auto pos = m_entries.find(post_id);
+        m_bytes -= pos->second.bytes;
+        m_entries.erase(pos);
+        ++m_evictions;
+    }
+}
+
+} // namespace blabber
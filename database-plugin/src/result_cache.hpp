@@ -0,0 +1,163 @@
+#ifndef BLABBER_RESULT_CACHE_HPP
+#define BLABBER_RESULT_CACHE_HPP
+
+#include "storage.hpp"
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * In-memory caches for query results. The caches are updated by the database
+ * after a write has been committed, so they never have to be invalidated.
+ * All classes in this file are thread safe.
+ */
+
+namespace blabber {
+
+/*
+ * Counters reported by the caches.
+ */
+struct cache_stats {
+    u64 hits = 0;
+    u64 misses = 0;
+    u64 evictions = 0;
+    u64 entries = 0;
+    u64 bytes = 0;
+};
+
+/*
+ * A list of front page entries (newest first). Every entry is immutable and may be shared
+ * by many lists, so copying a list only copies pointers.
+ */
+using frontpage_entries = std::vector<std::shared_ptr<const frontpage_result::post_entry>>;
+
+// Moves the entries of the query result into a shared list.
+std::shared_ptr<const frontpage_entries> share_entries(frontpage_result&& result);
+
+/*
+ * Holds the front page entries of the latest posts (newest first).
+ * New posts are inserted at the front, the oldest entries drop out
+ * once the capacity has been reached.
+ *
+ * The list of entries is an immutable snapshot that is shared with the callers.
+ * Updates replace the snapshot with a modified copy of the list; unchanged entries
+ * are shared between the old and the new snapshot.
+ */
+class frontpage_cache {
+public:
+    explicit frontpage_cache(size_t capacity);
+
+    frontpage_cache(const frontpage_cache&) = delete;
+    frontpage_cache& operator=(const frontpage_cache&) = delete;
+
+    size_t capacity() const { return m_capacity; }
+
+    // Replaces the cached entries with the result of a front page query
+    // (with max_posts = capacity()).
+    void reset(frontpage_result&& result);
+
+    // Inserts a new post. Posts must be inserted in the order of their creation.
+    void insert(const frontpage_result::post_entry& entry);
+
+    // Updates the comment summary of the post's entry (if any) after a comment was created.
+    void insert_comment(u64 post_id, u64 created_at);
+
+    // Returns the latest posts if the request can be served from the cache, or null otherwise.
+    // The result may contain more than `max_posts` entries.
+    std::shared_ptr<const frontpage_entries> fetch(size_t max_posts) const;
+
+    cache_stats stats() const;
+
+private:
+    const size_t m_capacity;
+
+    mutable std::atomic<u64> m_hits{0};
+    mutable std::atomic<u64> m_misses{0};
+
+    mutable std::shared_mutex m_mutex;
+
+    // Newest entry first. Never null.
+    std::shared_ptr<const frontpage_entries> m_entries;
+
+    // True if m_entries contains *all* posts, i.e. there are fewer posts than the capacity.
+    bool m_complete = false;
+};
+
+/*
+ * A least recently used cache of post query results, bounded by the (approximate)
+ * memory used by the cached results.
+ *
+ * Every entry remembers the `max_comments` value of the query that loaded it and
+ * always contains the newest comments up to that limit. New comments are inserted
+ * into cached entries instead of invalidating them.
+ *
+ * Cached results are immutable and shared with the callers; updates replace
+ * the result with a modified copy.
+ */
+class post_cache {
+public:
+    explicit post_cache(size_t max_bytes);
+
+    post_cache(const post_cache&) = delete;
+    post_cache& operator=(const post_cache&) = delete;
+
+    size_t max_bytes() const { return m_max_bytes; }
+
+    // Returns the cached result for the given post if it contains at least `max_comments` comments
+    // (or all comments of the post, if there are fewer). The result may contain more comments
+    // than requested. Returns null on a cache miss.
+    std::shared_ptr<const post_result> fetch(u64 post_id, size_t max_comments);
+
+    // Inserts the result of a post query with the given `max_comments` value.
+    void insert(std::shared_ptr<const post_result> result, size_t max_comments);
+
+    // Inserts a new comment into the cached entry of the post (if any).
+    // Comments must be inserted in the order of their creation.
+    void insert_comment(u64 post_id, const post_result::comment_entry& comment);
+
+    // Removes the cached entry of the post (if any).
+    void erase(u64 post_id);
+
+    cache_stats stats() const;
+
+private:
+    struct entry {
+        std::shared_ptr<const post_result> result;
+
+        // The `max_comments` value of the query that produced the result.
+        size_t limit = 0;
+
+        // Approximate memory usage of the result.
+        size_t bytes = 0;
+
+        // Position in m_lru.
+        std::list<u64>::iterator lru_pos;
+    };
+
+    // Returns the approximate memory usage of the result.
+    static size_t result_bytes(const post_result& result);
+
+    // Evicts the least recently used entries until the size limit is satisfied. Mutex must be held.
+    void evict();
+
+private:
+    const size_t m_max_bytes;
+
+    mutable std::mutex m_mutex;
+    std::unordered_map<u64, entry> m_entries;
+    std::list<u64> m_lru; // Most recently used post id first.
+    size_t m_bytes = 0;
+
+    u64 m_hits = 0;
+    u64 m_misses = 0;
+    u64 m_evictions = 0;
+};
+
+} // namespace blabber
+
+#endif // BLABBER_RESULT_CACHE_HPP
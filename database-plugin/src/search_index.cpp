@@ -0,0 +1,220 @@
+#include "search_index.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <unordered_map>
+
+namespace blabber {
+
+std::vector<std::string> tokenize(std::string_view text) {
+    static constexpr size_t min_token_size = 2;
+    static constexpr size_t max_token_size = 64;
+
+    auto is_token_char = [](unsigned char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+               || c >= 0x80;
+    };
+
+    std::vector<std::string> tokens;
+    std::string current;
+    auto finish_token = [&] {
+        if (current.size() >= min_token_size)
+            tokens.push_back(current);
+        current.clear();
+    };
+
+    for (char ch : text) {
+        const unsigned char c = static_cast<unsigned char>(ch);
+        if (!is_token_char(c)) {
+            finish_token();
+            continue;
+        }
+        if (current.size() < max_token_size)
+            current.push_back(c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : ch);
+    }
+    finish_token();
+    return tokens;
+}
+
+u64 hash_string(std::string_view str) {
+    u64 hash = 14695981039346656037ULL;
+    for (char c : str) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+search_index::search_index(prequel::anchor_handle<anchor> anchor_, prequel::allocator& alloc_)
+    : m_postings(std::move(anchor_), alloc_) {}
+
+static u32 saturating_add(u32 count, u64 value) {
+    return static_cast<u32>(std::min<u64>(u64(count) + value, std::numeric_limits<u32>::max()));
+}
+
+void search_index::add(u64 post_id, std::string_view text, u32 weight) {
+    // Every distinct token of the text is written once.
+    std::unordered_map<u64, u32> counts;
+    for (const std::string& token : tokenize(text)) {
+        counts[hash_string(token)] += weight;
+    }
+
+    for (const auto& [token, count] : counts) {
+        if (auto cursor = m_postings.find(std::tuple(token, post_id))) {
+            posting p = cursor.get();
+            p.count = saturating_add(p.count, count);
+            cursor.set(p);
+        } else {
+            m_postings.insert(posting{token, post_id, count});
+            count_post(token);
+        }
+    }
+}
+
+void search_index::count_post(u64 token) {
+    if (auto cursor = m_postings.find(std::tuple(token, u64(0)))) {
+        posting p = cursor.get();
+        p.count = saturating_add(p.count, 1);
+        cursor.set(p);
+    } else {
+        m_postings.insert(posting{token, 0, 1});
+    }
+}
+
+u64 search_index::count_posts(u64 token) const {
+    if (auto cursor = m_postings.find(std::tuple(token, u64(0))))
+        return cursor.get().count;
+    return 0;
+}
+
+template<typename Func>
+void search_index::scan_postings(u64 token, Func&& fn) const {
+    // Position the cursor at the last entry of the token, then walk backwards (newest first).
+    auto cursor = m_postings.upper_bound(std::tuple(token, std::numeric_limits<u64>::max()));
+    if (cursor) {
+        cursor.move_prev();
+    } else {
+        cursor = m_postings.create_cursor(m_postings.seek_max);
+    }
+
+    for (size_t scanned = 0; cursor && scanned < max_postings_per_token; ++scanned) {
+        posting p = cursor.get();
+        if (p.token != token || p.post_id == 0)
+            break;
+        fn(p);
+        cursor.move_prev();
+    }
+}
+
+/*
+ * Every post that matches all query tokens contains the rarest one, so the posting list of
+ * the rarest token is intersected with the others: each of its (newest) posts is looked up
+ * in the posting lists of the other tokens. Posts that only match some tokens are collected
+ * from the newest postings of the remaining tokens, but only if the complete matches do not
+ * fill the result. A query costs O(tokens * max_postings_per_token) index lookups no matter
+ * how many posts exist. Tokens that occur in fewer posts get a larger weight.
+ */
+std::vector<search_index::match> search_index::search(std::string_view query, size_t limit,
+                                                      u64 post_count) const {
+    struct query_token {
+        u64 hash = 0;
+        u64 posts = 0; // Number of posts that contain the token.
+        double idf = 0;
+    };
+
+    std::vector<query_token> tokens;
+    for (const std::string& token : tokenize(query)) {
+        const u64 hash = hash_string(token);
+        auto same_hash = [&](const query_token& t) { return t.hash == hash; };
+        if (std::none_of(tokens.begin(), tokens.end(), same_hash))
+            tokens.push_back(query_token{hash});
+        if (tokens.size() >= max_query_tokens)
+            break;
+    }
+    if (limit == 0)
+        return {};
+
+    // Tokens that do not occur in any post cannot be matched.
+    for (query_token& t : tokens) {
+        t.posts = count_posts(t.hash);
+        t.idf = std::log(1.0 + double(std::max(post_count, t.posts)) / double(t.posts));
+    }
+    tokens.erase(std::remove_if(tokens.begin(), tokens.end(),
+                                [](const query_token& t) { return t.posts == 0; }),
+                 tokens.end());
+    if (tokens.empty())
+        return {};
+    std::sort(tokens.begin(), tokens.end(),
+              [](const query_token& a, const query_token& b) { return a.posts < b.posts; });
+
+    struct candidate {
+        size_t matched = 0;
+        double score = 0;
+    };
+    std::unordered_map<u64, candidate> candidates;
+
+    auto token_score = [](const query_token& t, u32 count) {
+        return (1.0 + std::log(double(count))) * t.idf;
+    };
+
+    size_t complete = 0;
+    scan_postings(tokens[0].hash, [&](const posting& p) {
+        candidate c{1, token_score(tokens[0], p.count)};
+        for (size_t i = 1; i < tokens.size(); ++i) {
+            if (auto cursor = m_postings.find(std::tuple(tokens[i].hash, p.post_id))) {
+                c.matched += 1;
+                c.score += token_score(tokens[i], cursor.get().count);
+            }
+        }
+        if (c.matched == tokens.size())
+            complete += 1;
+        candidates.emplace(p.post_id, c);
+    });
+
+    // Partial matches are ranked below all complete matches.
+    if (complete < limit) {
+        std::unordered_map<u64, candidate> partial;
+        for (size_t i = 1; i < tokens.size(); ++i) {
+            scan_postings(tokens[i].hash, [&](const posting& p) {
+                if (candidates.count(p.post_id)) // Already scored by the intersection.
+                    return;
+                candidate& c = partial[p.post_id];
+                c.matched += 1;
+                c.score += token_score(tokens[i], p.count);
+            });
+        }
+        candidates.merge(partial);
+    }
+
+    struct ranked {
+        u64 post_id = 0;
+        candidate c;
+    };
+    std::vector<ranked> ranking;
+    ranking.reserve(candidates.size());
+    for (const auto& [post_id, c] : candidates) {
+        ranking.push_back(ranked{post_id, c});
+    }
+
+    const size_t count = std::min(limit, ranking.size());
+    std::partial_sort(ranking.begin(), ranking.begin() + count, ranking.end(),
+                      [](const ranked& a, const ranked& b) {
+                          if (a.c.matched != b.c.matched)
+                              return a.c.matched > b.c.matched;
+                          if (a.c.score != b.c.score)
+                              return a.c.score > b.c.score;
+                          return a.post_id > b.post_id;
+                      });
+
+    std::vector<match> result(count);
+    for (size_t i = 0; i < count; ++i)
+        result[i] = match{ranking[i].post_id, ranking[i].c.score};
+    return result;
+}
+
+void search_index::dump(std::ostream& os) const {
+    m_postings.raw().dump(os);
+}
+
+} // namespace blabber
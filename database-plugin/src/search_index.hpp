@@ -0,0 +1,113 @@
+#ifndef BLABBER_SEARCH_INDEX_HPP
+#define BLABBER_SEARCH_INDEX_HPP
+
+#include <prequel/anchor_handle.hpp>
+#include <prequel/container/btree.hpp>
+#include <prequel/serialization.hpp>
+
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <vector>
+
+namespace blabber {
+
+using namespace prequel::short_types;
+
+/*
+ * Splits the text into tokens: maximal runs of letters, digits and non-ascii bytes,
+ * with ascii letters converted to lower case. Tokens shorter than 2 bytes are dropped,
+ * longer tokens are truncated to 64 bytes.
+ */
+std::vector<std::string> tokenize(std::string_view text);
+
+// Returns a 64-bit hash of the string (FNV-1a). Hashes are stored on disk and must never change.
+u64 hash_string(std::string_view str);
+
+/*
+ * An inverted index that maps tokens to the posts containing them.
+ *
+ * Every (token, post) pair is a single btree entry that counts how often the token
+ * occurs in the post (including its comments). Tokens are stored as 64-bit hashes,
+ * so posting lists of different tokens are contiguous ranges of the tree, ordered by
+ * post id. Hash collisions may produce (very rare) false positives.
+ *
+ * The entry (token, 0) precedes the posting list of every token (post ids start at 1)
+ * and counts the posts that contain the token.
+ */
+class search_index {
+    struct posting {
+        u64 token = 0;
+        u64 post_id = 0;
+        u32 count = 0;
+
+        struct key {
+            std::tuple<u64, u64> operator()(const posting& p) const {
+                return std::tuple(p.token, p.post_id);
+            }
+        };
+
+        static constexpr auto get_binary_format() {
+            return prequel::binary_format(&posting::token, &posting::post_id, &posting::count);
+        }
+    };
+
+    using posting_tree = prequel::btree<posting, posting::key>;
+
+public:
+    using anchor = posting_tree::anchor;
+
+    // Every token is only scanned for this many posts (the newest ones containing it),
+    // which bounds the cost of a query independent of the size of the index.
+    static constexpr size_t max_postings_per_token = 1000;
+
+    // Queries use at most this many distinct tokens.
+    static constexpr size_t max_query_tokens = 16;
+
+    struct match {
+        u64 post_id = 0;
+        double score = 0;
+    };
+
+public:
+    explicit search_index(prequel::anchor_handle<anchor> anchor_, prequel::allocator& alloc_);
+
+    // Indexes the tokens of the text for the given post. Every occurrence counts `weight` times.
+    void add(u64 post_id, std::string_view text, u32 weight = 1);
+
+    /*
+     * Returns up to `limit` posts matching the query, best match first.
+     * Posts are ranked by the number of matched query tokens first, then by a tf-idf score
+     * and finally by their age (newer posts first). `post_count` is the number of posts
+     * in the database, it is used for the inverse document frequency of the tokens.
+     *
+     * Posts that contain all query tokens are found by looking up the newest
+     * `max_postings_per_token` posts of the rarest query token in the posting lists of
+     * the other tokens. If the rarest token occurs in more posts than that, older posts
+     * that match every token are not returned. Posts that only match some of the tokens
+     * are only searched for if there are less than `limit` posts that match all of them,
+     * among the newest `max_postings_per_token` posts of every token.
+     */
+    std::vector<match> search(std::string_view query, size_t limit, u64 post_count) const;
+
+    void dump(std::ostream& os) const;
+
+private:
+    // Increments the number of posts that contain the token.
+    void count_post(u64 token);
+
+    // Returns the number of posts that contain the token.
+    u64 count_posts(u64 token) const;
+
+    // Calls `fn` for the newest `max_postings_per_token` postings of the token (newest first).
+    template<typename Func>
+    void scan_postings(u64 token, Func&& fn) const;
+
+private:
+    posting_tree m_postings;
+};
+
+} // namespace blabber
+
+#endif // BLABBER_SEARCH_INDEX_HPP
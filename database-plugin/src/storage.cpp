@@ -1,89 +1,74 @@
 #include "storage.hpp"
+#include "compression.hpp"
+#include "string_loader.hpp"
 
 #include <fmt/ostream.h>
 
 #include <algorithm>
 #include <ctime>
+#include <limits>
 
 namespace blabber {
 
-// Dereference the string and load it from the heap.
-static std::string load_string(const prequel::heap& h, const prequel::heap_reference& ref) {
-    if (!ref)
-        return {};
-
-    std::string loaded;
-    loaded.resize(h.size(ref));
-    h.load(ref, reinterpret_cast<byte*>(&loaded[0]), loaded.size());
-    return loaded;
-}
-
-// Stores the string on the heap and returns a reference to its location.
-static prequel::heap_reference store_string(prequel::heap& h, const std::string& str) {
-    if (str.empty())
-        return {};
-
-    return h.allocate(reinterpret_cast<const byte*>(str.data()), str.size());
+u64 current_timestamp() {
+    /* should be UTC seconds on all relevant platforms */
+    time_t t = std::time(0);
+    if (t < 0)
+        throw std::runtime_error("time() failed.");
+    return static_cast<u64>(t);
 }
 
-// Loads the string, dereferencing if necessary.
-template<u32 Capacity>
-static std::string
-load_optimized_string(const prequel::heap& h, const optimized_string<Capacity>& str) {
-    std::string loaded;
-
-    struct visitor {
-        const prequel::heap* h;
-
-        // Called when the string was inlined. We can get the string content
-        // from the object itself.
-        std::string operator()(const prequel::fixed_cstring<Capacity>& str) const {
-            return std::string(str.begin(), str.end());
-        }
+storage::storage(prequel::anchor_handle<anchor> anchor_, prequel::allocator& alloc_,
+                 size_t compression_threshold, user_cache* users)
+    : m_anchor(std::move(anchor_))
+    , m_alloc(&alloc_)
+    , m_posts(m_anchor.member<&anchor::posts>(), alloc_)
+    , m_comments(m_anchor.member<&anchor::comments>(), alloc_)
+    , m_strings(m_anchor.member<&anchor::strings>(), alloc_)
+    , m_activity(m_anchor.member<&anchor::activity>(), alloc_)
+    , m_search(m_anchor.member<&anchor::search>(), alloc_)
+    , m_users(m_anchor.member<&anchor::users>(), alloc_)
+    , m_user_names(m_anchor.member<&anchor::user_names>(), alloc_, m_strings, users)
+    , m_compression_threshold(compression_threshold) {}
+
+heap_string storage::store_string(const std::string& str) {
+    if (str.size() > std::numeric_limits<u32>::max()) {
+        // Sanity check. Size of objects in prequel::heap is limited to 2^32 - 1 right now.
+        throw database_error("String is too large.");
+    }
 
-        // Called when the string is stored in the heap. We must dereference
-        // the heap ref in order to load to string content.
-        std::string operator()(const prequel::heap_reference& ref) const {
-            return load_string(*h, ref);
+    heap_string result;
+    if (str.empty())
+        return result;
+
+    result.size = static_cast<u32>(str.size());
+    if (m_compression_threshold > 0 && str.size() >= m_compression_threshold) {
+        if (auto compressed = compress_string(str)) {
+            result.data = m_strings.allocate(reinterpret_cast<const byte*>(compressed->data()),
+                                             compressed->size());
+            result.compressed = 1;
+            return result;
         }
-    };
+    }
 
-    return std::visit(visitor{&h}, str);
+    result.data = m_strings.allocate(reinterpret_cast<const byte*>(str.data()), str.size());
+    return result;
 }
 
-// Stores the string by either inlining it (small strings) or saving it on the heap.
 template<u32 Capacity>
-static optimized_string<Capacity> store_optimized_string(prequel::heap& h, const std::string& str) {
-    if (str.size() > std::numeric_limits<u32>::max()) {
-        // Sanity check. Size of objects in prequel::heap is limited to 2^32 - 1 right now.
-        throw database_error("String is too large.");
-    }
-
+optimized_string<Capacity> storage::store_optimized_string(const std::string& str) {
     // Check whether the string fits into the available optimized storage.
     if (str.size() <= Capacity) {
         return prequel::fixed_cstring<Capacity>(str);
     }
 
     // Store long strings on the heap.
-    return store_string(h, str);
-}
-
-static u64 current_timestamp() {
-    /* should be UTC seconds on all relevant platforms */
-    time_t t = std::time(0);
-    if (t < 0)
-        throw std::runtime_error("time() failed.");
-    return static_cast<u64>(t);
+    return store_string(str);
 }
 
-storage::storage(prequel::anchor_handle<anchor> anchor_, prequel::allocator& alloc_)
-    : m_anchor(std::move(anchor_))
-    , m_alloc(&alloc_)
-    , m_posts(m_anchor.member<&anchor::posts>(), alloc_)
-    , m_strings(m_anchor.member<&anchor::strings>(), alloc_) {}
-
-u64 storage::create_post(const std::string& user, const std::string& title,
-                         const std::string& content) {
+frontpage_result::post_entry storage::create_post(const std::string& user, const std::string& title,
+                                                  const std::string& content,
+                                                  std::optional<u64> created_at) {
     const u64 id = m_anchor.get<&anchor::next_post_id>();
     if (id == 0) { // id wrap around, practially impossible
         throw database_error("ID space exhausted.");
@@ -91,128 +76,477 @@ u64 storage::create_post(const std::string& user, const std::string& title,
 
     post new_post;
     new_post.id = id;
-    new_post.created_at = current_timestamp();
-    new_post.user = store_optimized_string<15>(m_strings, user);
-    new_post.title = store_optimized_string<31>(m_strings, title);
-    new_post.content = store_string(m_strings, content);
+    new_post.created_at = created_at ? *created_at : current_timestamp();
+    if (auto latest = m_posts.create_cursor(m_posts.seek_max)) {
+        // Posts must be sorted by time (see fetch_posts_between()). The clock may go backwards,
+        // but explicit timestamps are never changed silently.
+        const u64 latest_created_at = latest.get().created_at;
+        if (new_post.created_at < latest_created_at) {
+            if (created_at) {
+                throw std::invalid_argument(fmt::format(
+                    "The creation time of a new post ({}) must not be smaller than the "
+                    "creation time of the latest post ({}).",
+                    *created_at, latest_created_at));
+            }
+            new_post.created_at = latest_created_at;
+        }
+    }
+    new_post.user_id = m_user_names.intern(user);
+    new_post.title = store_optimized_string<31>(title);
+    new_post.content = store_string(content);
     m_posts.insert(new_post);
+    m_activity.insert(activity_entry{new_post.last_activity_at(), id});
+    index_post(id, title, content);
+    index_user_activity(new_post.user_id, new_post.created_at, id, 0, new_post.title);
 
     m_anchor.set<&anchor::next_post_id>(id + 1);
-    return id;
+
+    frontpage_result::post_entry entry;
+    entry.id = id;
+    entry.created_at = new_post.created_at;
+    entry.user = user;
+    entry.title = title;
+    return entry;
+}
+
+post_result::comment_entry
+storage::create_comment(u64 post_id, const std::string& user, const std::string& content) {
+    std::vector<post_result::comment_entry> entries(1);
+    entries[0].created_at = current_timestamp();
+    entries[0].user = user;
+    entries[0].content = content;
+    create_comments(post_id, entries);
+    return std::move(entries[0]);
 }
 
-void storage::create_comment(u64 post_id, const std::string& user, const std::string& content) {
-    // First, find the post. Then insert the new comment into the list.
+void storage::create_comments(u64 post_id,
+                              const std::vector<post_result::comment_entry>& comments) {
+    // First, find the post. Then insert the new comments at the next free positions.
     auto post_cursor = m_posts.find(post_id);
     if (!post_cursor) {
         throw not_found_error("Post not found.");
     }
 
+    if (comments.empty())
+        return;
+
     post found_post = post_cursor.get();
-    prequel::anchor_flag post_changed;
+    const u64 old_activity = found_post.last_activity_at();
+    for (const post_result::comment_entry& entry : comments) {
+        const comment new_comment = store_comment(post_id, found_post.comment_count, entry);
+        m_comments.insert(new_comment);
+        found_post.comment_count += 1;
+        found_post.last_comment_at = std::max(found_post.last_comment_at, entry.created_at);
+        m_search.add(post_id, entry.content);
+        index_user_activity(new_comment.user_id, entry.created_at, post_id,
+                            found_post.comment_count, new_comment.content);
+    }
+
+    // The summary has changed, we MUST update the post entry.
+    post_cursor.set(found_post);
+
+    if (found_post.last_activity_at() != old_activity) {
+        m_activity.erase(std::tuple(old_activity, post_id));
+        m_activity.insert(activity_entry{found_post.last_activity_at(), post_id});
+    }
+}
+
+void storage::import_post(const post_result& imported) {
+    if (imported.id == 0) {
+        throw database_error("Invalid post id.");
+    }
+    if (m_posts.find(imported.id)) {
+        throw database_error(fmt::format("A post with id {} already exists.", imported.id));
+    }
 
-    // Open the list from the list anchor in the post structure.
-    {
-        prequel::list<comment> comments(prequel::anchor_handle(found_post.comments, post_changed),
-                                        *m_alloc);
+    post new_post;
+    new_post.id = imported.id;
+    new_post.created_at = imported.created_at;
+    new_post.user_id = m_user_names.intern(imported.user);
+    new_post.title = store_optimized_string<31>(imported.title);
+    new_post.content = store_string(imported.content);
+
+    // Comments are stored newest first in the result.
+    for (auto pos = imported.comments.rbegin(); pos != imported.comments.rend(); ++pos) {
+        const comment new_comment = store_comment(new_post.id, new_post.comment_count, *pos);
+        m_comments.insert(new_comment);
+        new_post.comment_count += 1;
+        new_post.last_comment_at = std::max(new_post.last_comment_at, pos->created_at);
+        m_search.add(new_post.id, pos->content);
+        index_user_activity(new_comment.user_id, pos->created_at, new_post.id,
+                            new_post.comment_count, new_comment.content);
+    }
+    m_posts.insert(new_post);
+    m_activity.insert(activity_entry{new_post.last_activity_at(), new_post.id});
+    index_post(new_post.id, imported.title, imported.content);
+    index_user_activity(new_post.user_id, new_post.created_at, new_post.id, 0, new_post.title);
 
-        // Create and insert the new comment.
-        comment new_comment;
-        new_comment.created_at = current_timestamp();
-        new_comment.user = store_optimized_string<15>(m_strings, user);
-        new_comment.content = store_string(m_strings, content);
-        comments.push_back(new_comment);
+    if (imported.id >= m_anchor.get<&anchor::next_post_id>()) {
+        m_anchor.set<&anchor::next_post_id>(imported.id + 1);
     }
+}
+
+void storage::index_post(u64 post_id, const std::string& title, const std::string& content) {
+    // Matches in the title are more relevant than matches in the content.
+    static constexpr u32 title_weight = 3;
 
-    // The list anchor has changed because of the insertion, we MUST update the post entry.
-    if (post_changed) {
-        post_cursor.set(found_post);
+    m_search.add(post_id, title, title_weight);
+    m_search.add(post_id, content);
+}
+
+template<u32 Capacity>
+void storage::index_user_activity(u64 user_id, u64 created_at, u64 post_id, u64 comment,
+                                  const optimized_string<Capacity>& text) {
+    static_assert(Capacity <= comment_inline_capacity, "Text must fit into the index entry.");
+
+    user_activity_entry entry;
+    entry.user_id = user_id;
+    entry.created_at = created_at;
+    entry.post_id = post_id;
+    entry.comment = comment;
+    if (auto inlined = std::get_if<prequel::fixed_cstring<Capacity>>(&text)) {
+        entry.text = prequel::fixed_cstring<comment_inline_capacity>(
+            std::string(inlined->begin(), inlined->end()));
+    } else {
+        entry.text = std::get<heap_string>(text);
     }
+    m_users.insert(entry);
+}
+
+comment
+storage::store_comment(u64 post_id, u64 position, const post_result::comment_entry& entry) {
+    comment new_comment;
+    new_comment.post_id = post_id;
+    new_comment.position = position;
+    new_comment.created_at = entry.created_at;
+    new_comment.user_id = m_user_names.intern(entry.user);
+    new_comment.content = store_optimized_string<comment_inline_capacity>(entry.content);
+    return new_comment;
 }
 
 frontpage_result storage::fetch_frontpage(size_t max_posts) const {
+    return fetch_posts({}, max_posts);
+}
+
+frontpage_result storage::fetch_posts(std::optional<u64> before_id, size_t max_posts) const {
+    // Iterate from the end (or from the post before `before_id`), in reverse order.
+    post_tree::cursor cursor = m_posts.create_cursor(m_posts.seek_max);
+    if (before_id) {
+        if (auto next = m_posts.lower_bound(*before_id)) {
+            cursor = std::move(next);
+            cursor.move_prev();
+        }
+    }
+    return collect_posts(std::move(cursor), max_posts, [](const post&) { return true; });
+}
+
+/*
+ * Posts are sorted by id and by time (see create_post()), so the time range maps
+ * to a contiguous range in the post tree. Its end is found with a binary search over
+ * the id space, which costs O(log n) tree lookups; no secondary index is needed.
+ */
+frontpage_result storage::fetch_posts_between(u64 start, u64 end, size_t max_posts,
+                                              std::optional<u64> before_id) const {
+    if (start > end)
+        return {};
+
+    // Start below whichever bound comes first: the end of the range or the previous page.
+    post_tree::cursor cursor = first_post_after(end);
+    if (before_id) {
+        auto next = m_posts.lower_bound(*before_id);
+        if (next && (!cursor || next.get().id < cursor.get().id))
+            cursor = std::move(next);
+    }
+    if (cursor) {
+        cursor.move_prev();
+    } else {
+        cursor = m_posts.create_cursor(m_posts.seek_max);
+    }
+    return collect_posts(std::move(cursor), max_posts,
+                         [&](const post& p) { return p.created_at >= start; });
+}
+
+storage::post_tree::cursor storage::first_post_after(u64 timestamp) const {
+    // The result is in [low, high]. high == next_post_id means that there is no such post.
+    u64 low = 1;
+    u64 high = m_anchor.get<&anchor::next_post_id>();
+    while (low < high) {
+        const u64 mid = low + (high - low) / 2;
+
+        // Ids are not necessarily contiguous, look at the first existing post >= mid.
+        auto cursor = m_posts.lower_bound(mid);
+        if (!cursor) {
+            high = mid;
+            continue;
+        }
+
+        const post p = cursor.get();
+        if (p.created_at > timestamp) {
+            high = mid;
+        } else {
+            low = p.id + 1;
+        }
+    }
+    return m_posts.lower_bound(low);
+}
+
+template<typename Pred>
+frontpage_result
+storage::collect_posts(post_tree::cursor cursor, size_t max_posts, Pred&& pred) const {
+    std::vector<post> found_posts;
+    while (cursor && found_posts.size() < max_posts) {
+        post p = cursor.get();
+        if (!pred(p))
+            break;
+
+        found_posts.push_back(std::move(p));
+        cursor.move_prev();
+    }
+    return load_entries(found_posts);
+}
+
+/*
+ * Walks the activity index backwards, which costs O(max_posts) index entries plus
+ * one post lookup per entry, independent of the number of comments.
+ */
+frontpage_result storage::fetch_active_posts(size_t max_posts) const {
+    std::vector<post> found_posts;
+    auto cursor = m_activity.create_cursor(m_activity.seek_max);
+    while (cursor && found_posts.size() < max_posts) {
+        const activity_entry entry = cursor.get();
+        auto post_cursor = m_posts.find(entry.post_id);
+        if (!post_cursor) {
+            throw std::logic_error("Activity index refers to a post that does not exist.");
+        }
+
+        found_posts.push_back(post_cursor.get());
+        cursor.move_prev();
+    }
+    return load_entries(found_posts);
+}
+
+frontpage_result storage::search(const std::string& query, size_t limit) const {
+    // Post ids are assigned in order, so this is the number of posts (unless posts with
+    // sparse ids have been imported).
+    const u64 post_count = m_anchor.get<&anchor::next_post_id>() - 1;
+
     std::vector<post> found_posts;
-    {
-        // Iterate from the end, in reverse order.
-        auto tree_cursor = m_posts.create_cursor(m_posts.seek_max);
-        while (tree_cursor && found_posts.size() < max_posts) {
-            found_posts.push_back(tree_cursor.get());
-            tree_cursor.move_prev();
+    for (const search_index::match& m : m_search.search(query, limit, post_count)) {
+        auto post_cursor = m_posts.find(m.post_id);
+        if (!post_cursor) {
+            throw std::logic_error("Search index refers to a post that does not exist.");
         }
+        found_posts.push_back(post_cursor.get());
+    }
+    return load_entries(found_posts);
+}
+
+/*
+ * Entries of a user are contiguous in the index and sorted by time. Both the first page
+ * and every following page start with a lookup of the user id and a single tree lookup.
+ */
+user_activity_result
+storage::fetch_user_activity(const std::string& user, size_t limit,
+                             std::optional<user_activity_result::position> cursor) const {
+    static constexpr u64 max = std::numeric_limits<u64>::max();
+
+    const std::optional<u64> user_id = m_user_names.find(user);
+    if (!user_id)
+        return {};
+
+    user_tree::cursor pos = cursor ? m_users.lower_bound(std::tuple(
+                                         *user_id, cursor->created_at, cursor->post_id,
+                                         cursor->comment))
+                                   : m_users.upper_bound(std::tuple(*user_id, max, max, max));
+    if (pos) {
+        pos.move_prev();
+    } else {
+        pos = m_users.create_cursor(m_users.seek_max);
+    }
+
+    std::vector<user_activity_entry> found_entries;
+    while (pos && found_entries.size() < limit) {
+        user_activity_entry entry = pos.get();
+        if (entry.user_id != *user_id)
+            break;
+        found_entries.push_back(std::move(entry));
+        pos.move_prev();
     }
 
+    user_activity_result result;
+    result.entries.resize(found_entries.size());
+
+    string_loader loader(m_strings);
+    for (size_t i = 0; i < found_entries.size(); ++i) {
+        const user_activity_entry& found = found_entries[i];
+        user_activity_result::entry& entry = result.entries[i];
+        entry.created_at = found.created_at;
+        entry.post_id = found.post_id;
+        if (found.comment > 0)
+            entry.comment = found.comment - 1;
+        loader.add(found.text, entry.text);
+    }
+    loader.load();
+
+    if (!found_entries.empty() && pos && pos.get().user_id == *user_id) {
+        const user_activity_entry& last = found_entries.back();
+        result.next = user_activity_result::position{last.created_at, last.post_id, last.comment};
+    }
+    return result;
+}
+
+frontpage_result storage::load_entries(const std::vector<post>& posts) const {
     frontpage_result result;
-    for (const post& p : found_posts) {
-        frontpage_result::post_entry entry;
+    result.entries.resize(posts.size());
+
+    string_loader loader(m_strings);
+    user_name_loader names(m_user_names);
+    for (size_t i = 0; i < posts.size(); ++i) {
+        const post& p = posts[i];
+        frontpage_result::post_entry& entry = result.entries[i];
         entry.id = p.id;
         entry.created_at = p.created_at;
-        entry.user = load_optimized_string(m_strings, p.user);
-        entry.title = load_optimized_string(m_strings, p.title);
-
-        result.entries.push_back(std::move(entry));
+        entry.comment_count = p.comment_count;
+        entry.last_comment_at = p.last_comment_at;
+        names.add(p.user_id, entry.user);
+        loader.add(p.title, entry.title);
     }
+    names.load(loader);
     return result;
 }
 
 post_result storage::fetch_post(u64 post_id, size_t max_comments) const {
-    // First, find the post. Then insert the new comment into the list.
+    // First, find the post. Then read its newest comments.
     auto post_cursor = m_posts.find(post_id);
     if (!post_cursor) {
         throw not_found_error("Post not found.");
     }
 
-    post found_post = post_cursor.get();
-    prequel::anchor_flag post_changed;
-    std::vector<comment> found_comments;
-    {
-
-        // Open the list from the list anchor in the post structure.
-        prequel::list<comment> comments(prequel::anchor_handle(found_post.comments, post_changed),
-                                        *m_alloc);
-        auto cursor = comments.create_cursor(comments.seek_last);
-        while (cursor && found_comments.size() < max_comments) {
-            found_comments.push_back(cursor.get());
-            cursor.move_prev();
-        }
-    }
-
-    if (post_changed) {
-        // The list will not be modified by the operations above.
-        throw std::logic_error("Must not modify the post in a read only operation.");
-    }
+    const post found_post = post_cursor.get();
+    const std::vector<comment> found_comments =
+        collect_comments(post_id, found_post.comment_count, max_comments);
 
     post_result result;
     result.id = found_post.id;
     result.created_at = found_post.created_at;
-    result.user = load_optimized_string(m_strings, found_post.user);
-    result.title = load_optimized_string(m_strings, found_post.title);
-    result.content = load_string(m_strings, found_post.content);
-
-    /*
-     * Load the strings for the comments from the heap. Note that this would
-     * involve lots of seeking in a real application, because we load the strings
-     * in comment-order and not in the order in which they appear on disk.
-     *
-     * Sorting the string references before loading them (heap_reference supports a
-     * sensible ordering) would improve the efficiency of this operation by a lot, but this
-     * is currently not necessary: We don't support deletion, so all entries are somewhat
-     * in order anyway.
-     */
-    for (const comment& c : found_comments) {
-        post_result::comment_entry entry;
+    result.comment_count = found_post.comment_count;
+    result.last_comment_at = found_post.last_comment_at;
+    result.comments.resize(found_comments.size());
+
+    // All strings of the post and its comments (including long user names) are loaded
+    // in a single, sorted pass over the heap.
+    string_loader loader(m_strings);
+    user_name_loader names(m_user_names);
+    names.add(found_post.user_id, result.user);
+    loader.add(found_post.title, result.title);
+    loader.add(found_post.content, result.content);
+    for (size_t i = 0; i < found_comments.size(); ++i) {
+        const comment& c = found_comments[i];
+        post_result::comment_entry& entry = result.comments[i];
         entry.created_at = c.created_at;
-        entry.user = load_optimized_string(m_strings, c.user);
-        entry.content = load_string(m_strings, c.content);
+        names.add(c.user_id, entry.user);
+        loader.add(c.content, entry.content);
+    }
+    names.load(loader);
+    return result;
+}
+
+/*
+ * The position in the cursor is validated against the comment count of the post, then the
+ * comment tree is entered directly at that position. A page costs one post lookup, one
+ * tree lookup and O(limit) comments, no matter how deep it is within the thread.
+ */
+comments_result
+storage::fetch_comments(u64 post_id, std::optional<u64> before, size_t limit) const {
+    auto post_cursor = m_posts.find(post_id);
+    if (!post_cursor) {
+        throw not_found_error("Post not found.");
+    }
+
+    const post found_post = post_cursor.get();
+    const u64 end = before ? std::min(*before, found_post.comment_count)
+                           : found_post.comment_count;
+    const std::vector<comment> found_comments = collect_comments(post_id, end, limit);
+    const u64 first_position = end - found_comments.size();
+
+    comments_result result;
+    result.comments.resize(found_comments.size());
+
+    string_loader loader(m_strings);
+    user_name_loader names(m_user_names);
+    for (size_t i = 0; i < found_comments.size(); ++i) {
+        const comment& c = found_comments[i];
+        post_result::comment_entry& entry = result.comments[i];
+        entry.created_at = c.created_at;
+        names.add(c.user_id, entry.user);
+        loader.add(c.content, entry.content);
+    }
+    names.load(loader);
 
-        result.comments.push_back(std::move(entry));
+    if (!found_comments.empty() && first_position > 0) {
+        result.next_before = first_position;
     }
     return result;
 }
 
-void storage::dump(std::ostream& os) {
+std::vector<comment> storage::collect_comments(u64 post_id, u64 end, size_t limit) const {
+    std::vector<comment> found_comments;
+    if (end == 0 || limit == 0)
+        return found_comments;
+
+    // The positions of a post's comments are 0 to comment_count - 1, without gaps.
+    // Anything else means that the file is corrupted.
+    auto missing_comment = [&](u64 position) {
+        return database_error(fmt::format(
+            "Database is corrupted: comment {} of post {} is missing.", position, post_id));
+    };
+
+    const size_t count = static_cast<size_t>(std::min<u64>(end, limit));
+    auto cursor = m_comments.find(std::tuple(post_id, end - 1));
+    while (found_comments.size() < count) {
+        const u64 position = end - 1 - found_comments.size();
+        if (!cursor)
+            throw missing_comment(position);
+
+        comment c = cursor.get();
+        if (c.post_id != post_id || c.position != position)
+            throw missing_comment(position);
+        found_comments.push_back(std::move(c));
+        cursor.move_prev();
+    }
+    return found_comments;
+}
+
+std::optional<u64> storage::find_next_post(u64 min_id) const {
+    if (auto cursor = m_posts.lower_bound(min_id))
+        return cursor.get().id;
+    return {};
+}
+
+void storage::dump(std::ostream& os) const {
     fmt::print(os, "Post-Tree state:\n");
     m_posts.raw().dump(os);
 
+    fmt::print(os, "\n\n");
+    fmt::print(os, "Comment-Tree state:\n");
+    m_comments.raw().dump(os);
+
+    fmt::print(os, "\n\n");
+    fmt::print(os, "Activity index state:\n");
+    m_activity.raw().dump(os);
+
+    fmt::print(os, "\n\n");
+    fmt::print(os, "Search index state:\n");
+    m_search.dump(os);
+
+    fmt::print(os, "\n\n");
+    fmt::print(os, "User index state:\n");
+    m_users.raw().dump(os);
+
+    fmt::print(os, "\n\n");
+    fmt::print(os, "User dictionary state:\n");
+    m_user_names.dump(os);
+
     fmt::print(os, "\n\n");
     fmt::print(os, "String storage state:\n");
     m_strings.dump(os);
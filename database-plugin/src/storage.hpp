@@ -1,14 +1,19 @@
 #ifndef BLABBER_STORAGE_HPP
 #define BLABBER_STORAGE_HPP
 
+#include "search_index.hpp"
+#include "user_dictionary.hpp"
+
 #include <prequel/anchor_handle.hpp>
 #include <prequel/container/btree.hpp>
 #include <prequel/container/heap.hpp>
-#include <prequel/container/list.hpp>
 #include <prequel/fixed_string.hpp>
 #include <prequel/serialization.hpp>
 
+#include <algorithm>
+#include <optional>
 #include <string>
+#include <tuple>
 #include <variant>
 #include <vector>
 
@@ -35,10 +40,39 @@ public:
 struct comment;
 struct post;
 
+// Returns the current time as a unix timestamp (seconds, UTC).
+u64 current_timestamp();
+
+/*
+ * A string stored on the heap. Strings that are at least as large as the compression
+ * threshold of the storage are compressed, unless compression does not make them smaller.
+ */
+struct heap_string {
+    // Location of the (possibly compressed) string data. Invalid for empty strings.
+    prequel::heap_reference data;
+
+    // Size of the original string.
+    u32 size = 0;
+
+    // 1 if the data is compressed (zlib format), 0 otherwise.
+    u8 compressed = 0;
+
+    explicit operator bool() const { return static_cast<bool>(data); }
+
+    static constexpr auto get_binary_format() {
+        return prequel::binary_format(&heap_string::data, &heap_string::size,
+                                      &heap_string::compressed);
+    }
+};
+
 // A string is either inlined (i.e. stored directly), if its size is small enough,
 // or moved to the heap storage otherwise.
 template<u32 Capacity>
-using optimized_string = std::variant<prequel::fixed_cstring<Capacity>, prequel::heap::reference>;
+using optimized_string = std::variant<prequel::fixed_cstring<Capacity>, heap_string>;
+
+// Comment content up to this size (in bytes) is stored inside the comment itself,
+// i.e. in the leaf block of the comment tree. Changing this value changes the file format.
+static constexpr u32 comment_inline_capacity = 47;
 
 /*
  * The format of posts stored on disk.
@@ -47,44 +81,121 @@ struct post {
     // Unique id.
     u64 id = 0;
 
-    // Unix timestamp (seconds, UTC).
+    // Unix timestamp (seconds, UTC). Never smaller than the timestamp
+    // of an older post, which makes posts sorted by time as well.
     u64 created_at = 0;
 
-    // User name (string).
-    optimized_string<15> user;
+    // Id of the user (see user_dictionary).
+    u64 user_id = 0;
 
     // User defined title (string).
     optimized_string<31> title;
 
     // User defined content (string).
-    prequel::heap_reference content;
+    heap_string content;
+
+    // Number of comments, maintained on write so that it can be displayed
+    // without reading the comments. Also the position of the next comment.
+    u64 comment_count = 0;
+
+    // Unix timestamp of the newest comment (0 if there are no comments).
+    u64 last_comment_at = 0;
 
-    // All comments in the order they have been inserted in (not indexed by anything).
-    prequel::list<comment>::anchor comments;
+    // Time of the last activity (creation of the post or of its newest comment).
+    u64 last_activity_at() const { return std::max(created_at, last_comment_at); }
 
     // Defines the binary layout. Must list all members once.
     static constexpr auto get_binary_format() {
-        return prequel::binary_format(&post::id, &post::created_at, &post::user, &post::title,
-                                      &post::content, &post::comments);
+        return prequel::binary_format(&post::id, &post::created_at, &post::user_id,
+                                      &post::title, &post::content, &post::comment_count,
+                                      &post::last_comment_at);
+    }
+};
+
+/*
+ * An entry of the activity index, which orders posts by the time of their last activity.
+ * Every post has exactly one entry that is replaced when a comment is created.
+ */
+struct activity_entry {
+    u64 last_activity_at = 0;
+    u64 post_id = 0;
+
+    struct key {
+        std::tuple<u64, u64> operator()(const activity_entry& e) const {
+            return std::tuple(e.last_activity_at, e.post_id);
+        }
+    };
+
+    static constexpr auto get_binary_format() {
+        return prequel::binary_format(&activity_entry::last_activity_at,
+                                      &activity_entry::post_id);
     }
 };
 
 /*
- * The format of comments stored on disk.
+ * The format of comments stored on disk. Comments are indexed by their post and their position
+ * within the post (0 for the first comment ever created), so the comments of a post are
+ * contiguous and sorted by age. Positions are stable because comments are never removed.
  */
 struct comment {
+    u64 post_id = 0;
+    u64 position = 0;
+
     // Unix timestamp (seconds, UTC).
     u64 created_at = 0;
 
-    // User name (string).
-    optimized_string<15> user;
+    // Id of the user (see user_dictionary).
+    u64 user_id = 0;
 
-    // User defined content (string).
-    prequel::heap_reference content;
+    // User defined content (string). Short content is stored inline, which saves
+    // a random heap read for every comment loaded from disk.
+    optimized_string<comment_inline_capacity> content;
+
+    struct key {
+        std::tuple<u64, u64> operator()(const comment& c) const {
+            return std::tuple(c.post_id, c.position);
+        }
+    };
 
     // Defines the binary layout.
     static constexpr auto get_binary_format() {
-        return prequel::binary_format(&comment::created_at, &comment::user, &comment::content);
+        return prequel::binary_format(&comment::post_id, &comment::position,
+                                      &comment::created_at, &comment::user_id,
+                                      &comment::content);
+    }
+};
+
+/*
+ * An entry of the per-user index. Every post and every comment has an entry
+ * for its user, ordered by (user, time).
+ */
+struct user_activity_entry {
+    // Id of the user (see user_dictionary).
+    u64 user_id = 0;
+
+    // Unix timestamp of the post or comment.
+    u64 created_at = 0;
+
+    u64 post_id = 0;
+
+    // 0 for the post itself, otherwise the position of the comment in its post + 1.
+    u64 comment = 0;
+
+    // Title of the post or content of the comment. Shares the heap storage of the original
+    // string, so the index only stores short strings twice.
+    optimized_string<comment_inline_capacity> text;
+
+    struct key {
+        std::tuple<u64, u64, u64, u64> operator()(const user_activity_entry& e) const {
+            return std::tuple(e.user_id, e.created_at, e.post_id, e.comment);
+        }
+    };
+
+    static constexpr auto get_binary_format() {
+        return prequel::binary_format(&user_activity_entry::user_id,
+                                      &user_activity_entry::created_at,
+                                      &user_activity_entry::post_id, &user_activity_entry::comment,
+                                      &user_activity_entry::text);
     }
 };
 
@@ -99,6 +210,8 @@ struct frontpage_result {
         u64 created_at = 0;
         std::string user;
         std::string title;
+        u64 comment_count = 0;
+        u64 last_comment_at = 0;
     };
 
     // Newest entry first.
@@ -121,16 +234,82 @@ struct post_result {
     std::string title;
     std::string content;
 
+    // Total number of comments and the timestamp of the newest one (0 if there are none).
+    // `comments` may only contain a part of them.
+    u64 comment_count = 0;
+    u64 last_comment_at = 0;
+
     // Newest comment first.
     std::vector<comment_entry> comments;
 };
 
+/*
+ * The result of a comment query (a page of the comments of a post).
+ *
+ * Comments are addressed by their position in the post (0 for the first comment
+ * ever created). Positions are stable because comments are never removed.
+ */
+struct comments_result {
+    // Newest comment first.
+    std::vector<post_result::comment_entry> comments;
+
+    // Position of the oldest returned comment. Passing it as the `before`
+    // argument of the next query returns the next (older) page.
+    // Empty if there are no older comments.
+    std::optional<u64> next_before;
+};
+
+/*
+ * The result of a user activity query (a page of the posts and comments of a user).
+ */
+struct user_activity_result {
+    struct entry {
+        u64 created_at = 0;
+        u64 post_id = 0;
+
+        // Position of the comment in its post, empty if the entry is the post itself.
+        std::optional<u64> comment;
+
+        // Title of the post or content of the comment.
+        std::string text;
+    };
+
+    // Identifies an entry of the user index, used to continue with the next page.
+    struct position {
+        u64 created_at = 0;
+        u64 post_id = 0;
+        u64 comment = 0;
+    };
+
+    // Newest entry first.
+    std::vector<entry> entries;
+
+    // Passing this as the `cursor` argument of the next query returns the next (older) page.
+    // Empty if there are no older entries.
+    std::optional<position> next;
+};
+
 class storage {
     /*
      * Stores posts and indexes them by their id.
      */
     using post_tree = prequel::btree<post, prequel::indexed_by_member<&post::id>>;
 
+    /*
+     * Stores the comments of all posts, indexed by (post id, position).
+     */
+    using comment_tree = prequel::btree<comment, comment::key>;
+
+    /*
+     * Indexes posts by the time of their last activity.
+     */
+    using activity_tree = prequel::btree<activity_entry, activity_entry::key>;
+
+    /*
+     * Indexes the posts and comments of every user by time.
+     */
+    using user_tree = prequel::btree<user_activity_entry, user_activity_entry::key>;
+
 public:
     /*
      * The anchor of this class stores the fields that must be serialized in order to re-open the database.
@@ -150,8 +329,25 @@ public:
         // Long strings are stored on the heap.
         prequel::heap::anchor strings;
 
+        // Anchor of the activity index.
+        activity_tree::anchor activity;
+
+        // Anchor of the full text index over titles, post content and comments.
+        search_index::anchor search;
+
+        // Anchor of the per-user index.
+        user_tree::anchor users;
+
+        // Maps user names to the ids stored in posts and comments.
+        user_dictionary::anchor user_names;
+
+        // Anchor of the tree that stores all comments.
+        comment_tree::anchor comments;
+
         static constexpr auto get_binary_format() {
-            return prequel::binary_format(&anchor::next_post_id, &anchor::posts, &anchor::strings);
+            return prequel::binary_format(&anchor::next_post_id, &anchor::posts, &anchor::strings,
+                                          &anchor::activity, &anchor::search, &anchor::users,
+                                          &anchor::user_names, &anchor::comments);
         }
 
         friend storage;
@@ -159,26 +355,121 @@ public:
     };
 
 public:
-    explicit storage(prequel::anchor_handle<anchor> anchor_, prequel::allocator& alloc_);
+    // Strings of at least `compression_threshold` bytes are compressed when they are stored.
+    // Zero disables compression. Compressed strings can always be read.
+    // User names are looked up in `users` first, if it is not null.
+    explicit storage(prequel::anchor_handle<anchor> anchor_, prequel::allocator& alloc_,
+                     size_t compression_threshold = 0, user_cache* users = nullptr);
 
     prequel::engine& get_engine() const { return m_alloc->get_engine(); }
     prequel::allocator& get_allocator() const { return *m_alloc; }
 
-    u64 create_post(const std::string& user, const std::string& title, const std::string& content);
+    // Returns the front page entry of the new post. The post is created with the current time
+    // (or the time of the latest post, if the clock went backwards), unless `created_at`
+    // is specified. Throws std::invalid_argument if `created_at` is smaller than the
+    // creation time of the latest post.
+    frontpage_result::post_entry create_post(const std::string& user, const std::string& title,
+                                             const std::string& content,
+                                             std::optional<u64> created_at = {});
 
-    void create_comment(u64 post_id, const std::string& user, const std::string& content);
+    // Returns the new comment.
+    post_result::comment_entry
+    create_comment(u64 post_id, const std::string& user, const std::string& content);
+
+    // Appends the comments (oldest first, with their timestamps) to the post.
+    // The post is only read and updated once for all comments.
+    void create_comments(u64 post_id, const std::vector<post_result::comment_entry>& comments);
+
+    // Inserts a complete post (including all of its comments) with its original id and timestamps.
+    // Used to copy posts between databases. All data of the post is allocated together.
+    void import_post(const post_result& post);
 
     frontpage_result fetch_frontpage(size_t max_posts) const;
 
+    // Returns up to `max_posts` posts with an id smaller than `before_id` (newest first).
+    // Starts with the newest post if `before_id` is empty.
+    frontpage_result fetch_posts(std::optional<u64> before_id, size_t max_posts) const;
+
+    // Returns up to `max_posts` posts created in the time range [start, end] (newest first).
+    // If `before_id` is set, only posts with a smaller id are returned, which continues
+    // a previous page that ended with that post.
+    frontpage_result fetch_posts_between(u64 start, u64 end, size_t max_posts,
+                                         std::optional<u64> before_id = {}) const;
+
+    // Returns up to `max_posts` posts ordered by the time of their last activity
+    // (most recently active first).
+    frontpage_result fetch_active_posts(size_t max_posts) const;
+
+    // Returns up to `limit` posts whose title, content or comments match the query
+    // (best match first). See search_index::search() for the ranking.
+    frontpage_result search(const std::string& query, size_t limit) const;
+
+    // Returns up to `limit` posts and comments of the user (newest first), starting with the
+    // entry directly before `cursor` (or with the newest entry, if `cursor` is empty).
+    // Only reads the index (and the heap for long strings), never the posts or comments.
+    user_activity_result fetch_user_activity(const std::string& user, size_t limit,
+                                             std::optional<user_activity_result::position> cursor)
+        const;
+
     post_result fetch_post(u64 post_id, size_t max_comments) const;
 
-    void dump(std::ostream& os);
+    // Returns up to `limit` comments of the post, newest first, starting with the comment
+    // directly before position `before` (or with the newest comment, if `before` is empty).
+    // Positions beyond the newest comment are treated like an empty `before`.
+    comments_result
+    fetch_comments(u64 post_id, std::optional<u64> before, size_t limit) const;
+
+    // Returns the smallest post id >= `min_id`, or an empty optional if there is no such post.
+    std::optional<u64> find_next_post(u64 min_id) const;
+
+    void dump(std::ostream& os) const;
 
 private:
+    // Stores the string on the heap, compressed if possible.
+    heap_string store_string(const std::string& str);
+
+    // Stores the string by either inlining it (small strings) or saving it on the heap.
+    template<u32 Capacity>
+    optimized_string<Capacity> store_optimized_string(const std::string& str);
+
+    // Adds the title and content of a new post to the search index.
+    void index_post(u64 post_id, const std::string& title, const std::string& content);
+
+    // Inserts the entry of a post or comment into the per-user index. `comment` is 0 for posts
+    // or the position of the comment + 1.
+    template<u32 Capacity>
+    void index_user_activity(u64 user_id, u64 created_at, u64 post_id, u64 comment,
+                             const optimized_string<Capacity>& text);
+
+    // Stores the strings of the comment and returns its on disk representation.
+    comment store_comment(u64 post_id, u64 position, const post_result::comment_entry& entry);
+
+    // Returns up to `limit` comments of the post with a position smaller than `end`,
+    // newest first. `end` must not be greater than the number of comments of the post.
+    // Throws database_error if one of these comments is missing.
+    std::vector<comment> collect_comments(u64 post_id, u64 end, size_t limit) const;
+
+    // Returns a cursor to the first post created after `timestamp` (invalid if there is none).
+    post_tree::cursor first_post_after(u64 timestamp) const;
+
+    // Collects up to `max_posts` posts, starting at `cursor` and moving backwards,
+    // while `pred` returns true for the visited post.
+    template<typename Pred>
+    frontpage_result collect_posts(post_tree::cursor cursor, size_t max_posts, Pred&& pred) const;
+
+    // Loads the front page entries of the given posts (in the same order).
+    frontpage_result load_entries(const std::vector<post>& posts) const;
+
     prequel::anchor_handle<anchor> m_anchor;
     prequel::allocator* m_alloc = nullptr;
     post_tree m_posts;
+    comment_tree m_comments;
     prequel::heap m_strings;
+    activity_tree m_activity;
+    search_index m_search;
+    user_tree m_users;
+    user_dictionary m_user_names;
+    size_t m_compression_threshold = 0;
 };
 
 } // namespace blabber
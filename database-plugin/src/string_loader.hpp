@@ -0,0 +1,92 @@
+#ifndef BLABBER_STRING_LOADER_HPP
+#define BLABBER_STRING_LOADER_HPP
+
+#include "compression.hpp"
+#include "storage.hpp"
+
+#include <prequel/container/heap.hpp>
+
+#include <algorithm>
+#include <string>
+#include <variant>
+#include <vector>
+
+namespace blabber {
+
+/*
+ * Loads strings for the result of a query. Inlined strings are copied immediately, while
+ * strings stored on the heap are only collected at first. `load()` then reads them
+ * in the order of their location on disk (instead of the order in which they
+ * were requested), which avoids seeking back and forth in the heap file.
+ * Compressed strings are decompressed while they are being loaded.
+ *
+ * The target strings must remain valid (and must not be moved) until `load()` has been called.
+ */
+class string_loader {
+public:
+    explicit string_loader(const prequel::heap& h)
+        : m_heap(&h) {}
+
+    // Requests the heap string `str` to be loaded into `target`.
+    void add(const heap_string& str, std::string& target) {
+        target.clear();
+        if (str)
+            m_requests.push_back({str, &target});
+    }
+
+    // Requests the uncompressed heap string `ref` (older file formats) to be loaded into `target`.
+    void add(const prequel::heap_reference& ref, std::string& target) {
+        heap_string str;
+        str.data = ref;
+        add(str, target);
+    }
+
+    // Requests the string to be loaded into `target`, dereferencing if necessary.
+    template<u32 Capacity, typename HeapString>
+    void add(const std::variant<prequel::fixed_cstring<Capacity>, HeapString>& str,
+             std::string& target) {
+        if (auto inlined = std::get_if<prequel::fixed_cstring<Capacity>>(&str)) {
+            target.assign(inlined->begin(), inlined->end());
+        } else {
+            add(std::get<HeapString>(str), target);
+        }
+    }
+
+    // Loads all requested heap strings, sorted by their location.
+    void load() {
+        std::sort(m_requests.begin(), m_requests.end(),
+                  [](const request& a, const request& b) { return a.str.data < b.str.data; });
+
+        for (const request& req : m_requests) {
+            std::string& target = *req.target;
+            const size_t size = m_heap->size(req.str.data);
+            if (!req.str.compressed) {
+                target.resize(size);
+                m_heap->load(req.str.data, reinterpret_cast<byte*>(&target[0]), size);
+                continue;
+            }
+
+            m_buffer.resize(size);
+            m_heap->load(req.str.data, m_buffer.data(), size);
+            target.resize(req.str.size);
+            decompress_string(m_buffer.data(), size, target);
+        }
+        m_requests.clear();
+    }
+
+private:
+    struct request {
+        heap_string str;
+        std::string* target = nullptr;
+    };
+
+    const prequel::heap* m_heap;
+    std::vector<request> m_requests;
+
+    // Holds compressed data during load().
+    std::vector<byte> m_buffer;
+};
+
+} // namespace blabber
+
+#endif // BLABBER_STRING_LOADER_HPP
@@ -0,0 +1,205 @@
+#include "user_dictionary.hpp"
+#include "search_index.hpp"
+#include "storage.hpp"
+#include "string_loader.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <mutex>
+
+namespace blabber {
+
+user_cache::user_cache(size_t max_entries)
+    : m_max_entries(max_entries) {}
+
+std::optional<std::string> user_cache::find_name(u64 id) const {
+    std::shared_lock lock(m_mutex);
+    auto pos = m_names.find(id);
+    if (pos == m_names.end()) {
+        ++m_misses;
+        return {};
+    }
+    ++m_hits;
+    return pos->second.name;
+}
+
+std::optional<u64> user_cache::find_id(const std::string& name) const {
+    std::shared_lock lock(m_mutex);
+    auto pos = m_ids.find(name);
+    if (pos == m_ids.end()) {
+        ++m_misses;
+        return {};
+    }
+    ++m_hits;
+    return pos->second;
+}
+
+void user_cache::insert(u64 id, const std::string& name) {
+    if (m_max_entries == 0)
+        return;
+
+    std::unique_lock lock(m_mutex);
+    if (m_names.count(id))
+        return;
+
+    size_t slot = m_slots.size();
+    if (m_slots.size() >= m_max_entries) {
+        slot = std::uniform_int_distribution<size_t>(0, m_slots.size() - 1)(m_random);
+
+        auto victim = m_names.find(m_slots[slot]);
+        m_ids.erase(victim->second.name);
+        m_names.erase(victim);
+        m_slots[slot] = id;
+        ++m_evictions;
+    } else {
+        m_slots.push_back(id);
+    }
+    m_names.emplace(id, entry{name, slot});
+    m_ids.emplace(name, id);
+}
+
+user_cache_stats user_cache::stats() const {
+    std::shared_lock lock(m_mutex);
+
+    user_cache_stats stats;
+    stats.hits = m_hits;
+    stats.misses = m_misses;
+    stats.evictions = m_evictions;
+    stats.entries = m_names.size();
+    return stats;
+}
+
+user_dictionary::user_dictionary(prequel::anchor_handle<anchor> anchor_,
+                                 prequel::allocator& alloc_, prequel::heap& strings,
+                                 user_cache* cache)
+    : m_anchor(std::move(anchor_))
+    , m_strings(&strings)
+    , m_cache(cache)
+    , m_names(m_anchor.member<&anchor::names>(), alloc_)
+    , m_ids(m_anchor.member<&anchor::ids>(), alloc_)
+    , m_first_new_id(m_anchor.get<&anchor::next_id>()) {}
+
+u64 user_dictionary::intern(const std::string& name) {
+    if (auto id = find(name))
+        return *id;
+
+    if (name.size() > std::numeric_limits<u32>::max()) {
+        throw database_error("User name is too large.");
+    }
+
+    const u64 id = m_anchor.get<&anchor::next_id>();
+    if (id == 0) { // id wrap around, practically impossible
+        throw database_error("User ID space exhausted.");
+    }
+
+    id_entry entry;
+    entry.id = id;
+    if (name.size() <= 15) {
+        entry.name = prequel::fixed_cstring<15>(name);
+    } else {
+        entry.name = m_strings->allocate(reinterpret_cast<const byte*>(name.data()), name.size());
+    }
+    m_ids.insert(entry);
+    m_names.insert(name_entry{hash_string(name), id});
+
+    m_anchor.set<&anchor::next_id>(id + 1);
+    return id;
+}
+
+std::optional<u64> user_dictionary::find(const std::string& name) const {
+    if (m_cache) {
+        if (auto id = m_cache->find_id(name))
+            return id;
+    }
+
+    // Visit all users with the same hash (usually none or one).
+    const u64 hash = hash_string(name);
+    for (auto cursor = m_names.lower_bound(std::tuple(hash, u64(0)));
+         cursor && cursor.get().hash == hash; cursor.move_next()) {
+        const u64 id = cursor.get().id;
+        auto id_cursor = m_ids.find(id);
+        if (!id_cursor) {
+            throw std::logic_error("User name index refers to a user that does not exist.");
+        }
+        if (load_name(id_cursor.get()) == name) {
+            cache_user(id, name);
+            return id;
+        }
+    }
+    return {};
+}
+
+std::string user_dictionary::name(u64 id) const {
+    if (m_cache) {
+        if (auto name = m_cache->find_name(id))
+            return std::move(*name);
+    }
+
+    auto cursor = m_ids.find(id);
+    if (!cursor) {
+        throw std::logic_error("User does not exist.");
+    }
+
+    std::string name = load_name(cursor.get());
+    cache_user(id, name);
+    return name;
+}
+
+std::string user_dictionary::load_name(const id_entry& entry) const {
+    if (auto inlined = std::get_if<prequel::fixed_cstring<15>>(&entry.name)) {
+        return std::string(inlined->begin(), inlined->end());
+    }
+
+    const prequel::heap_reference ref = std::get<prequel::heap_reference>(entry.name);
+    std::string name(m_strings->size(ref), '\0');
+    m_strings->load(ref, reinterpret_cast<byte*>(&name[0]), name.size());
+    return name;
+}
+
+void user_dictionary::cache_user(u64 id, const std::string& name) const {
+    if (m_cache && id < m_first_new_id)
+        m_cache->insert(id, name);
+}
+
+void user_dictionary::dump(std::ostream& os) const {
+    m_ids.raw().dump(os);
+}
+
+void user_name_loader::load(string_loader& strings) {
+    std::sort(m_requests.begin(), m_requests.end(),
+              [](const request& a, const request& b) { return a.id < b.id; });
+
+    // Only the first request of every id is resolved, the others are copied afterwards.
+    std::vector<request> loaded;
+    for (size_t i = 0; i < m_requests.size(); ++i) {
+        const request& req = m_requests[i];
+        if (i > 0 && m_requests[i - 1].id == req.id)
+            continue;
+
+        if (m_users->m_cache) {
+            if (auto name = m_users->m_cache->find_name(req.id)) {
+                *req.target = std::move(*name);
+                continue;
+            }
+        }
+
+        auto cursor = m_users->m_ids.find(req.id);
+        if (!cursor) {
+            throw std::logic_error("User does not exist.");
+        }
+        strings.add(cursor.get().name, *req.target);
+        loaded.push_back(req);
+    }
+    strings.load();
+
+    for (const request& req : loaded) {
+        m_users->cache_user(req.id, *req.target);
+    }
+    for (size_t i = 1; i < m_requests.size(); ++i) {
+        if (m_requests[i - 1].id == m_requests[i].id)
+            *m_requests[i].target = *m_requests[i - 1].target;
+    }
+    m_requests.clear();
+}
+
+} // namespace blabber
@@ -0,0 +1,207 @@
+#ifndef BLABBER_USER_DICTIONARY_HPP
+#define BLABBER_USER_DICTIONARY_HPP
+
+#include <prequel/anchor_handle.hpp>
+#include <prequel/container/btree.hpp>
+#include <prequel/container/heap.hpp>
+#include <prequel/fixed_string.hpp>
+#include <prequel/serialization.hpp>
+
+#include <atomic>
+#include <optional>
+#include <ostream>
+#include <random>
+#include <shared_mutex>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+namespace blabber {
+
+using namespace prequel::short_types;
+
+class string_loader;
+
+/*
+ * Counters reported by the user cache.
+ */
+struct user_cache_stats {
+    u64 hits = 0;
+    u64 misses = 0;
+    u64 evictions = 0;
+    u64 entries = 0;
+};
+
+/*
+ * Keeps the names of recently used user ids (and the reverse mapping) in memory.
+ * The mapping between names and ids never changes once it has been committed,
+ * so entries never have to be invalidated. When the cache is full, a random entry
+ * is evicted for every new one. Unlike LRU eviction, this does not have to track
+ * lookups, so lookups only need a shared lock.
+ * This class is thread safe.
+ */
+class user_cache {
+public:
+    explicit user_cache(size_t max_entries);
+
+    user_cache(const user_cache&) = delete;
+    user_cache& operator=(const user_cache&) = delete;
+
+    size_t max_entries() const { return m_max_entries; }
+
+    std::optional<std::string> find_name(u64 id) const;
+    std::optional<u64> find_id(const std::string& name) const;
+
+    // Must only be called for committed users.
+    void insert(u64 id, const std::string& name);
+
+    user_cache_stats stats() const;
+
+private:
+    struct entry {
+        std::string name;
+
+        // Index in m_slots.
+        size_t slot = 0;
+    };
+
+private:
+    const size_t m_max_entries;
+
+    mutable std::atomic<u64> m_hits{0};
+    mutable std::atomic<u64> m_misses{0};
+    u64 m_evictions = 0;
+
+    mutable std::shared_mutex m_mutex;
+    std::unordered_map<u64, entry> m_names;
+    std::unordered_map<std::string, u64> m_ids;
+
+    // The ids of all cached users, in no particular order. Used to pick eviction victims.
+    std::vector<u64> m_slots;
+    std::minstd_rand m_random;
+};
+
+/*
+ * Maps user names to compact ids and back. Posts and comments only store the id
+ * of their user, every name is stored exactly once.
+ *
+ * Names are indexed by their hash (with the id as a tie breaker for colliding names),
+ * ids are indexed by themselves. Names up to 15 bytes are inlined into the id index,
+ * longer names are stored on the heap.
+ */
+class user_dictionary {
+    struct name_entry {
+        u64 hash = 0;
+        u64 id = 0;
+
+        struct key {
+            std::tuple<u64, u64> operator()(const name_entry& e) const {
+                return std::tuple(e.hash, e.id);
+            }
+        };
+
+        static constexpr auto get_binary_format() {
+            return prequel::binary_format(&name_entry::hash, &name_entry::id);
+        }
+    };
+
+    struct id_entry {
+        u64 id = 0;
+        std::variant<prequel::fixed_cstring<15>, prequel::heap_reference> name;
+
+        static constexpr auto get_binary_format() {
+            return prequel::binary_format(&id_entry::id, &id_entry::name);
+        }
+    };
+
+    using name_tree = prequel::btree<name_entry, name_entry::key>;
+    using id_tree = prequel::btree<id_entry, prequel::indexed_by_member<&id_entry::id>>;
+
+public:
+    class anchor {
+        // Ids start at 1, 0 is never used.
+        u64 next_id = 1;
+        name_tree::anchor names;
+        id_tree::anchor ids;
+
+        static constexpr auto get_binary_format() {
+            return prequel::binary_format(&anchor::next_id, &anchor::names, &anchor::ids);
+        }
+
+        friend user_dictionary;
+        friend prequel::binary_format_access;
+    };
+
+public:
+    // Long names are stored in `strings`. The cache is optional (it can be null).
+    // Users created by this instance are only inserted into the cache after they have been
+    // read by a later instance, i.e. in a later transaction, after they have been committed.
+    explicit user_dictionary(prequel::anchor_handle<anchor> anchor_, prequel::allocator& alloc_,
+                             prequel::heap& strings, user_cache* cache);
+
+    // Returns the id of the user, creating a new one if the name is unknown.
+    u64 intern(const std::string& name);
+
+    // Returns the id of the user, or an empty optional if the name is unknown.
+    std::optional<u64> find(const std::string& name) const;
+
+    // Returns the name of the user with the given id. Throws if the id does not exist.
+    std::string name(u64 id) const;
+
+    void dump(std::ostream& os) const;
+
+private:
+    friend class user_name_loader;
+
+    // Returns the name stored in the entry.
+    std::string load_name(const id_entry& entry) const;
+
+    // Inserts the user into the cache if it has been committed.
+    void cache_user(u64 id, const std::string& name) const;
+
+private:
+    prequel::anchor_handle<anchor> m_anchor;
+    prequel::heap* m_strings = nullptr;
+    user_cache* m_cache = nullptr;
+    name_tree m_names;
+    id_tree m_ids;
+
+    // Ids below this value existed before this instance was created.
+    u64 m_first_new_id = 0;
+};
+
+/*
+ * Resolves the user names for the result of a query. Ids are only collected at first,
+ * `load()` then looks up every distinct id once (in id order, i.e. in the order of the index)
+ * and loads long names from the heap together with the other strings of the query.
+ *
+ * The target strings must remain valid (and must not be moved) until `load()` has been called.
+ */
+class user_name_loader {
+public:
+    explicit user_name_loader(const user_dictionary& users)
+        : m_users(&users) {}
+
+    // Requests the name of the user `id` to be stored in `target`.
+    void add(u64 id, std::string& target) { m_requests.push_back({id, &target}); }
+
+    // Resolves all requested names. Names stored on the heap are added to `strings`,
+    // which is loaded as well (i.e. `strings.load()` is called by this function).
+    // Throws if one of the ids does not exist.
+    void load(string_loader& strings);
+
+private:
+    struct request {
+        u64 id = 0;
+        std::string* target = nullptr;
+    };
+
+    const user_dictionary* m_users;
+    std::vector<request> m_requests;
+};
+
+} // namespace blabber
+
+#endif // BLABBER_USER_DICTIONARY_HPP
@@ -0,0 +1,144 @@
+#include "test.hpp"
+
+#include <memory>
+#include <string>
+
+using namespace blabber;
+using namespace blabber::test;
+
+static std::shared_ptr<const post_result> make_post(u64 id, size_t content_size) {
+    auto result = std::make_shared<post_result>();
+    result->id = id;
+    result->user = "alice";
+    result->title = fmt::format("post {}", id);
+    result->content = std::string(content_size, 'x');
+    return result;
+}
+
+/*
+ * The post cache evicts the least recently used entries once its size limit is exceeded.
+ */
+TEST_CASE(cache_post_cache_evicts_least_recently_used) {
+    // Room for two posts of 10000 bytes, but not for three.
+    post_cache cache(25000);
+    cache.insert(make_post(1, 10000), 10);
+    cache.insert(make_post(2, 10000), 10);
+    REQUIRE(cache.fetch(1, 10)); // 2 is now the least recently used entry.
+
+    cache.insert(make_post(3, 10000), 10);
+    REQUIRE(cache.fetch(1, 10));
+    REQUIRE(!cache.fetch(2, 10));
+    REQUIRE(cache.fetch(3, 10));
+
+    const cache_stats stats = cache.stats();
+    REQUIRE(stats.evictions == 1);
+    REQUIRE(stats.entries == 2);
+    REQUIRE(stats.bytes <= 25000);
+
+    // Results that are larger than the cache are not cached at all.
+    cache.insert(make_post(4, 30000), 10);
+    REQUIRE(!cache.fetch(4, 10));
+    REQUIRE(cache.stats().entries == 2);
+}
+
+/*
+ * Cached entries only serve queries for at most as many comments as they were loaded with.
+ */
+TEST_CASE(cache_post_cache_respects_comment_limit) {
+    post_cache cache(1 << 20);
+    auto post = std::make_shared<post_result>(*make_post(1, 100));
+    post->comment_count = 5;
+    for (u64 i = 0; i < 2; ++i)
+        post->comments.push_back({100 - i, "bob", fmt::format("comment {}", 4 - i)});
+    cache.insert(post, 2);
+
+    REQUIRE(cache.fetch(1, 2));
+    REQUIRE(!cache.fetch(1, 3));
+
+    cache.insert_comment(1, {200, "carol", "comment 5"});
+    auto cached = cache.fetch(1, 2);
+    REQUIRE(cached && cached->comment_count == 6);
+    REQUIRE(cached->comments.front().content == "comment 5");
+
+    cache.erase(1);
+    REQUIRE(!cache.fetch(1, 1));
+}
+
+/*
+ * The user cache evicts (random) entries once it is full, it never exceeds its size.
+ */
+TEST_CASE(cache_user_cache_evicts_when_full) {
+    user_cache cache(4);
+    for (u64 id = 1; id <= 10; ++id)
+        cache.insert(id, fmt::format("user {}", id));
+
+    const user_cache_stats stats = cache.stats();
+    REQUIRE(stats.entries == 4);
+    REQUIRE(stats.evictions == 6);
+
+    // The remaining entries still map both ways.
+    size_t found = 0;
+    for (u64 id = 1; id <= 10; ++id) {
+        if (auto name = cache.find_name(id)) {
+            REQUIRE(*name == fmt::format("user {}", id));
+            REQUIRE(cache.find_id(*name) == id);
+            found += 1;
+        } else {
+            REQUIRE(!cache.find_id(fmt::format("user {}", id)));
+        }
+    }
+    REQUIRE(found == 4);
+}
+
+/*
+ * The front page cache keeps the newest `capacity` posts.
+ */
+TEST_CASE(cache_frontpage_cache_keeps_newest_posts) {
+    frontpage_cache cache(3);
+    cache.reset(frontpage_result());
+    for (u64 id = 1; id <= 5; ++id) {
+        frontpage_result::post_entry entry;
+        entry.id = id;
+        entry.title = fmt::format("post {}", id);
+        cache.insert(entry);
+    }
+
+    auto entries = cache.fetch(3);
+    REQUIRE(entries && entries->size() == 3);
+    REQUIRE((*entries)[0]->id == 5);
+    REQUIRE((*entries)[2]->id == 3);
+
+    // Older posts are no longer cached.
+    REQUIRE(!cache.fetch(4));
+}
+
+/*
+ * Results served after an eviction are loaded from the database again and include
+ * the comments created in the meantime.
+ */
+TEST_CASE(cache_database_results_survive_eviction) {
+    temp_dir dir;
+    database_options options = small_options();
+    options.post_cache_bytes = 4096;
+    database db(dir.file("test.db"), options);
+
+    std::vector<u64> ids;
+    for (u64 i = 0; i < 20; ++i)
+        ids.push_back(db.create_post("alice", fmt::format("post {}", i), std::string(1000, 'x')));
+
+    for (u64 round = 0; round < 3; ++round) {
+        for (u64 id : ids) {
+            REQUIRE(db.create_comment(id, "bob", fmt::format("comment {}", round)));
+            auto post = db.fetch_post(id, 10);
+            REQUIRE(post);
+            REQUIRE(post->comment_count == round + 1);
+            REQUIRE(post->comments.size() == round + 1);
+            REQUIRE(post->comments.front().content == fmt::format("comment {}", round));
+        }
+    }
+
+    const result_cache_stats stats = db.cache_stats();
+    REQUIRE(stats.posts.evictions > 0);
+    REQUIRE(stats.posts.bytes <= 4096);
+    db.finish();
+}
@@ -0,0 +1,141 @@
+#include "test.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace blabber;
+using namespace blabber::test;
+
+/*
+ * Compaction copies the database while a writer keeps creating posts and comments.
+ * The copy must be consistent: it contains exactly the writes that were committed before
+ * the final step of the compaction, i.e. a prefix of the writer's operations.
+ */
+TEST_CASE(compaction_races_with_writes) {
+    temp_dir dir;
+    database_options options = small_options();
+    options.checkpoint_threshold = 64 << 10; // Checkpoints happen during the copy as well.
+    database db(dir.file("source.db"), options);
+
+    // More than one batch of the copy (see database::post_copier).
+    constexpr u64 initial_posts = 2500;
+    std::vector<database::new_post> posts;
+    for (u64 i = 0; i < initial_posts; ++i) {
+        const std::string content = i % 3 == 0 ? std::string(2000, 'a' + i % 26) : "short";
+        posts.push_back({fmt::format("user {}", i % 10), fmt::format("post {}", i), content, {}});
+    }
+    const std::vector<u64> ids = db.insert_posts(posts);
+    std::map<u64, std::vector<post_result::comment_entry>> comments;
+    for (u64 id : ids) {
+        for (u64 c = 0; c < 3; ++c)
+            comments[id].push_back({1, "bob", fmt::format("initial {} {}", id, c)});
+    }
+    REQUIRE(db.insert_comments(comments) == 0);
+
+    // Operation j creates a post (every 10th operation) or a comment, titles and contents
+    // are "op j". Comments go to old and to new posts.
+    std::atomic<bool> stop{false};
+    std::atomic<size_t> errors{0};
+    u64 ops = 0; // Only accessed by the writer until it has been joined.
+    std::thread writer([&] {
+        std::vector<u64> new_posts;
+        try {
+            for (u64 j = 0; !stop; ++j, ++ops) {
+                const std::string text = fmt::format("op {}", j);
+                if (j % 10 == 0) {
+                    new_posts.push_back(db.create_post("writer", text, "content"));
+                } else {
+                    const u64 target = j % 2 == 0 ? new_posts[j % new_posts.size()]
+                                                  : ids[(j * 7919) % ids.size()];
+                    if (!db.create_comment(target, "writer", text))
+                        ++errors;
+                }
+            }
+        } catch (...) {
+            ++errors;
+        }
+    });
+
+    compact_stats stats;
+    try {
+        stats = db.compact(dir.file("dest.db"));
+    } catch (...) {
+        stop = true;
+        writer.join();
+        throw;
+    }
+    stop = true;
+    writer.join();
+    REQUIRE(errors == 0);
+
+    const std::map<u64, post_result> source = read_posts(db);
+    db.finish();
+
+    database dest_db(dir.file("dest.db"), small_options());
+    const std::map<u64, post_result> dest = read_posts(dest_db);
+    dest_db.finish();
+
+    // Every post of the copy equals the source post, except that newer comments may be missing.
+    std::set<std::string> copied_ops;
+    u64 copied_comments = 0;
+    for (const auto& [id, copy] : dest) {
+        auto pos = source.find(id);
+        REQUIRE(pos != source.end());
+        post_result expected = pos->second;
+        REQUIRE(copy.comments.size() <= expected.comments.size());
+
+        // Comments are newest first: drop the ones that were created after the copy.
+        expected.comments.erase(expected.comments.begin(),
+                                expected.comments.end() - copy.comments.size());
+        expected.comment_count = expected.comments.size();
+        expected.last_comment_at = 0;
+        for (const post_result::comment_entry& comment : expected.comments)
+            expected.last_comment_at = std::max(expected.last_comment_at, comment.created_at);
+        REQUIRE(same_post(copy, expected));
+
+        if (copy.title.compare(0, 3, "op ") == 0)
+            copied_ops.insert(copy.title);
+        for (const post_result::comment_entry& comment : copy.comments) {
+            if (comment.content.compare(0, 3, "op ") == 0)
+                copied_ops.insert(comment.content);
+        }
+        copied_comments += copy.comments.size();
+    }
+
+    // All initial data and a prefix of the writer's operations have been copied.
+    for (u64 id : ids)
+        REQUIRE(dest.count(id));
+    for (size_t j = 0; j < copied_ops.size(); ++j)
+        REQUIRE(copied_ops.count(fmt::format("op {}", j)));
+    REQUIRE(copied_ops.size() <= ops);
+
+    REQUIRE(stats.copied.posts == dest.size());
+    REQUIRE(stats.copied.comments == copied_comments);
+    REQUIRE(stats.copied.adjusted_timestamps == 0);
+}
+
+/*
+ * Compaction refuses to overwrite a database that already contains posts.
+ */
+TEST_CASE(compaction_requires_empty_destination) {
+    temp_dir dir;
+    {
+        database other(dir.file("dest.db"), small_options());
+        other.create_post("alice", "title", "content");
+        other.finish();
+    }
+
+    database db(dir.file("source.db"), small_options());
+    db.create_post("bob", "title", "content");
+    REQUIRE_THROWS_AS(db.compact(dir.file("dest.db")), database_error);
+
+    // The failed compaction does not block the next one.
+    const compact_stats stats = db.compact(dir.file("dest2.db"));
+    REQUIRE(stats.copied.posts == 1);
+    db.finish();
+}
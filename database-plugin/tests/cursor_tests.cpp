@@ -0,0 +1,172 @@
+#include "test.hpp"
+
+#include <algorithm>
+#include <map>
+#include <optional>
+#include <string>
+#include <tuple>
+#include <vector>
+
+using namespace blabber;
+using namespace blabber::test;
+
+/*
+ * Pages of fetch_posts_between() are continued with the id of the last post of the previous
+ * page. Together, the pages must contain every post in the range exactly once, newest first.
+ */
+TEST_CASE(cursor_fetch_posts_between_pages) {
+    temp_dir dir;
+    database db(dir.file("test.db"), small_options());
+
+    // Post i (id i + 1) is created at time 1000 + 10 * (i / 2), so timestamps repeat.
+    std::vector<database::new_post> posts;
+    for (u64 i = 0; i < 100; ++i)
+        posts.push_back({"alice", fmt::format("post {}", i), "content", 1000 + 10 * (i / 2)});
+    const std::vector<u64> ids = db.insert_posts(posts);
+    REQUIRE(ids.size() == posts.size());
+
+    const u64 start = 1100;
+    const u64 end = 1300;
+    std::vector<u64> expected;
+    for (u64 i = posts.size(); i-- > 0;) {
+        if (*posts[i].created_at >= start && *posts[i].created_at <= end)
+            expected.push_back(ids[i]);
+    }
+
+    std::vector<u64> found;
+    std::optional<u64> before;
+    while (1) {
+        const frontpage_result page = db.fetch_posts_between(start, end, 7, before);
+        REQUIRE(page.entries.size() <= 7);
+        for (const frontpage_result::post_entry& entry : page.entries) {
+            REQUIRE(entry.created_at >= start && entry.created_at <= end);
+            found.push_back(entry.id);
+        }
+        if (page.entries.size() < 7)
+            break;
+        before = page.entries.back().id;
+    }
+    REQUIRE(found == expected);
+
+    REQUIRE(db.fetch_posts_between(end, start, 10, {}).entries.empty());
+    REQUIRE(db.fetch_posts_between(5000, 6000, 10, {}).entries.empty());
+    db.finish();
+}
+
+/*
+ * Comment positions are stable: comments created while a client pages through the older
+ * comments do not shift the following pages.
+ */
+TEST_CASE(cursor_fetch_comments_pages) {
+    temp_dir dir;
+    database db(dir.file("test.db"), small_options());
+
+    const u64 post_id = db.create_post("alice", "title", "content");
+    std::map<u64, std::vector<post_result::comment_entry>> comments;
+    for (u64 i = 0; i < 100; ++i) {
+        // Long comments are stored on the heap, short ones inline.
+        const std::string content = i % 10 == 0 ? std::string(200, 'x') + std::to_string(i)
+                                                : fmt::format("comment {}", i);
+        comments[post_id].push_back({1000 + i, "bob", content});
+    }
+    REQUIRE(db.insert_comments(comments) == 0);
+
+    std::vector<std::string> found;
+    std::optional<u64> before;
+    bool added = false;
+    while (1) {
+        const std::optional<comments_result> page = db.fetch_comments(post_id, before, 7);
+        REQUIRE(page);
+        REQUIRE(page->comments.size() <= 7);
+        for (const post_result::comment_entry& comment : page->comments)
+            found.push_back(comment.content);
+        if (!page->next_before)
+            break;
+        before = page->next_before;
+
+        if (!added) {
+            REQUIRE(db.create_comment(post_id, "carol", "new comment"));
+            added = true;
+        }
+    }
+
+    REQUIRE(found.size() == 100);
+    for (u64 i = 0; i < 100; ++i)
+        REQUIRE(found[i] == comments[post_id][99 - i].content);
+
+    // The newest page includes the comment created in the meantime.
+    const std::optional<comments_result> newest = db.fetch_comments(post_id, {}, 1);
+    REQUIRE(newest && newest->comments.size() == 1);
+    REQUIRE(newest->comments[0].content == "new comment");
+    REQUIRE(newest->next_before == u64(100));
+
+    // Positions beyond the newest comment start with the newest comment.
+    const std::optional<comments_result> beyond = db.fetch_comments(post_id, 1000, 1);
+    REQUIRE(beyond && beyond->comments.size() == 1);
+    REQUIRE(beyond->comments[0].content == "new comment");
+
+    const std::optional<comments_result> oldest = db.fetch_comments(post_id, 0, 10);
+    REQUIRE(oldest && oldest->comments.empty() && !oldest->next_before);
+
+    REQUIRE(!db.fetch_comments(post_id + 1, {}, 10));
+    db.finish();
+}
+
+/*
+ * A user's posts and comments are returned newest first, every page continues
+ * directly after the entry identified by the cursor of the previous page.
+ */
+TEST_CASE(cursor_fetch_user_activity_pages) {
+    temp_dir dir;
+    database db(dir.file("test.db"), small_options());
+
+    std::vector<database::new_post> posts;
+    for (u64 i = 0; i < 10; ++i) {
+        const std::string user = i % 2 == 0 ? "alice" : "bob";
+        posts.push_back({user, fmt::format("post {}", i), "content", 1000 + 100 * i});
+    }
+    const std::vector<u64> ids = db.insert_posts(posts);
+
+    // (created_at, post id, comment position or empty, text) of alice's entries.
+    using entry = std::tuple<u64, u64, std::optional<u64>, std::string>;
+    std::vector<entry> expected;
+    std::map<u64, std::vector<post_result::comment_entry>> comments;
+    for (u64 i = 0; i < 10; ++i) {
+        if (posts[i].user == "alice")
+            expected.emplace_back(*posts[i].created_at, ids[i], std::nullopt, posts[i].title);
+
+        // The comments of a post share a timestamp, so their order depends on the position.
+        for (u64 c = 0; c < 5; ++c) {
+            const std::string user = c % 2 == 0 ? "alice" : "carol";
+            const std::string content = fmt::format("comment {} {}", i, c);
+            comments[ids[i]].push_back({*posts[i].created_at + 50, user, content});
+            if (user == "alice")
+                expected.emplace_back(*posts[i].created_at + 50, ids[i], c, content);
+        }
+    }
+    REQUIRE(db.insert_comments(comments) == 0);
+    std::sort(expected.begin(), expected.end(), [](const entry& a, const entry& b) {
+        // Posts sort before their comments at the same time (comment = 0 in the index).
+        auto key = [](const entry& e) {
+            const std::optional<u64>& comment = std::get<2>(e);
+            return std::tuple(std::get<0>(e), std::get<1>(e), comment ? *comment + 1 : 0);
+        };
+        return key(a) > key(b);
+    });
+
+    std::vector<entry> found;
+    std::optional<user_activity_result::position> cursor;
+    while (1) {
+        const user_activity_result page = db.fetch_user_activity("alice", 4, cursor);
+        REQUIRE(page.entries.size() <= 4);
+        for (const user_activity_result::entry& e : page.entries)
+            found.emplace_back(e.created_at, e.post_id, e.comment, e.text);
+        if (!page.next)
+            break;
+        cursor = page.next;
+    }
+    REQUIRE(found == expected);
+
+    REQUIRE(db.fetch_user_activity("nobody", 10, {}).entries.empty());
+    db.finish();
+}
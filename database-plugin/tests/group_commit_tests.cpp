@@ -0,0 +1,114 @@
+#include "test.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace blabber;
+using namespace blabber::test;
+
+/*
+ * Comments for a missing post fail inside the group that commits them. The other operations
+ * of the group must be committed exactly once (failed groups are re-applied), and every
+ * caller must receive its own result.
+ */
+TEST_CASE(group_commit_isolates_failed_operations) {
+    temp_dir dir;
+    database_options options = small_options();
+    options.group_commit_window = std::chrono::milliseconds(5);
+    options.group_commit_max_ops = 16;
+    database db(dir.file("test.db"), options);
+
+    const u64 post_id = db.create_post("alice", "title", "content");
+    const u64 missing_post_id = post_id + 1000;
+
+    constexpr size_t threads = 8;
+    constexpr size_t ops_per_thread = 50;
+    std::atomic<size_t> wrong_results{0};
+    std::vector<std::vector<u64>> new_posts(threads);
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            try {
+                for (size_t i = 0; i < ops_per_thread; ++i) {
+                    const std::string content = fmt::format("comment {} {}", t, i);
+                    switch (i % 3) {
+                    case 0:
+                        if (!db.create_comment(post_id, "bob", content))
+                            ++wrong_results;
+                        break;
+                    case 1:
+                        if (db.create_comment(missing_post_id, "bob", content))
+                            ++wrong_results;
+                        break;
+                    case 2:
+                        new_posts[t].push_back(db.create_post("carol", content, "content"));
+                        break;
+                    }
+                }
+            } catch (...) {
+                ++wrong_results;
+            }
+        });
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    REQUIRE(wrong_results == 0);
+
+    std::set<std::string> expected;
+    for (size_t t = 0; t < threads; ++t) {
+        for (size_t i = 0; i < ops_per_thread; i += 3)
+            expected.insert(fmt::format("comment {} {}", t, i));
+    }
+
+    auto post = db.fetch_post(post_id, size_t(-1));
+    REQUIRE(post);
+    REQUIRE(post->comment_count == expected.size());
+    REQUIRE(post->comments.size() == expected.size());
+
+    std::set<std::string> found;
+    for (const post_result::comment_entry& comment : post->comments) {
+        REQUIRE(found.insert(comment.content).second);
+    }
+    REQUIRE(found == expected);
+
+    // Every new post was created exactly once, with a distinct id.
+    std::set<u64> post_ids{post_id};
+    for (const std::vector<u64>& ids : new_posts) {
+        for (u64 id : ids) {
+            REQUIRE(post_ids.insert(id).second);
+            REQUIRE(db.fetch_post(id, 0));
+        }
+    }
+    REQUIRE(db.fetch_posts({}, size_t(-1)).entries.size() == post_ids.size());
+    db.finish();
+}
+
+/*
+ * A batch is applied as a single operation of a group commit: its writes are atomic and
+ * its reads see the changes of earlier operations of the same batch.
+ */
+TEST_CASE(group_commit_applies_batches_atomically) {
+    temp_dir dir;
+    database db(dir.file("test.db"), small_options());
+
+    const u64 post_id = db.create_post("alice", "title", "content");
+    const std::vector<batch::result> results = db.execute_batch({
+        batch::create_comment{post_id, "bob", "first"},
+        batch::create_comment{post_id + 1, "bob", "missing"},
+        batch::fetch_post{post_id, 10},
+    });
+    REQUIRE(results.size() == 3);
+    REQUIRE(std::get<bool>(results[0]));
+    REQUIRE(!std::get<bool>(results[1]));
+
+    const auto& post = std::get<std::shared_ptr<const post_result>>(results[2]);
+    REQUIRE(post);
+    REQUIRE(post->comments.size() == 1);
+    REQUIRE(post->comments[0].content == "first");
+    db.finish();
+}
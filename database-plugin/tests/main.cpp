@@ -0,0 +1,122 @@
+/*
+ * Runs the tests of the database (without python).
+ *
+ * Usage: blabber_tests [NAME...]
+ *
+ * Runs all test cases, or only the ones with the given names. Returns a non-zero
+ * exit code if a test case failed.
+ */
+
+#include "test.hpp"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <exception>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+namespace blabber::test {
+
+std::vector<test_case>& registry() {
+    static std::vector<test_case> tests;
+    return tests;
+}
+
+temp_dir::temp_dir() {
+    static std::atomic<u64> next_id{0};
+
+    const std::filesystem::path path = std::filesystem::temp_directory_path()
+                                       / fmt::format("blabber-test-{}-{}", ::getpid(), next_id++);
+    std::filesystem::remove_all(path);
+    std::filesystem::create_directories(path);
+    m_path = path.string();
+}
+
+temp_dir::~temp_dir() {
+    std::error_code ec;
+    std::filesystem::remove_all(m_path, ec);
+}
+
+std::string temp_dir::file(const std::string& name) const {
+    return (std::filesystem::path(m_path) / name).string();
+}
+
+database_options small_options() {
+    database_options options;
+    options.cache_blocks = 64;
+    options.sync = sync_mode::none;
+    return options;
+}
+
+std::map<u64, post_result> read_posts(database& db) {
+    std::map<u64, post_result> posts;
+    std::optional<u64> before;
+    while (1) {
+        const frontpage_result page = db.fetch_posts(before, 1000);
+        for (const frontpage_result::post_entry& entry : page.entries) {
+            auto post = db.fetch_post(entry.id, size_t(-1));
+            if (!post)
+                throw failure(fmt::format("Post {} is listed but cannot be fetched.", entry.id));
+            posts.emplace(entry.id, *post);
+        }
+        if (page.entries.empty())
+            break;
+        before = page.entries.back().id;
+    }
+    return posts;
+}
+
+bool same_post(const post_result& a, const post_result& b) {
+    auto same_comment = [](const post_result::comment_entry& x,
+                           const post_result::comment_entry& y) {
+        return x.created_at == y.created_at && x.user == y.user && x.content == y.content;
+    };
+    return a.id == b.id && a.created_at == b.created_at && a.user == b.user
+           && a.title == b.title && a.content == b.content && a.comment_count == b.comment_count
+           && a.last_comment_at == b.last_comment_at
+           && std::equal(a.comments.begin(), a.comments.end(), b.comments.begin(),
+                         b.comments.end(), same_comment);
+}
+
+} // namespace blabber::test
+
+int main(int argc, char** argv) {
+    using namespace blabber::test;
+
+    const std::vector<std::string> selected(argv + 1, argv + argc);
+    auto is_selected = [&](const test_case& test) {
+        if (selected.empty())
+            return true;
+        for (const std::string& name : selected) {
+            if (name == test.name)
+                return true;
+        }
+        return false;
+    };
+
+    size_t passed = 0;
+    size_t failed = 0;
+    for (const test_case& test : registry()) {
+        if (!is_selected(test))
+            continue;
+
+        try {
+            test.run();
+            passed += 1;
+            fmt::print("ok       {}\n", test.name);
+        } catch (const std::exception& e) {
+            failed += 1;
+            fmt::print("FAILED   {}: {}\n", test.name, e.what());
+        }
+        std::fflush(stdout);
+    }
+
+    fmt::print("\n{} passed, {} failed\n", passed, failed);
+    return failed == 0 && passed > 0 ? 0 : 1;
+}
@@ -0,0 +1,104 @@
+#include "test.hpp"
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace blabber;
+using namespace blabber::test;
+
+/*
+ * Readers fetch posts (bypassing the result caches, so that every fetch reads the database)
+ * while a writer creates posts and comments and checkpoints keep merging the journal into
+ * the database file. Every result must be consistent: comment k of a post has the content
+ * "comment k", the comment count matches the comments and never decreases.
+ * The database checks that its file is only modified by checkpoints (see
+ * database::check_database_unmodified), so a violation fails the reads and writes as well.
+ */
+static void run_snapshot_reads_race_with_checkpoints(bool mmap_reads) {
+    temp_dir dir;
+    database_options options = small_options();
+    options.checkpoint_threshold = 16 << 10;
+    options.post_cache_bytes = 0;
+    options.frontpage_cache_size = 0;
+    options.mmap_reads = mmap_reads;
+    database db(dir.file("test.db"), options);
+
+    constexpr u64 initial_posts = 20;
+    std::vector<u64> ids;
+    for (u64 i = 0; i < initial_posts; ++i)
+        ids.push_back(db.create_post("alice", fmt::format("post {}", i), std::string(500, 'x')));
+
+    std::atomic<bool> stop{false};
+    std::atomic<size_t> errors{0};
+    std::atomic<size_t> reads{0};
+
+    auto read_loop = [&](u64 seed) {
+        std::vector<u64> seen(ids.size(), 0);
+        try {
+            for (u64 i = seed; !stop; ++i) {
+                const size_t index = (i * 7919) % ids.size();
+                auto post = db.fetch_post(ids[index], size_t(-1));
+                if (!post || post->comment_count != post->comments.size()
+                    || post->comment_count < seen[index]) {
+                    ++errors;
+                    continue;
+                }
+                // Comments are newest first.
+                for (size_t c = 0; c < post->comments.size(); ++c) {
+                    const u64 k = post->comments.size() - 1 - c;
+                    if (post->comments[c].content != fmt::format("comment {}", k))
+                        ++errors;
+                }
+                seen[index] = post->comment_count;
+                ++reads;
+            }
+        } catch (...) {
+            ++errors;
+        }
+    };
+
+    std::vector<std::thread> readers;
+    for (u64 r = 0; r < 4; ++r)
+        readers.emplace_back(read_loop, r);
+
+    try {
+        std::vector<u64> comments(ids.size(), 0);
+        for (u64 j = 0; j < 2000; ++j) {
+            const size_t index = j % ids.size();
+            REQUIRE(db.create_comment(ids[index], "bob",
+                                      fmt::format("comment {}", comments[index]++)));
+            if (j % 50 == 0)
+                db.create_post("carol", fmt::format("new {}", j), std::string(1000, 'y'));
+            if (j % 200 == 0)
+                db.checkpoint_now();
+        }
+    } catch (...) {
+        stop = true;
+        for (std::thread& reader : readers)
+            reader.join();
+        throw;
+    }
+    stop = true;
+    for (std::thread& reader : readers)
+        reader.join();
+
+    REQUIRE(errors == 0);
+    REQUIRE(reads > 0);
+    REQUIRE(db.stats().snapshot_reads > 0);
+
+    for (u64 id : ids) {
+        auto post = db.fetch_post(id, size_t(-1));
+        REQUIRE(post && post->comment_count == 2000 / initial_posts);
+    }
+    db.finish();
+}
+
+TEST_CASE(snapshot_reads_race_with_checkpoints) {
+    run_snapshot_reads_race_with_checkpoints(false);
+}
+
+TEST_CASE(snapshot_reads_race_with_checkpoints_mmap) {
+    run_snapshot_reads_race_with_checkpoints(true);
+}
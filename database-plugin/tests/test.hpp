@@ -0,0 +1,98 @@
+#ifndef BLABBER_TESTS_TEST_HPP
+#define BLABBER_TESTS_TEST_HPP
+
+#include "database.hpp"
+
+#include <fmt/format.h>
+
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/*
+ * A minimal test harness: test cases register themselves with TEST_CASE and fail by throwing
+ * from REQUIRE. The test runner (main.cpp) executes every registered test case, or the ones
+ * named on its command line.
+ */
+
+namespace blabber::test {
+
+struct test_case {
+    const char* name = nullptr;
+    void (*run)() = nullptr;
+};
+
+// All test cases of the executable, in registration order.
+std::vector<test_case>& registry();
+
+struct registrar {
+    registrar(const char* name, void (*run)()) { registry().push_back(test_case{name, run}); }
+};
+
+class failure : public std::runtime_error {
+public:
+    using runtime_error::runtime_error;
+};
+
+[[noreturn]] inline void fail(const char* file, int line, const std::string& message) {
+    throw failure(fmt::format("{}:{}: {}", file, line, message));
+}
+
+/*
+ * A directory for the files of a single test. It is created empty and removed
+ * (with all files in it) when the object is destroyed.
+ */
+class temp_dir {
+public:
+    temp_dir();
+    ~temp_dir();
+
+    temp_dir(const temp_dir&) = delete;
+    temp_dir& operator=(const temp_dir&) = delete;
+
+    // Returns the path of the file with the given name inside the directory.
+    std::string file(const std::string& name) const;
+
+private:
+    std::string m_path;
+};
+
+// Options for small databases: a small block cache and no syncs.
+database_options small_options();
+
+// Reads all posts of the database (with all of their comments), indexed by id.
+std::map<u64, post_result> read_posts(database& db);
+
+// Returns true if both results are equal, including their comments.
+bool same_post(const post_result& a, const post_result& b);
+
+} // namespace blabber::test
+
+#define BLABBER_TEST_CONCAT_IMPL(a, b) a##b
+#define BLABBER_TEST_CONCAT(a, b) BLABBER_TEST_CONCAT_IMPL(a, b)
+
+#define TEST_CASE(name)                                                                            \
+    static void name();                                                                            \
+    static const ::blabber::test::registrar BLABBER_TEST_CONCAT(name, _registrar)(#name, &name);   \
+    static void name()
+
+#define REQUIRE(expr)                                                                              \
+    do {                                                                                           \
+        if (!(expr))                                                                               \
+            ::blabber::test::fail(__FILE__, __LINE__, "REQUIRE(" #expr ") failed.");               \
+    } while (0)
+
+#define REQUIRE_THROWS_AS(expr, type)                                                              \
+    do {                                                                                           \
+        bool thrown_ = false;                                                                      \
+        try {                                                                                      \
+            expr;                                                                                  \
+        } catch (const type&) {                                                                    \
+            thrown_ = true;                                                                        \
+        }                                                                                          \
+        if (!thrown_)                                                                              \
+            ::blabber::test::fail(__FILE__, __LINE__, #expr " did not throw " #type ".");          \
+    } while (0)
+
+#endif // BLABBER_TESTS_TEST_HPP
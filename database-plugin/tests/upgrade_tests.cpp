@@ -0,0 +1,315 @@
+#include "test.hpp"
+
+#include "legacy_format.hpp"
+
+#include <prequel/container/default_allocator.hpp>
+#include <prequel/file_engine.hpp>
+#include <prequel/simple_file_format.hpp>
+#include <prequel/vfs.hpp>
+
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace blabber;
+using namespace blabber::test;
+
+// The version written by this build (see database::FILE_FORMAT_VERSION).
+static constexpr u32 current_version = 9;
+
+/*
+ * Returns the offset of the version number in the header of a database file,
+ * directly after the magic header.
+ */
+static std::streamoff version_offset() {
+    return static_cast<std::streamoff>(prequel::serialized_size<prequel::magic_header>());
+}
+
+// Reads the file format version (big endian) of a database file that is not in use.
+static u32 read_file_version(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    file.seekg(version_offset());
+    unsigned char bytes[4] = {};
+    file.read(reinterpret_cast<char*>(bytes), sizeof(bytes));
+    REQUIRE(file);
+    return (u32(bytes[0]) << 24) | (u32(bytes[1]) << 16) | (u32(bytes[2]) << 8) | u32(bytes[3]);
+}
+
+// Overwrites the file format version of a database file that is not in use.
+static void write_file_version(const std::string& path, u32 version) {
+    std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+    file.seekp(version_offset());
+    const unsigned char bytes[4] = {static_cast<unsigned char>(version >> 24),
+                                    static_cast<unsigned char>(version >> 16),
+                                    static_cast<unsigned char>(version >> 8),
+                                    static_cast<unsigned char>(version)};
+    file.write(reinterpret_cast<const char*>(bytes), sizeof(bytes));
+    REQUIRE(file);
+}
+
+// Fills a new database with posts and comments and returns its content.
+static std::map<u64, post_result> create_database(const std::string& path) {
+    database db(path, small_options());
+    for (u64 i = 0; i < 50; ++i) {
+        const std::string content = i % 5 == 0 ? std::string(3000, 'c') : "content";
+        const u64 id = db.create_post(fmt::format("user {}", i % 7), fmt::format("post {}", i),
+                                      content);
+        for (u64 c = 0; c < i % 4; ++c) {
+            const std::string comment = c == 0 ? fmt::format("needle{} comment", i)
+                                               : std::string(100, 'x');
+            REQUIRE(db.create_comment(id, fmt::format("user {}", c), comment));
+        }
+    }
+    std::map<u64, post_result> posts = read_posts(db);
+    db.finish();
+    return posts;
+}
+
+/*
+ * Version 8 has the layout of the current version, but its search index does not count the
+ * posts of every token. Such files are upgraded by copying all posts into a new file.
+ */
+TEST_CASE(upgrade_from_version_8) {
+    temp_dir dir;
+    const std::string path = dir.file("test.db");
+    const std::map<u64, post_result> expected = create_database(path);
+    REQUIRE(read_file_version(path) == current_version);
+    write_file_version(path, 8);
+
+    {
+        database db(path, small_options());
+        const std::optional<copy_stats>& stats = db.upgrade_stats();
+        REQUIRE(stats);
+        REQUIRE(stats->posts == expected.size());
+
+        u64 comments = 0;
+        for (const auto& entry : expected)
+            comments += entry.second.comments.size();
+        REQUIRE(stats->comments == comments);
+        REQUIRE(stats->adjusted_timestamps == 0);
+
+        const std::map<u64, post_result> posts = read_posts(db);
+        REQUIRE(posts.size() == expected.size());
+        for (const auto& [id, post] : expected) {
+            auto pos = posts.find(id);
+            REQUIRE(pos != posts.end());
+            REQUIRE(same_post(pos->second, post));
+        }
+
+        // The search index has been rebuilt.
+        const frontpage_result found = db.search("needle13", 10);
+        REQUIRE(found.entries.size() == 1);
+        REQUIRE(found.entries[0].title == "post 13");
+
+        // New posts continue after the copied ones.
+        REQUIRE(db.create_post("alice", "new", "content") == expected.rbegin()->first + 1);
+        db.finish();
+    }
+    REQUIRE(read_file_version(path) == current_version);
+
+    // The file is in the current format now.
+    database db(path, small_options());
+    REQUIRE(!db.upgrade_stats());
+    db.finish();
+}
+
+/*
+ * The layout of the first block of a version 7 file. It is spelled out here (instead of using
+ * v7::reader::anchor) so that the test also checks the layout assumed by the v7 reader.
+ * The indexes are left empty because the upgrade only reads the posts.
+ */
+namespace {
+
+struct v7_anchor {
+    using post_tree = prequel::btree<v7::post, prequel::indexed_by_member<&v7::post::id>>;
+    using activity_tree = prequel::btree<activity_entry, activity_entry::key>;
+    using user_tree = prequel::btree<user_activity_entry, user_activity_entry::key>;
+
+    u64 next_post_id = 1;
+    post_tree::anchor posts;
+    prequel::heap::anchor strings;
+    activity_tree::anchor activity;
+    search_index::anchor search;
+    user_tree::anchor users;
+    user_dictionary::anchor user_names;
+
+    static constexpr auto get_binary_format() {
+        return prequel::binary_format(&v7_anchor::next_post_id, &v7_anchor::posts,
+                                      &v7_anchor::strings, &v7_anchor::activity,
+                                      &v7_anchor::search, &v7_anchor::users,
+                                      &v7_anchor::user_names);
+    }
+};
+
+struct v7_master_block {
+    prequel::magic_header magic;
+    u32 version = 0;
+    prequel::default_allocator::anchor alloc;
+    v7_anchor store;
+
+    static constexpr auto get_binary_format() {
+        return prequel::binary_format(&v7_master_block::magic, &v7_master_block::version,
+                                      &v7_master_block::alloc, &v7_master_block::store);
+    }
+};
+
+} // namespace
+
+// Stores the string on the heap (uncompressed). Empty strings are not stored.
+static heap_string store_v7_string(prequel::heap& strings, const std::string& str) {
+    heap_string result;
+    if (!str.empty()) {
+        result.data = strings.allocate(reinterpret_cast<const byte*>(str.data()), str.size());
+        result.size = static_cast<u32>(str.size());
+    }
+    return result;
+}
+
+template<u32 Capacity>
+static optimized_string<Capacity> store_v7_string(prequel::heap& strings,
+                                                  const std::string& str) {
+    if (str.size() <= Capacity)
+        return prequel::fixed_cstring<Capacity>(str);
+    return store_v7_string(strings, str);
+}
+
+/*
+ * Writes a version 7 database file (every post with its own list of comments) with the
+ * given posts. Comments of the posts must be newest first, like query results.
+ */
+static void create_v7_database(const std::string& path, const std::map<u64, post_result>& posts) {
+    auto& vfs = prequel::system_vfs();
+    std::unique_ptr<prequel::file> file = vfs.open(path.c_str(), vfs.read_write, vfs.open_create);
+    prequel::file_engine engine(*file, database::BLOCK_SIZE, 64);
+    engine.grow(1);
+
+    v7_master_block master;
+    master.magic = prequel::magic_header("BLABBER_DB");
+    master.version = 7;
+    {
+        prequel::anchor_flag changed;
+        prequel::anchor_handle anchor(master, changed);
+        prequel::default_allocator alloc(anchor.member<&v7_master_block::alloc>(), engine);
+        auto store = anchor.member<&v7_master_block::store>();
+
+        v7_anchor::post_tree post_tree(store.member<&v7_anchor::posts>(), alloc);
+        prequel::heap strings(store.member<&v7_anchor::strings>(), alloc);
+        user_dictionary users(store.member<&v7_anchor::user_names>(), alloc, strings, nullptr);
+
+        for (const auto& [id, expected] : posts) {
+            v7::post p;
+            p.id = id;
+            p.created_at = expected.created_at;
+            p.user_id = users.intern(expected.user);
+            p.title = store_v7_string<31>(strings, expected.title);
+            p.content = store_v7_string(strings, expected.content);
+            p.comment_count = expected.comment_count;
+            p.last_comment_at = expected.last_comment_at;
+
+            prequel::anchor_flag post_changed;
+            prequel::list<v7::comment> comments(prequel::anchor_handle(p.comments, post_changed),
+                                                alloc);
+            for (auto c = expected.comments.rbegin(); c != expected.comments.rend(); ++c) {
+                v7::comment entry;
+                entry.created_at = c->created_at;
+                entry.user_id = users.intern(c->user);
+                entry.content = store_v7_string<comment_inline_capacity>(strings, c->content);
+                comments.push_back(entry);
+            }
+            REQUIRE(post_tree.insert(p).inserted);
+        }
+        store.set<&v7_anchor::next_post_id>(posts.rbegin()->first + 1);
+    }
+    engine.overwrite_zero(prequel::block_index(0)).set(0, master);
+    engine.flush();
+}
+
+/*
+ * Version 7 stored the comments of every post in a list of its own, version 8 moved them into
+ * a single comment tree. Upgraded files contain the same posts and comments, and comment
+ * pages can be fetched by position.
+ */
+TEST_CASE(upgrade_from_version_7) {
+    std::map<u64, post_result> expected;
+    u64 now = 1000;
+    for (u64 id = 1; id <= 40; ++id) {
+        post_result& post = expected[id];
+        post.id = id;
+        post.created_at = now++;
+        post.user = id % 3 == 0 ? std::string(40, 'u') : fmt::format("user {}", id % 5);
+        post.title = id % 4 == 0 ? fmt::format("long title {} {}", id, std::string(40, 't'))
+                                 : fmt::format("post {}", id);
+        post.content = id % 10 == 0 ? std::string() : fmt::format("content {}", id);
+        for (u64 c = 0; c < id % 4 * 30; ++c) {
+            const std::string content = c % 7 == 0 ? std::string(100, 'x')
+                                                   : fmt::format("comment {}", c);
+            post.comments.insert(post.comments.begin(),
+                                 {now++, fmt::format("user {}", c % 6), content});
+        }
+        post.comment_count = post.comments.size();
+        post.last_comment_at = post.comments.empty() ? 0 : post.comments.front().created_at;
+    }
+
+    temp_dir dir;
+    const std::string path = dir.file("test.db");
+    create_v7_database(path, expected);
+    REQUIRE(read_file_version(path) == 7);
+
+    {
+        database db(path, small_options());
+        const std::optional<copy_stats>& stats = db.upgrade_stats();
+        REQUIRE(stats);
+        REQUIRE(stats->posts == expected.size());
+
+        u64 comments = 0;
+        for (const auto& entry : expected)
+            comments += entry.second.comments.size();
+        REQUIRE(stats->comments == comments);
+        REQUIRE(stats->adjusted_timestamps == 0);
+
+        const std::map<u64, post_result> posts = read_posts(db);
+        REQUIRE(posts.size() == expected.size());
+        for (const auto& [id, post] : expected) {
+            auto pos = posts.find(id);
+            REQUIRE(pos != posts.end());
+            REQUIRE(same_post(pos->second, post));
+        }
+
+        // Comment pages are addressed by the position of the comments.
+        const post_result& post = expected.at(3);
+        std::vector<post_result::comment_entry> paged;
+        std::optional<u64> before;
+        while (1) {
+            auto page = db.fetch_comments(post.id, before, 7);
+            REQUIRE(page);
+            paged.insert(paged.end(), page->comments.begin(), page->comments.end());
+            if (!page->next_before)
+                break;
+            before = page->next_before;
+        }
+        REQUIRE(paged.size() == post.comments.size());
+        for (size_t i = 0; i < paged.size(); ++i)
+            REQUIRE(paged[i].content == post.comments[i].content);
+
+        REQUIRE(db.create_comment(post.id, "alice", "new comment"));
+        auto updated = db.fetch_post(post.id, 1);
+        REQUIRE(updated && updated->comment_count == post.comment_count + 1);
+        REQUIRE(updated->comments.front().content == "new comment");
+        db.finish();
+    }
+    REQUIRE(read_file_version(path) == current_version);
+}
+
+/*
+ * Files written by a newer version are rejected without being modified.
+ */
+TEST_CASE(upgrade_rejects_newer_versions) {
+    temp_dir dir;
+    const std::string path = dir.file("test.db");
+    create_database(path);
+    write_file_version(path, current_version + 1);
+
+    REQUIRE_THROWS_AS(database db(path, small_options()), std::runtime_error);
+    REQUIRE(read_file_version(path) == current_version + 1);
+}
@@ -0,0 +1,225 @@
+#!/usr/bin/env python3
+
+# Generates HTTP load against a running instance of app.py and reports
+# throughput, latency percentiles and the depth of the database queue.
+#
+# Post popularity follows a Zipf distribution (the newest posts are the most popular ones).
+# Read requests fetch the front page or a post, write requests create comments or posts.
+#
+# Usage: ./loadgen.py [--url http://localhost:8080] [--duration 30] [--concurrency 64] ...
+
+import aiohttp
+import argparse
+import asyncio
+import bisect
+import itertools
+import random
+import re
+import sys
+import time
+
+POST_LINK = re.compile(r'/post/(\d+)"')
+WORDS = ("the quick brown fox jumps over the lazy dog database storage block cache journal "
+         "commit post comment reply thread latency throughput disk memory index tree heap "
+         "hello world agree disagree because however maybe").split()
+
+
+class Zipf:
+    """Samples ranks in [0, n) with probability proportional to 1 / (rank + 1)^s."""
+
+    def __init__(self, n, s, rng):
+        self._rng = rng
+        self._cumulative = list(itertools.accumulate(1.0 / (k ** s) for k in range(1, n + 1)))
+
+    def sample(self):
+        value = self._rng.random() * self._cumulative[-1]
+        return min(bisect.bisect_left(self._cumulative, value), len(self._cumulative) - 1)
+
+
+class Stats:
+    def __init__(self):
+        self.latencies = dict()  # operation -> list of seconds
+        self.errors = dict()     # operation -> count
+        self.pending = []        # sampled queue depth
+        self.pending_max = 0
+
+    def record(self, op, seconds):
+        self.latencies.setdefault(op, []).append(seconds)
+
+    def error(self, op):
+        self.errors[op] = self.errors.get(op, 0) + 1
+
+
+def percentile(sorted_values, p):
+    if not sorted_values:
+        return 0.0
+    return sorted_values[min(len(sorted_values) - 1, int(p * len(sorted_values)))]
+
+
+def text(rng, min_words, max_words):
+    return " ".join(rng.choice(WORDS) for _ in range(rng.randint(min_words, max_words)))
+
+
+async def discover_posts(session, url):
+    async with session.get(url + "/") as response:
+        html = await response.text()
+    ids = [int(match) for match in POST_LINK.findall(html)]
+    return max(ids) if ids else 0
+
+
+async def create_post(session, url, rng):
+    data = {
+        "user": "loadgen{}".format(rng.randint(0, 999)),
+        "title": text(rng, 2, 6),
+        "content": text(rng, 20, 400),
+    }
+    async with session.post(url + "/post", data = data, allow_redirects = False) as response:
+        await response.read()
+        if response.status != 302:
+            raise RuntimeError("Unexpected status {}".format(response.status))
+        return int(response.headers["Location"].rsplit("/", 1)[1])
+
+
+async def worker(session, args, deadline, post_ids, stats, rng):
+    zipf = Zipf(args.popular_posts, args.zipf, rng)
+
+    def pick_post():
+        # Rank 0 is the newest post.
+        newest = post_ids[-1]
+        return max(1, newest - zipf.sample())
+
+    while time.monotonic() < deadline:
+        start = time.monotonic()
+        if rng.random() < args.write_ratio:
+            if rng.random() < args.post_share:
+                op = "create_post"
+            else:
+                op = "create_comment"
+        else:
+            op = "index" if rng.random() < args.index_share else "show_post"
+
+        try:
+            if op == "index":
+                async with session.get(args.url + "/") as response:
+                    await response.read()
+                    ok = response.status == 200
+            elif op == "show_post":
+                async with session.get("{}/post/{}".format(args.url, pick_post())) as response:
+                    await response.read()
+                    ok = response.status == 200
+            elif op == "create_comment":
+                data = {
+                    "user": "loadgen{}".format(rng.randint(0, 999)),
+                    "content": text(rng, 1, 60),
+                }
+                post_url = "{}/post/{}/comment".format(args.url, pick_post())
+                async with session.post(post_url, data = data, allow_redirects = False) as response:
+                    await response.read()
+                    ok = response.status == 302
+            else:
+                post_id = await create_post(session, args.url, rng)
+                post_ids[-1] = max(post_ids[-1], post_id)
+                ok = True
+        except (aiohttp.ClientError, RuntimeError, asyncio.TimeoutError):
+            ok = False
+
+        if ok:
+            stats.record(op, time.monotonic() - start)
+        else:
+            stats.error(op)
+
+
+async def sample_pending(session, args, deadline, stats):
+    while time.monotonic() < deadline:
+        try:
+            async with session.get(args.url + "/stats") as response:
+                result = await response.json()
+            stats.pending.append(result["pending"])
+            stats.pending_max = max(stats.pending_max, result["pending_max"])
+        except (aiohttp.ClientError, ValueError, KeyError):
+            pass
+        await asyncio.sleep(args.sample_interval)
+
+
+def report(args, stats, seconds):
+    total = sum(len(values) for values in stats.latencies.values())
+    print("duration:     {:.1f} s".format(seconds))
+    print("concurrency:  {}".format(args.concurrency))
+    print("requests:     {} ({:.0f} per second)".format(total, total / seconds))
+    print()
+    print("{:<16}{:>10}{:>10}{:>10}{:>10}{:>10}{:>10}{:>8}".format(
+        "operation", "count", "req/s", "p50 ms", "p90 ms", "p99 ms", "max ms", "errors"))
+    for op in ("index", "show_post", "create_comment", "create_post"):
+        values = sorted(stats.latencies.get(op, []))
+        errors = stats.errors.get(op, 0)
+        if not values and not errors:
+            continue
+        print("{:<16}{:>10}{:>10.0f}{:>10.2f}{:>10.2f}{:>10.2f}{:>10.2f}{:>8}".format(
+            op, len(values), len(values) / seconds,
+            percentile(values, 0.50) * 1000, percentile(values, 0.90) * 1000,
+            percentile(values, 0.99) * 1000, (values[-1] if values else 0) * 1000, errors))
+    print()
+    if stats.pending:
+        print("db queue:     mean {:.1f}, max {} ({} samples)".format(
+            sum(stats.pending) / len(stats.pending), stats.pending_max, len(stats.pending)))
+    else:
+        print("db queue:     no samples (is /stats available?)")
+
+
+async def run(args):
+    rng = random.Random(args.seed)
+    timeout = aiohttp.ClientTimeout(total = args.timeout)
+    connector = aiohttp.TCPConnector(limit = args.concurrency + 1)
+    async with aiohttp.ClientSession(timeout = timeout, connector = connector) as session:
+        newest = await discover_posts(session, args.url)
+        for _ in range(max(0, args.seed_posts - newest)):
+            newest = await create_post(session, args.url, rng)
+        if newest == 0:
+            print("The database has no posts, use --seed-posts to create some.", file = sys.stderr)
+            return 1
+
+        # Shared between the workers, the last element is the id of the newest post.
+        post_ids = [newest]
+        stats = Stats()
+
+        start = time.monotonic()
+        deadline = start + args.duration
+        tasks = [worker(session, args, deadline, post_ids, stats, random.Random(rng.random()))
+                 for _ in range(args.concurrency)]
+        tasks.append(sample_pending(session, args, deadline, stats))
+        await asyncio.gather(*tasks)
+
+        report(args, stats, time.monotonic() - start)
+        return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description = "Generate HTTP load against app.py.")
+    parser.add_argument("--url", default = "http://localhost:8080", help = "base url of the app")
+    parser.add_argument("--duration", type = float, default = 30, help = "seconds to run")
+    parser.add_argument("--concurrency", type = int, default = 64,
+                        help = "number of concurrent clients")
+    parser.add_argument("--write-ratio", type = float, default = 0.1,
+                        help = "fraction of requests that write")
+    parser.add_argument("--post-share", type = float, default = 0.05,
+                        help = "fraction of writes that create posts (the rest are comments)")
+    parser.add_argument("--index-share", type = float, default = 0.2,
+                        help = "fraction of reads that fetch the front page")
+    parser.add_argument("--zipf", type = float, default = 1.1,
+                        help = "exponent of the post popularity distribution")
+    parser.add_argument("--popular-posts", type = int, default = 10000,
+                        help = "number of posts (newest first) that receive traffic")
+    parser.add_argument("--seed-posts", type = int, default = 0,
+                        help = "create posts until the database contains at least this many")
+    parser.add_argument("--sample-interval", type = float, default = 0.5,
+                        help = "seconds between samples of the database queue")
+    parser.add_argument("--timeout", type = float, default = 30, help = "request timeout (s)")
+    parser.add_argument("--seed", type = int, default = 1, help = "random seed")
+    args = parser.parse_args()
+
+    loop = asyncio.get_event_loop()
+    sys.exit(loop.run_until_complete(run(args)))
+
+
+if __name__ == "__main__":
+    main()